@@ -0,0 +1,220 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <dlfcn.h>
+#include <vector>
+
+namespace hal::linux::bench {
+
+/// Summary of one benchmark case
+struct result
+{
+  const char* name = "";
+  std::size_t iterations = 0;
+  /// Operations timed together per sample
+  std::size_t batch = 1;
+  double mean_ns = 0.0;
+  double p50_ns = 0.0;
+  double p90_ns = 0.0;
+  double p99_ns = 0.0;
+  /// Negative when the ioctl shim is not preloaded
+  double syscalls_per_op = -1.0;
+};
+
+/**
+ * @brief Times operations and reports latency percentiles and the number of
+ * intercepted syscalls per operation.
+ *
+ * Each sample times a batch of back to back operations and divides by the
+ * batch size, which is picked so that reading the clock twice costs at most
+ * about 2% of a sample. Percentiles are therefore over batch means. Cases
+ * with a setup step are timed one operation per sample, so their figures
+ * include one clock_overhead_ns(). Nothing is subtracted from the samples.
+ *
+ * Syscalls are only counted when benchmarks/ioctl_shim.cpp is preloaded, and
+ * only those of the calling thread. The counter is looked up at runtime so the
+ * benchmark also runs without the shim.
+ */
+class runner
+{
+public:
+  runner()
+    : m_syscalls(reinterpret_cast<counter_function>(
+        dlsym(RTLD_DEFAULT, "hal_bench_syscalls")))
+  {
+    std::vector<std::int64_t> samples(10'000);
+    for (auto& sample : samples) {
+      const auto start = clock::now();
+      sample = (clock::now() - start).count();
+    }
+    std::sort(samples.begin(), samples.end());
+    m_overhead_ns = samples[samples.size() / 2];
+  }
+
+  /// Whether syscalls are being counted
+  bool counting() const
+  {
+    return m_syscalls != nullptr;
+  }
+
+  /// Median cost of the two clock reads around a sample
+  std::int64_t clock_overhead_ns() const
+  {
+    return m_overhead_ns;
+  }
+
+  /**
+   * @brief Run p_operation p_iterations times after a short warm up, one
+   * operation per sample.
+   * @param p_name Name printed in the report.
+   * @param p_iterations Number of timed calls.
+   * @param p_operation Operation to measure.
+   * @param p_setup Untimed preparation run before every call, its syscalls
+   * are not counted either.
+   */
+  template<typename Operation, typename Setup>
+  result run(const char* p_name,
+             std::size_t p_iterations,
+             Operation&& p_operation,
+             Setup&& p_setup)
+  {
+    for (std::size_t i = 0; i < warm_up(p_iterations); i++) {
+      p_setup();
+      p_operation();
+    }
+    return measure(p_name, p_iterations, 1, p_operation, p_setup);
+  }
+
+  /**
+   * @brief Run p_operation p_iterations times after a short warm up, in
+   * batches long enough to make the cost of reading the clock negligible.
+   * @param p_name Name printed in the report.
+   * @param p_iterations Number of timed calls.
+   * @param p_operation Operation to measure.
+   */
+  template<typename Operation>
+  result run(const char* p_name,
+             std::size_t p_iterations,
+             Operation&& p_operation)
+  {
+    const auto warm_ups = std::max<std::size_t>(warm_up(p_iterations), 1);
+    const auto start = clock::now();
+    for (std::size_t i = 0; i < warm_ups; i++) {
+      p_operation();
+    }
+    const auto warm_up_ns = (clock::now() - start).count();
+    const auto operation_ns = std::max<double>(
+      static_cast<double>(warm_up_ns) / static_cast<double>(warm_ups), 0.1);
+
+    // Keep at least 100 samples for the percentiles
+    const auto wanted = static_cast<std::size_t>(
+      50.0 * static_cast<double>(m_overhead_ns) / operation_ns);
+    const auto batch = std::clamp<std::size_t>(
+      wanted, 1, std::max<std::size_t>(p_iterations / 100, 1));
+    return measure(p_name, p_iterations, batch, p_operation, [] {});
+  }
+
+  void print_header() const
+  {
+    std::printf("clock overhead %lld ns per sample, not subtracted\n",
+                static_cast<long long>(m_overhead_ns));
+    std::printf("%-40s %10s %10s %10s %10s %10s %8s\n",
+                "benchmark",
+                "ns/op",
+                "p50",
+                "p90",
+                "p99",
+                "syscalls",
+                "batch");
+  }
+
+  static void print(const result& p_result)
+  {
+    std::printf("%-40s %10.1f %10.1f %10.1f %10.1f ",
+                p_result.name,
+                p_result.mean_ns,
+                p_result.p50_ns,
+                p_result.p90_ns,
+                p_result.p99_ns);
+    if (p_result.syscalls_per_op < 0) {
+      std::printf("%10s", "n/a");
+    } else {
+      std::printf("%10.2f", p_result.syscalls_per_op);
+    }
+    std::printf(" %8zu\n", p_result.batch);
+  }
+
+private:
+  using clock = std::chrono::steady_clock;
+  using counter_function = unsigned long long (*)();
+
+  static std::size_t warm_up(std::size_t p_iterations)
+  {
+    return std::min<std::size_t>(p_iterations, 1000);
+  }
+
+  template<typename Operation, typename Setup>
+  result measure(const char* p_name,
+                 std::size_t p_iterations,
+                 std::size_t p_batch,
+                 Operation&& p_operation,
+                 Setup&& p_setup)
+  {
+    const auto count = std::max<std::size_t>(p_iterations / p_batch, 1);
+    std::vector<double> samples(count);
+    unsigned long long calls = 0;
+    for (auto& sample : samples) {
+      p_setup();
+      const auto calls_before = syscalls();
+      const auto start = clock::now();
+      for (std::size_t i = 0; i < p_batch; i++) {
+        p_operation();
+      }
+      const auto end = clock::now();
+      calls += syscalls() - calls_before;
+      sample = static_cast<double>((end - start).count()) /
+               static_cast<double>(p_batch);
+    }
+
+    const auto operations = samples.size() * p_batch;
+    result summary{
+      .name = p_name,
+      .iterations = operations,
+      .batch = p_batch,
+    };
+    double total = 0.0;
+    for (const auto sample : samples) {
+      total += sample;
+    }
+    summary.mean_ns = total / static_cast<double>(samples.size());
+    std::sort(samples.begin(), samples.end());
+    summary.p50_ns = percentile(samples, 0.50);
+    summary.p90_ns = percentile(samples, 0.90);
+    summary.p99_ns = percentile(samples, 0.99);
+    if (counting()) {
+      summary.syscalls_per_op =
+        static_cast<double>(calls) / static_cast<double>(operations);
+    }
+    print(summary);
+    return summary;
+  }
+
+  unsigned long long syscalls() const
+  {
+    return m_syscalls ? m_syscalls() : 0;
+  }
+
+  static double percentile(const std::vector<double>& p_sorted,
+                           double p_fraction)
+  {
+    const auto index = static_cast<std::size_t>(
+      p_fraction * static_cast<double>(p_sorted.size() - 1));
+    return p_sorted[index];
+  }
+
+  counter_function m_syscalls;
+  std::int64_t m_overhead_ns = 0;
+};
+}  // namespace hal::linux::bench
@@ -0,0 +1,327 @@
+// Copyright 2024 Khalil Estell
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Per call cost of the drivers, without any hardware attached.
+//
+// GPIO and i2c run against the simulated devices of ioctl_shim.cpp, so their
+// numbers are the driver's own overhead plus one trip through the shim. Serial
+// runs over a pseudo terminal. Build the run_benchmarks target to run with the
+// shim preloaded, or preload it by hand:
+//
+//   LD_PRELOAD=./libhal_bench_shim.so ./linux_demos_benchmark
+//
+// The sim/ cases run the same drivers on hal::linux::simulated_syscalls, which
+// never enters the kernel and so needs neither the shim nor a terminal.
+
+#include "../include/libhal-linux/deferred_log.hpp"
+#include "../include/libhal-linux/i2c.hpp"
+#include "../include/libhal-linux/input_pin.hpp"
+#include "../include/libhal-linux/instrumentation.hpp"
+#include "../include/libhal-linux/output_pin.hpp"
+#include "../include/libhal-linux/output_port.hpp"
+#include "../include/libhal-linux/register_cache.hpp"
+#include "../include/libhal-linux/serial.hpp"
+#include "../include/libhal-linux/simulated_kernel.hpp"
+#include "../include/libhal-linux/steady_clock.hpp"
+#include "bench.hpp"
+#include "simulated_devices.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+using namespace hal::linux;
+
+namespace {
+constexpr std::size_t iterations = 100'000;
+constexpr std::size_t io_iterations = 20'000;
+
+// Keeps results alive so the optimizer cannot drop the calls
+volatile std::uint64_t sink = 0;
+
+// What the drivers recorded themselves, when built with
+// HAL_LINUX_INSTRUMENTATION=1. Drivers are only listed while alive.
+void print_driver_stats()
+{
+  for (const auto& [name, counters] : driver_stats::snapshot_all()) {
+    std::printf("  %-30s ops %9llu  bytes %10llu  errors %llu  "
+                "p50 < %llu ns  p99 < %llu ns\n",
+                name.c_str(),
+                static_cast<unsigned long long>(counters.operations),
+                static_cast<unsigned long long>(counters.bytes),
+                static_cast<unsigned long long>(counters.errors),
+                static_cast<unsigned long long>(
+                  counters.latency_percentile_ns(0.50)),
+                static_cast<unsigned long long>(
+                  counters.latency_percentile_ns(0.99)));
+  }
+}
+
+void clock_benchmarks(bench::runner& p_runner)
+{
+  auto chrono_clock = steady_clock<std::chrono::steady_clock>();
+  auto raw_clock = raw_steady_clock();
+  auto counter_clock = raw_steady_clock(true);
+
+  p_runner.run("clock/std::chrono::steady_clock::now", iterations, [] {
+    sink = std::chrono::steady_clock::now().time_since_epoch().count();
+  });
+  p_runner.run("clock/steady_clock::uptime", iterations, [&] {
+    sink = chrono_clock.uptime();
+  });
+  p_runner.run("clock/raw_steady_clock::uptime", iterations, [&] {
+    sink = raw_clock.uptime();
+  });
+  p_runner.run(counter_clock.uses_counter()
+                 ? "clock/raw_steady_clock(counter)::uptime"
+                 : "clock/raw_steady_clock(no counter)::uptime",
+               iterations,
+               [&] { sink = counter_clock.uptime(); });
+}
+
+void log_benchmarks(bench::runner& p_runner)
+{
+  auto log = deferred_log(4096);
+  const auto device = deferred_log::device_id("/dev/bench");
+  p_runner.run("log/deferred_log::record", iterations, [&] {
+    log.record(log_level::error, log_event::i2c_write, device, 0x68, EIO);
+  });
+  log.minimum_level(log_level::error);
+  p_runner.run("log/deferred_log::record(filtered)", iterations, [&] {
+    log.record(log_level::debug, log_event::i2c_write, device, 0x68, EIO);
+  });
+  p_runner.run("log/deferred_log::drain(1)", iterations, [&] {
+    log.record(log_level::error, log_event::i2c_write, device, 0x68, EIO);
+    log.drain([](const log_record& p_record) { sink = p_record.argument; });
+  });
+}
+
+void gpio_benchmarks(bench::runner& p_runner)
+{
+  auto pin = output_pin(bench::simulated_gpio_chip, 1);
+  auto input = input_pin(bench::simulated_gpio_chip, 2);
+  const std::array<std::uint16_t, 8> lines = { 8, 9, 10, 11, 12, 13, 14, 15 };
+  auto port = output_port(bench::simulated_gpio_chip, lines);
+
+  bool level = false;
+  p_runner.run("gpio/output_pin::level(toggle)", iterations, [&] {
+    level = !level;
+    pin.level(level);
+  });
+  p_runner.run("gpio/output_pin::level()", iterations, [&] {
+    sink = pin.level();
+  });
+  pin.cache_level(true);
+  p_runner.run("gpio/output_pin::level(same, cached)", iterations, [&] {
+    pin.level(true);
+  });
+  p_runner.run("gpio/output_pin::level(), cached", iterations, [&] {
+    sink = pin.level();
+  });
+  p_runner.run("gpio/input_pin::level()", iterations, [&] {
+    sink = input.level();
+  });
+  std::uint64_t bits = 0;
+  p_runner.run("gpio/output_port::level(8 lines)", iterations, [&] {
+    port.level(bits++);
+  });
+  print_driver_stats();
+}
+
+void i2c_benchmarks(bench::runner& p_runner)
+{
+  auto bus = i2c(bench::simulated_i2c_bus);
+  const std::array<hal::byte, 1> select = { 0x3B };
+  std::array<hal::byte, 6> sample{};
+
+  p_runner.run("i2c/write_then_read(1, 6)", iterations, [&] {
+    bus.transaction(0x68, select, sample, [] {});
+  });
+  const std::array<hal::byte, 2> command = { 0x6B, 0x00 };
+  p_runner.run("i2c/write(2)", iterations, [&] {
+    bus.transaction(0x68, command, {}, [] {});
+  });
+  p_runner.run("i2c/read_register", iterations, [&] {
+    sink = bus.read_register(0x68, 0x75);
+  });
+
+  i2c_batch batch;
+  std::array<std::array<hal::byte, 6>, 6> readings{};
+  p_runner.run("i2c/transfer(6 device batch)", iterations, [&] {
+    batch.clear();
+    for (std::size_t i = 0; i < readings.size(); i++) {
+      batch.read(static_cast<std::uint16_t>(0x40 + i), readings[i]);
+    }
+    bus.transfer(batch);
+  });
+
+  auto registers = register_cache(bus, 0x68);
+  p_runner.run("i2c/register_cache::read(cached)", iterations, [&] {
+    sink = registers.read(0x1B);
+  });
+  p_runner.run("i2c/register_cache::update_bits", iterations, [&] {
+    registers.update_bits(0x1B, 0x18, 0x08);
+  });
+  print_driver_stats();
+}
+
+void serial_benchmarks(bench::runner& p_runner)
+{
+  int controller = -1;
+  int device = -1;
+  std::array<char, 64> name{};
+  if (openpty(&controller, &device, name.data(), nullptr, nullptr) < 0) {
+    std::printf("serial: skipped, no pseudo terminal available\n");
+    return;
+  }
+  auto port = serial(name.data());
+  port.configure_latency({ .low_latency = false });
+
+  // Keep the terminal from filling up while writes are measured
+  std::atomic<bool> draining = true;
+  auto drain = std::thread([&] {
+    std::array<hal::byte, 4096> discard;
+    pollfd readable{ .fd = controller, .events = POLLIN, .revents = 0 };
+    while (draining) {
+      if (poll(&readable, 1, 10) > 0) {
+        [[maybe_unused]] auto res =
+          ::read(controller, discard.data(), discard.size());
+      }
+    }
+  });
+
+  std::array<hal::byte, 64> frame{};
+  frame.fill('x');
+  p_runner.run("serial/write(64)", io_iterations, [&] { port.write(frame); });
+  draining = false;
+  drain.join();
+
+  std::array<hal::byte, 64> received{};
+  const auto send_frame = [&] {
+    // Terminal input is delivered asynchronously, wait until it arrived
+    [[maybe_unused]] auto res = ::write(controller, frame.data(), 64);
+    pollfd readable{ .fd = port.native_handle(),
+                    .events = POLLIN,
+                    .revents = 0 };
+    poll(&readable, 1, 100);
+  };
+  p_runner.run(
+    "serial/read(64)",
+    io_iterations,
+    [&] { sink = port.read(received).data.size(); },
+    send_frame);
+
+  // Same reads teed into a capture file, no syscall added
+  const std::string capture_path = "/tmp/hal_benchmark_capture.bin";
+  port.enable_capture(capture_path, 256 * 1024);
+  p_runner.run(
+    "serial/read(64), captured",
+    io_iterations,
+    [&] { sink = port.read(received).data.size(); },
+    send_frame);
+  p_runner.run(
+    "serial/read_in_place(64), captured",
+    io_iterations,
+    [&] { sink = port.read_in_place(64).size(); },
+    send_frame);
+  unlink(capture_path.c_str());
+  print_driver_stats();
+  close(controller);
+  close(device);
+}
+
+void simulated_benchmarks(bench::runner& p_runner)
+{
+  using sim = simulated_syscalls;
+  auto& kernel = simulated_kernel::instance();
+  kernel.add_gpio_chip("/sim/gpiochip0");
+  kernel.add_i2c_bus("/sim/i2c-1");
+  kernel.add_i2c_device("/sim/i2c-1", 0x68);
+  kernel.add_tty("/sim/ttyS0");
+
+  {
+    auto pin = basic_output_pin<sim>("/sim/gpiochip0", 1);
+    auto input = basic_input_pin<sim>("/sim/gpiochip0", 2);
+    bool level = false;
+    p_runner.run("sim/gpio/output_pin::level(toggle)", iterations, [&] {
+      level = !level;
+      pin.level(level);
+    });
+    p_runner.run("sim/gpio/input_pin::level()", iterations, [&] {
+      sink = input.level();
+    });
+  }
+
+  {
+    auto bus = basic_i2c<sim>("/sim/i2c-1");
+    const std::array<hal::byte, 1> select = { 0x3B };
+    std::array<hal::byte, 6> sample{};
+    p_runner.run("sim/i2c/write_then_read(1, 6)", iterations, [&] {
+      bus.transaction(0x68, select, sample, [] {});
+    });
+  }
+
+  {
+    auto port = basic_serial<sim>("/sim/ttyS0");
+    kernel.tty_loopback("/sim/ttyS0", true);
+    std::array<hal::byte, 64> frame{};
+    std::array<hal::byte, 64> received{};
+    p_runner.run("sim/serial/write(64) + read(64)", iterations, [&] {
+      port.write(frame);
+      sink = port.read(received).data.size();
+    });
+  }
+  print_driver_stats();
+  kernel.reset();
+}
+
+template<typename F>
+void run_group(const char* p_name, F&& p_group)
+{
+  try {
+    p_group();
+  } catch (const hal::exception& p_error) {
+    std::printf("%s: skipped, error %d\n",
+                p_name,
+                static_cast<int>(p_error.error_code()));
+  }
+}
+}  // namespace
+
+int main()
+{
+  bench::runner runner;
+  if (!runner.counting()) {
+    std::printf("ioctl shim not preloaded: syscalls are not counted and the "
+                "gpio and i2c cases are skipped\n");
+  }
+  runner.print_header();
+  clock_benchmarks(runner);
+  log_benchmarks(runner);
+  if (runner.counting()) {
+    run_group("gpio", [&] { gpio_benchmarks(runner); });
+    run_group("i2c", [&] { i2c_benchmarks(runner); });
+  }
+  run_group("serial", [&] { serial_benchmarks(runner); });
+  run_group("sim", [&] { simulated_benchmarks(runner); });
+  return 0;
+}
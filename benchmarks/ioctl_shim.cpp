@@ -0,0 +1,273 @@
+// LD_PRELOAD library that stands in for the GPIO and i2c character devices so
+// the drivers can be benchmarked on any Linux machine.
+//
+// The paths in simulated_devices.hpp open as eventfds, which gives them real,
+// closable file descriptors. ioctls on those descriptors are answered here
+// without entering the kernel, every other descriptor is passed through.
+// Each intercepted call is counted, simulated or not, per calling thread. The
+// count is exported as hal_bench_syscalls() for the benchmark to find with
+// dlsym.
+
+#include "simulated_devices.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
+#include <cstring>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <linux/gpio.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+enum class device : std::uint8_t
+{
+  none,
+  gpio_chip,
+  gpio_lines,
+  i2c_bus,
+};
+
+constexpr int max_fds = 4096;
+
+// Per thread, so helper threads do not show up in the numbers of the thread
+// being measured
+thread_local unsigned long long syscalls = 0;
+std::array<std::atomic<device>, max_fds> devices{};
+// Line levels of every simulated line request, by file descriptor
+std::array<std::atomic<std::uint64_t>, max_fds> line_values{};
+
+using open_function = int (*)(const char*, int, ...);
+using close_function = int (*)(int);
+using ioctl_function = int (*)(int, unsigned long, ...);
+using read_function = ssize_t (*)(int, void*, size_t);
+using write_function = ssize_t (*)(int, const void*, size_t);
+using writev_function = ssize_t (*)(int, const iovec*, int);
+
+// The libc definition a wrapper forwards to, looked up once per wrapper
+template<typename F>
+F next(const char* p_name)
+{
+  return reinterpret_cast<F>(dlsym(RTLD_NEXT, p_name));
+}
+
+int real_close(int p_fd)
+{
+  static const auto function = next<close_function>("close");
+  return function(p_fd);
+}
+
+device device_of(int p_fd)
+{
+  if (p_fd < 0 || p_fd >= max_fds) {
+    return device::none;
+  }
+  return devices[p_fd].load(std::memory_order_relaxed);
+}
+
+int open_simulated(device p_device)
+{
+  const int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (fd >= max_fds) {
+    real_close(fd);
+    errno = EMFILE;
+    return -1;
+  }
+  if (fd >= 0) {
+    devices[fd].store(p_device, std::memory_order_relaxed);
+  }
+  return fd;
+}
+
+// The mode argument is only there when the file may be created
+mode_t creation_mode(int p_flags, va_list p_args)
+{
+  if ((p_flags & O_CREAT) || (p_flags & O_TMPFILE) == O_TMPFILE) {
+    return static_cast<mode_t>(va_arg(p_args, int));
+  }
+  return 0;
+}
+
+int open_path(const char* p_path,
+              int p_flags,
+              mode_t p_mode,
+              open_function p_real)
+{
+  syscalls++;
+  if (std::strcmp(p_path, hal::linux::bench::simulated_gpio_chip) == 0) {
+    return open_simulated(device::gpio_chip);
+  }
+  if (std::strcmp(p_path, hal::linux::bench::simulated_i2c_bus) == 0) {
+    return open_simulated(device::i2c_bus);
+  }
+  return p_real(p_path, p_flags, p_mode);
+}
+
+int gpio_ioctl(int p_fd, unsigned long p_request, void* p_argument)
+{
+  switch (p_request) {
+    case GPIO_V2_GET_LINE_IOCTL: {
+      auto* request = static_cast<gpio_v2_line_request*>(p_argument);
+      request->fd = open_simulated(device::gpio_lines);
+      return request->fd < 0 ? -1 : 0;
+    }
+    case GPIO_V2_LINE_SET_VALUES_IOCTL: {
+      auto* values = static_cast<gpio_v2_line_values*>(p_argument);
+      auto& current = line_values[p_fd];
+      auto state = current.load(std::memory_order_relaxed);
+      while (!current.compare_exchange_weak(
+        state, (state & ~values->mask) | (values->bits & values->mask))) {
+      }
+      return 0;
+    }
+    case GPIO_V2_LINE_GET_VALUES_IOCTL: {
+      auto* values = static_cast<gpio_v2_line_values*>(p_argument);
+      values->bits = line_values[p_fd].load() & values->mask;
+      return 0;
+    }
+    case GPIO_V2_LINE_SET_CONFIG_IOCTL:
+      return 0;
+    default:
+      errno = ENOTTY;
+      return -1;
+  }
+}
+
+// Reads return a counting pattern, writes go nowhere
+void fill(std::uint8_t* p_data, std::size_t p_size)
+{
+  for (std::size_t i = 0; i < p_size; i++) {
+    p_data[i] = static_cast<std::uint8_t>(i);
+  }
+}
+
+int i2c_ioctl(unsigned long p_request, void* p_argument)
+{
+  switch (p_request) {
+    case I2C_FUNCS:
+      *static_cast<unsigned long*>(p_argument) =
+        I2C_FUNC_I2C | I2C_FUNC_10BIT_ADDR | I2C_FUNC_SMBUS_EMUL;
+      return 0;
+    case I2C_SLAVE:
+    case I2C_SLAVE_FORCE:
+    case I2C_TENBIT:
+      return 0;
+    case I2C_RDWR: {
+      auto* transfer = static_cast<i2c_rdwr_ioctl_data*>(p_argument);
+      for (std::uint32_t i = 0; i < transfer->nmsgs; i++) {
+        const auto& message = transfer->msgs[i];
+        if (message.flags & I2C_M_RD) {
+          fill(message.buf, message.len);
+        }
+      }
+      return static_cast<int>(transfer->nmsgs);
+    }
+    case I2C_SMBUS: {
+      auto* command = static_cast<i2c_smbus_ioctl_data*>(p_argument);
+      if (command->read_write == I2C_SMBUS_READ && command->data) {
+        if (command->size == I2C_SMBUS_I2C_BLOCK_DATA) {
+          fill(command->data->block + 1, command->data->block[0]);
+        } else {
+          fill(command->data->block, 2);
+        }
+      }
+      return 0;
+    }
+    default:
+      errno = ENOTTY;
+      return -1;
+  }
+}
+}  // namespace
+
+extern "C" {
+
+unsigned long long hal_bench_syscalls()
+{
+  return syscalls;
+}
+
+int open(const char* p_path, int p_flags, ...)
+{
+  va_list args;
+  va_start(args, p_flags);
+  const auto mode = creation_mode(p_flags, args);
+  va_end(args);
+  static const auto real = next<open_function>("open");
+  return open_path(p_path, p_flags, mode, real);
+}
+
+int open64(const char* p_path, int p_flags, ...)
+{
+  va_list args;
+  va_start(args, p_flags);
+  const auto mode = creation_mode(p_flags, args);
+  va_end(args);
+  static const auto real = next<open_function>("open64");
+  return open_path(p_path, p_flags, mode, real);
+}
+
+int close(int p_fd)
+{
+  syscalls++;
+  if (device_of(p_fd) != device::none) {
+    devices[p_fd].store(device::none, std::memory_order_relaxed);
+    line_values[p_fd].store(0, std::memory_order_relaxed);
+  }
+  return real_close(p_fd);
+}
+
+int ioctl(int p_fd, unsigned long p_request, ...)
+{
+  static const auto real = next<ioctl_function>("ioctl");
+  va_list args;
+  va_start(args, p_request);
+  auto* argument = va_arg(args, void*);
+  va_end(args);
+
+  syscalls++;
+  switch (device_of(p_fd)) {
+    case device::gpio_chip:
+    case device::gpio_lines:
+      return gpio_ioctl(p_fd, p_request, argument);
+    case device::i2c_bus:
+      return i2c_ioctl(p_request, argument);
+    case device::none:
+    default:
+      return real(p_fd, p_request, argument);
+  }
+}
+
+ssize_t read(int p_fd, void* p_data, size_t p_size)
+{
+  static const auto real = next<read_function>("read");
+  syscalls++;
+  if (device_of(p_fd) == device::i2c_bus) {
+    fill(static_cast<std::uint8_t*>(p_data), p_size);
+    return static_cast<ssize_t>(p_size);
+  }
+  return real(p_fd, p_data, p_size);
+}
+
+ssize_t write(int p_fd, const void* p_data, size_t p_size)
+{
+  static const auto real = next<write_function>("write");
+  syscalls++;
+  if (device_of(p_fd) == device::i2c_bus) {
+    return static_cast<ssize_t>(p_size);
+  }
+  return real(p_fd, p_data, p_size);
+}
+
+ssize_t writev(int p_fd, const iovec* p_vectors, int p_count)
+{
+  static const auto real = next<writev_function>("writev");
+  syscalls++;
+  return real(p_fd, p_vectors, p_count);
+}
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// Device paths the ioctl shim answers for instead of the kernel. Opening them
+// without the shim preloaded fails, which the benchmark reports as skipped.
+namespace hal::linux::bench {
+inline constexpr const char* simulated_gpio_chip = "/dev/gpiochip-sim";
+inline constexpr const char* simulated_i2c_bus = "/dev/i2c-sim";
+}  // namespace hal::linux::bench
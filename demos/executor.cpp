@@ -0,0 +1,78 @@
+// Copyright 2024 Khalil Estell
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "../include/libhal-linux/executor.hpp"
+#include "../include/libhal-linux/i2c.hpp"
+#include "../include/libhal-linux/interrupt_pin.hpp"
+#include "../include/libhal-linux/serial.hpp"
+#include "../include/libhal-linux/steady_clock.hpp"
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <libhal/error.hpp>
+
+using namespace std::chrono_literals;
+
+hal::linux::task<> echo_serial(hal::linux::executor& p_exec,
+                               hal::linux::serial& p_serial)
+{
+  std::array<hal::byte, 64> buffer{};
+  while (true) {
+    co_await p_exec.readable(p_serial);
+    auto received = p_serial.read(buffer).data;
+    p_serial.write(received);
+  }
+}
+
+hal::linux::task<> sample_imu(hal::linux::executor& p_exec,
+                              hal::linux::i2c& p_bus)
+{
+  constexpr hal::byte address = 0x68;
+  const auto wake_sensor = std::array<hal::byte, 2>{ 0x6B, 0 };
+  const auto accel_register = std::array<hal::byte, 1>{ 0x3B };
+  std::array<hal::byte, 6> accel{};
+  co_await p_exec.transaction(p_bus, address, wake_sensor, {});
+  while (true) {
+    co_await p_exec.transaction(p_bus, address, accel_register, accel);
+    const auto x = static_cast<std::int16_t>(accel[0] << 8 | accel[1]);
+    printf("accel x: %d\n", x);
+    co_await p_exec.sleep_for(100ms);
+  }
+}
+
+hal::linux::task<> watch_button(hal::linux::executor& p_exec,
+                                hal::linux::interrupt_pin& p_button)
+{
+  while (true) {
+    auto event = co_await p_exec.edge(p_button);
+    printf("button edge at %llu ns\n", event.timestamp_ns);
+  }
+}
+
+int main()
+{
+  auto clock = hal::linux::steady_clock<std::chrono::steady_clock>();
+  auto serial = hal::linux::serial("/dev/serial0");
+  auto bus = hal::linux::i2c("/dev/i2c-1");
+  auto button = hal::linux::interrupt_pin("/dev/gpiochip0", 3);
+
+  // All three devices are serviced from this one thread
+  auto exec = hal::linux::executor(clock);
+  exec.spawn(echo_serial(exec, serial));
+  exec.spawn(sample_imu(exec, bus));
+  exec.spawn(watch_button(exec, button));
+  exec.run();
+
+  return 0;
+}
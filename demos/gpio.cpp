@@ -22,6 +22,8 @@ int main()
 {
   auto output_gpio = hal::linux::output_pin("/dev/gpiochip0", 2);
   auto input_gpio = hal::linux::input_pin("/dev/gpiochip0", 3);
+  // Reading back our own writes is answered from the cache, no ioctl needed
+  output_gpio.cache_level(true);
   std::cout << "blinking gpio 2 on gpiochip0\n";
   bool state = output_gpio.level();
   bool saved_state = false;
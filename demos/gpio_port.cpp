@@ -0,0 +1,42 @@
+// Copyright 2024 Khalil Estell
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "../include/libhal-linux/input_port.hpp"
+#include "../include/libhal-linux/output_port.hpp"
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <libhal/error.hpp>
+#include <unistd.h>
+
+int main()
+{
+  constexpr auto bus_pins = std::array<std::uint16_t, 4>{ 2, 4, 17, 27 };
+  constexpr auto button_pins = std::array<std::uint16_t, 2>{ 3, 22 };
+  auto bus = hal::linux::output_port("/dev/gpiochip0", bus_pins);
+  auto buttons = hal::linux::input_port("/dev/gpiochip0", button_pins);
+  auto quit_button = buttons.pin(0);
+
+  std::cout << "counting on a 4 bit bus on gpiochip0\n";
+  for (std::uint64_t count = 0; quit_button.level(); count++) {
+    // All four lines change with a single ioctl
+    bus.level(count);
+    std::cout << "bus: " << bus.level() << " buttons: " << buttons.level()
+              << std::endl;
+    sleep(1);
+  }
+  std::cout << "quiting, bye bye\n";
+
+  return 0;
+}
@@ -0,0 +1,41 @@
+// Copyright 2024 Khalil Estell
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "../include/libhal-linux/interrupt_pin.hpp"
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <libhal/error.hpp>
+#include <unistd.h>
+
+int main()
+{
+  auto button = hal::linux::interrupt_pin("/dev/gpiochip0", 3);
+  std::atomic<int> presses = 0;
+  button.configure({ .resistor = hal::pin_resistor::pull_up,
+                     .trigger = hal::interrupt_pin::trigger_edge::falling });
+  button.on_edge([&presses](bool p_state, std::uint64_t p_timestamp_ns) {
+    std::cout << "edge: " << p_state << " at " << p_timestamp_ns << "ns\n";
+    presses++;
+  });
+
+  std::cout << "waiting for 5 presses on gpio 3 of gpiochip0\n";
+  while (presses < 5) {
+    // The main thread is free to sleep, edges arrive on the event thread
+    sleep(1);
+  }
+  std::cout << "dropped events: " << button.dropped_events() << "\n";
+
+  return 0;
+}
@@ -0,0 +1,64 @@
+// Copyright 2024 Khalil Estell
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "../include/libhal-linux/deferred_log.hpp"
+#include "../include/libhal-linux/event_thread.hpp"
+#include "../include/libhal-linux/realtime_context.hpp"
+#include <chrono>
+#include <cstdio>
+
+namespace {
+void print_jitter(const char* p_label,
+                  const hal::linux::realtime_context::jitter_stats& p_stats)
+{
+  std::printf("%-10s mean %8.0f ns  p99 %8lld ns  max %8lld ns\n",
+              p_label,
+              p_stats.mean_ns,
+              static_cast<long long>(p_stats.p99_ns),
+              static_cast<long long>(p_stats.max_ns));
+}
+}  // namespace
+
+int main()
+{
+  using namespace std::chrono_literals;
+  using hal::linux::realtime_context;
+
+  // Wake up every 500 us like a 2 kHz control loop would
+  print_jitter("default", realtime_context::measure_jitter(500us, 4000));
+
+  {
+    // Without CAP_SYS_NICE or a big enough RLIMIT_MEMLOCK some of this is
+    // skipped, the loop still runs with whatever could be applied
+    auto context = realtime_context({
+      .cpus = { 0 },
+      .priority = 80,
+      .prefault_heap = 4 * 1024 * 1024,
+    });
+    const auto& applied = context.applied();
+    std::printf("affinity %s, SCHED_FIFO %s, memory lock %s, "
+                "timer slack %s\n",
+                applied.affinity == 0 ? "on" : "off",
+                applied.scheduler == 0 ? "on" : "off",
+                applied.memory_lock == 0 ? "on" : "off",
+                applied.timer_slack == 0 ? "on" : "off");
+    print_jitter("realtime", realtime_context::measure_jitter(500us, 4000));
+  }
+
+  // Driver worker threads opt in the same way
+  hal::linux::event_thread::shared().realtime({ .priority = 50 });
+
+  hal::linux::deferred_log::global().dump(stderr);
+  return 0;
+}
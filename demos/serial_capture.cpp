@@ -0,0 +1,94 @@
+// Copyright 2024 Khalil Estell
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "../include/libhal-linux/capture_ring.hpp"
+#include "../include/libhal-linux/serial.hpp"
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <poll.h>
+#include <pty.h>
+#include <span>
+#include <string>
+#include <unistd.h>
+
+int main()
+{
+  // A pseudo terminal pair stands in for the UART, the controller side plays
+  // the device on the other end of the wire
+  int controller = -1;
+  int device = -1;
+  std::array<char, 64> name{};
+  if (openpty(&controller, &device, name.data(), nullptr, nullptr) < 0) {
+    perror("openpty");
+    return 1;
+  }
+  auto port = hal::linux::serial(name.data());
+  const std::string capture_path = "/tmp/serial_capture.bin";
+  // Small enough that the ring wraps during the demo
+  port.enable_capture(capture_path, 8192);
+
+  std::array<hal::byte, 256> buffer{};
+  std::size_t total = 0;
+  for (int line = 0; line < 200; line++) {
+    const auto message = "line " + std::to_string(line) + " from device\n";
+    [[maybe_unused]] auto res =
+      ::write(controller, message.data(), message.size());
+    pollfd readable{ .fd = port.native_handle(),
+                    .events = POLLIN,
+                    .revents = 0 };
+    poll(&readable, 1, 100);
+    // The application reads as usual, the capture happens underneath
+    total += port.read(buffer).data.size();
+  }
+  std::printf("application read %zu bytes\n", total);
+
+  // Or without any copy, straight out of the capture file
+  [[maybe_unused]] auto res = ::write(controller, "in place\n", 9);
+  pollfd readable{ .fd = port.native_handle(),
+                  .events = POLLIN,
+                  .revents = 0 };
+  poll(&readable, 1, 100);
+  const auto in_place = port.read_in_place();
+  std::printf("read_in_place: %.*s",
+              static_cast<int>(in_place.size()),
+              reinterpret_cast<const char*>(in_place.data()));
+
+  // What an analysis tool would do with the file after an incident
+  std::uint64_t previous = 0;
+  std::uint64_t largest_gap = 0;
+  std::size_t captured = 0;
+  const auto chunks = hal::linux::capture_ring::for_each(
+    capture_path,
+    [&](std::uint64_t p_timestamp_ns, std::span<const hal::byte> p_data) {
+      if (previous == 0) {
+        std::printf("oldest chunk: %.*s",
+                    static_cast<int>(p_data.size()),
+                    reinterpret_cast<const char*>(p_data.data()));
+      } else if (p_timestamp_ns - previous > largest_gap) {
+        largest_gap = p_timestamp_ns - previous;
+      }
+      previous = p_timestamp_ns;
+      captured += p_data.size();
+    });
+  std::printf("capture file holds %zu chunks, %zu bytes, largest gap %.3f "
+              "ms\n",
+              chunks,
+              captured,
+              static_cast<double>(largest_gap) / 1e6);
+
+  close(controller);
+  close(device);
+  return 0;
+}
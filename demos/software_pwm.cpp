@@ -0,0 +1,47 @@
+// Copyright 2024 Khalil Estell
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "../include/libhal-linux/output_port.hpp"
+#include "../include/libhal-linux/software_pwm.hpp"
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <libhal/error.hpp>
+#include <unistd.h>
+
+int main()
+{
+  constexpr auto led_pins = std::array<std::uint16_t, 2>{ 2, 4 };
+  auto leds = hal::linux::output_port("/dev/gpiochip0", led_pins);
+  // One thread services every channel
+  auto engine = hal::linux::pwm_engine();
+  auto red = hal::linux::software_pwm(engine, leds, 0);
+  auto green = hal::linux::software_pwm(engine, leds, 1);
+  red.frequency(200.0f);
+  green.frequency(200.0f);
+
+  std::cout << "fading gpio 2 and 4 on gpiochip0\n";
+  for (int step = 0; step <= 100; step++) {
+    red.duty_cycle(step / 100.0f);
+    green.duty_cycle(1.0f - step / 100.0f);
+    usleep(50'000);
+  }
+
+  const auto jitter = engine.jitter();
+  std::cout << "wake ups: " << jitter.samples << " late by min "
+            << jitter.min_ns << "ns, max " << jitter.max_ns << "ns, mean "
+            << jitter.mean_ns << "ns\n";
+
+  return 0;
+}
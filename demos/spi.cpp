@@ -0,0 +1,51 @@
+// Copyright 2024 Khalil Estell
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "../include/libhal-linux/spi.hpp"
+#include <array>
+#include <iostream>
+#include <libhal/error.hpp>
+#include <unistd.h>
+
+int main()
+{
+  auto bus = hal::linux::spi("/dev/spidev0.0", { .clock_rate = 8'000'000.0f });
+
+  // Single full duplex transfer through the plain hal::spi interface
+  constexpr auto read_id = std::array<hal::byte, 1>{ 0x04 };
+  auto id = std::array<hal::byte, 4>{};
+  bus.transfer(read_id, id);
+  std::cout << "id: " << int(id[1]) << " " << int(id[2]) << " "
+            << int(id[3]) << "\n";
+
+  // A whole frame of command and pixel segments in a single ioctl. Chip
+  // select toggles after each row so the panel latches it.
+  constexpr auto rows = 32;
+  auto row_address = std::array<std::array<hal::byte, 2>, rows>{};
+  auto pixels = std::array<hal::byte, 128>{};
+  auto frame = hal::linux::spi_batch();
+  for (hal::byte frame_count = 0;; frame_count++) {
+    pixels.fill(frame_count);
+    frame.clear();
+    for (int row = 0; row < rows; row++) {
+      row_address[row] = { 0x2C, static_cast<hal::byte>(row) };
+      frame.write(row_address[row]);
+      frame.write(pixels, { .cs_change = true });
+    }
+    bus.transfer(frame);
+    usleep(16'000);
+  }
+
+  return 0;
+}
@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include "../include/libhal-linux/delay.hpp"
 #include "../include/libhal-linux/steady_clock.hpp"
 #include <chrono>
 #include <cstdio>
@@ -25,8 +26,19 @@ int main()
   using namespace hal::literals;
   auto sc = hal::linux::steady_clock<std::chrono::steady_clock>();
   printf("Clock made!\n");
+  // Sleeps for all but the last few microseconds instead of spinning
+  auto sleeper = hal::linux::precise_delay();
+  sleeper.calibrate();
   for (int i = 0; i < 10; i++) {
-    hal::delay(sc, 5s);
+    sleeper.sleep_for(sc, 1s);
     printf("Delayed for a second\n");
   }
-}
\ No newline at end of file
+  const auto stats = sleeper.stats();
+  printf("overshoot ns min: %lld max: %lld mean: %.0f, spin ns mean: %.0f, "
+         "margin ns: %lld\n",
+         static_cast<long long>(stats.min_ns),
+         static_cast<long long>(stats.max_ns),
+         stats.mean_ns,
+         stats.mean_spin_ns,
+         static_cast<long long>(sleeper.margin().count()));
+}
@@ -0,0 +1,53 @@
+// Copyright 2024 Khalil Estell
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "../include/libhal-linux/timer.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <libhal/error.hpp>
+#include <unistd.h>
+
+int main()
+{
+  using namespace std::chrono_literals;
+
+  // A periodic task that reschedules itself from its own callback
+  auto heartbeat = hal::linux::timer();
+  std::atomic<int> beats = 0;
+  hal::callback<void(void)> beat = [&] {
+    beats++;
+    heartbeat.schedule(beat, 100ms);
+  };
+  heartbeat.schedule(beat, 100ms);
+
+  // Hundreds of watchdogs that keep getting pushed back never fire, and all
+  // of them share one timerfd and the event thread.
+  std::array<hal::linux::timer, 500> watchdogs;
+  std::atomic<int> barks = 0;
+  for (int round = 0; round < 20; round++) {
+    for (auto& watchdog : watchdogs) {
+      watchdog.schedule([&] { barks++; }, 250ms);
+    }
+    usleep(50'000);
+  }
+
+  printf("heartbeats: %d, watchdogs fired: %d\n", beats.load(), barks.load());
+  for (auto& watchdog : watchdogs) {
+    watchdog.cancel();
+  }
+  heartbeat.cancel();
+  return 0;
+}
@@ -1,3 +1,4 @@
+#include "../include/libhal-linux/deferred_log.hpp"
 #include "../include/libhal-linux/serial.hpp"
 #include <algorithm>
 #include <iostream>
@@ -8,6 +9,8 @@
 int main()
 {
   std::cout << "UART test\n";
+  // Driver errors are recorded without formatting, print them off the hot path
+  auto log_printer = hal::linux::log_printer(stderr);
   auto serial_file_path = "/dev/serial0";
   auto serial_bus = hal::linux::serial(serial_file_path);
   std::string test_str = "Hello from libhal\n";
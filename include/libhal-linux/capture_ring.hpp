@@ -0,0 +1,316 @@
+#pragma once
+#include "errors.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <libhal/units.hpp>
+#include <span>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace hal::linux {
+
+/**
+ * @brief Size capped ring of timestamped chunks in a memory mapped file.
+ *
+ * Data is received straight into the mapping, so capturing costs neither a
+ * copy nor a write syscall, and the page cache keeps the file current even
+ * if the process dies. Once the ring is full the oldest chunks are
+ * overwritten.
+ *
+ * File layout: a file_header in the first page, followed by `capacity`
+ * bytes of records. Records are a chunk_header and its payload, padded to
+ * 16 bytes, and never wrap around the end of the ring; a padding record
+ * fills the gap instead. `tail` and `head` in the header are offsets into
+ * the unwrapped stream of records, modulo `capacity` they give the position
+ * in the ring. for_each() walks a capture file, live or post-mortem.
+ *
+ * Not thread safe, one thread receives at a time.
+ */
+class capture_ring
+{
+public:
+  static constexpr char magic[8] = { 'H', 'A', 'L', 'C', 'A', 'P', '0', '1' };
+
+  struct file_header
+  {
+    char magic[8];
+    std::uint32_t version;
+    /// Offset of the first record in the file
+    std::uint32_t data_offset;
+    /// Bytes of records the ring holds
+    std::uint64_t capacity;
+    /// Stream offset of the oldest record
+    std::uint64_t tail;
+    /// Stream offset just past the newest record
+    std::uint64_t head;
+  };
+
+  struct chunk_header
+  {
+    /// Payload bytes following the header
+    std::uint32_t size;
+    /// chunk_data or chunk_padding
+    std::uint32_t type;
+    /// CLOCK_REALTIME time the payload was received
+    std::uint64_t timestamp_ns;
+  };
+
+  static constexpr std::uint32_t chunk_padding = 0;
+  static constexpr std::uint32_t chunk_data = 1;
+
+  /**
+   * @brief Create, or truncate, and map a capture file.
+   * @param p_path Path of the capture file.
+   * @param p_capacity Bytes of records to keep, rounded up to whole pages.
+   *
+   * @throws hal::linux::errno_exception if the file could not be created,
+   * sized or mapped.
+   */
+  capture_ring(const std::string& p_path, std::size_t p_capacity)
+  {
+    m_fd = ::open(p_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+      throw errno_exception(errno, std::errc::no_such_file_or_directory, this);
+    }
+    const auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    m_capacity = (std::max(p_capacity, 2 * page) + page - 1) / page * page;
+    m_size = page + m_capacity;
+    if (ftruncate(m_fd, static_cast<off_t>(m_size)) < 0) {
+      const int error = errno;
+      ::close(m_fd);
+      throw errno_exception(error, std::errc::no_space_on_device, this);
+    }
+    void* mapping =
+      mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (mapping == MAP_FAILED) {
+      const int error = errno;
+      ::close(m_fd);
+      throw errno_exception(error, std::errc::not_enough_memory, this);
+    }
+    m_base = static_cast<hal::byte*>(mapping);
+    m_data = m_base + page;
+
+    auto& file = header();
+    std::memcpy(file.magic, magic, sizeof(magic));
+    file.version = 1;
+    file.data_offset = static_cast<std::uint32_t>(page);
+    file.capacity = m_capacity;
+  }
+
+  capture_ring(const capture_ring&) = delete;
+  capture_ring& operator=(const capture_ring&) = delete;
+
+  ~capture_ring()
+  {
+    munmap(m_base, m_size);
+    ::close(m_fd);
+  }
+
+  /**
+   * @brief Receive the next chunk straight into the ring.
+   * @param p_max Most bytes to receive, capped to half the ring.
+   * @param p_read Called as p_read(hal::byte* p_buffer, std::size_t p_size)
+   * and returns like read(). The bytes it stores become the chunk.
+   * @return What p_read returned. last() holds the chunk if it was positive.
+   */
+  template<typename Read>
+  ssize_t receive(std::size_t p_max, Read&& p_read)
+  {
+    const auto max = std::min(p_max, m_capacity / 2 - sizeof(chunk_header));
+    const auto needed = record_size(max);
+    auto offset = m_head % m_capacity;
+    if (m_capacity - offset < needed) {
+      // Fill up to the end of the ring, records never wrap
+      const auto rest = m_capacity - offset;
+      evict(m_head + rest);
+      write_header(offset, rest - sizeof(chunk_header), chunk_padding);
+      publish(m_head + rest);
+      offset = 0;
+    }
+    // Whatever the read could overwrite has to go first
+    evict(m_head + needed);
+
+    auto* chunk = m_data + offset;
+    const auto received = p_read(chunk + sizeof(chunk_header), max);
+    if (received <= 0) {
+      return received;
+    }
+    const auto size = static_cast<std::size_t>(received);
+    write_header(offset, size, chunk_data);
+    publish(m_head + record_size(size));
+    m_last = { chunk + sizeof(chunk_header), size };
+    return received;
+  }
+
+  /// Payload of the chunk received last, valid until the next receive()
+  std::span<const hal::byte> last() const
+  {
+    return m_last;
+  }
+
+  /// Bytes of records the ring holds
+  std::size_t capacity() const
+  {
+    return m_capacity;
+  }
+
+  /// Schedule the captured pages for writing to disk without waiting
+  void flush()
+  {
+    msync(m_base, m_size, MS_ASYNC);
+  }
+
+  /**
+   * @brief Walk the data chunks of a capture file, oldest first.
+   * @param p_path Path of a file written by a capture_ring.
+   * @param p_handler Called as p_handler(std::uint64_t p_timestamp_ns,
+   * std::span<const hal::byte> p_payload) for every chunk.
+   * @return Number of chunks passed to p_handler. Stops early at a record
+   * that is out of bounds, as a live file may be overwritten while read.
+   *
+   * @throws hal::linux::errno_exception if the file could not be mapped or
+   * is not a capture file.
+   */
+  template<typename Handler>
+  static std::size_t for_each(const std::string& p_path, Handler&& p_handler)
+  {
+    const int fd = ::open(p_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw errno_exception(
+        errno, std::errc::no_such_file_or_directory, nullptr);
+    }
+    struct stat info;
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &info) == 0 &&
+        static_cast<std::size_t>(info.st_size) >= sizeof(file_header)) {
+      mapping = mmap(nullptr,
+                     static_cast<std::size_t>(info.st_size),
+                     PROT_READ,
+                     MAP_SHARED,
+                     fd,
+                     0);
+    }
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+      throw errno_exception(EINVAL, std::errc::invalid_argument, nullptr);
+    }
+    const auto file_size = static_cast<std::size_t>(info.st_size);
+    const auto* base = static_cast<const hal::byte*>(mapping);
+    const auto* file = reinterpret_cast<const file_header*>(base);
+    if (std::memcmp(file->magic, magic, sizeof(magic)) != 0 ||
+        file->data_offset + file->capacity > file_size) {
+      munmap(mapping, file_size);
+      throw errno_exception(EINVAL, std::errc::invalid_argument, nullptr);
+    }
+
+    const auto capacity = file->capacity;
+    const auto* data = base + file->data_offset;
+    const auto head = load(file->head);
+    std::size_t count = 0;
+    for (auto position = load(file->tail); position < head;) {
+      const auto offset = position % capacity;
+      if (capacity - offset < sizeof(chunk_header)) {
+        break;
+      }
+      chunk_header chunk;
+      std::memcpy(&chunk, data + offset, sizeof(chunk));
+      const auto size = record_size(chunk.size);
+      if (size > capacity - offset) {
+        break;
+      }
+      if (chunk.type == chunk_data) {
+        p_handler(chunk.timestamp_ns,
+                  std::span<const hal::byte>(
+                    data + offset + sizeof(chunk_header), chunk.size));
+        count++;
+      }
+      position += size;
+    }
+    munmap(mapping, file_size);
+    return count;
+  }
+
+private:
+  static constexpr std::size_t alignment = 16;
+
+  static std::size_t record_size(std::size_t p_payload)
+  {
+    return (sizeof(chunk_header) + p_payload + alignment - 1) / alignment *
+           alignment;
+  }
+
+  static std::uint64_t load(const std::uint64_t& p_offset)
+  {
+    return std::atomic_ref(const_cast<std::uint64_t&>(p_offset))
+      .load(std::memory_order_acquire);
+  }
+
+  static std::uint64_t realtime_ns()
+  {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return static_cast<std::uint64_t>(now.tv_sec) * 1'000'000'000 +
+           static_cast<std::uint64_t>(now.tv_nsec);
+  }
+
+  file_header& header()
+  {
+    return *reinterpret_cast<file_header*>(m_base);
+  }
+
+  void write_header(std::size_t p_offset,
+                    std::size_t p_size,
+                    std::uint32_t p_type)
+  {
+    const chunk_header chunk{
+      .size = static_cast<std::uint32_t>(p_size),
+      .type = p_type,
+      .timestamp_ns = realtime_ns(),
+    };
+    std::memcpy(m_data + p_offset, &chunk, sizeof(chunk));
+  }
+
+  // Drop the oldest records until the stream up to p_end fits in the ring
+  void evict(std::uint64_t p_end)
+  {
+    if (p_end <= m_capacity) {
+      return;
+    }
+    auto tail = m_tail;
+    while (tail < m_head && tail < p_end - m_capacity) {
+      chunk_header chunk;
+      std::memcpy(&chunk, m_data + tail % m_capacity, sizeof(chunk));
+      tail += record_size(chunk.size);
+    }
+    if (tail != m_tail) {
+      m_tail = tail;
+      std::atomic_ref(header().tail).store(tail, std::memory_order_release);
+    }
+  }
+
+  void publish(std::uint64_t p_head)
+  {
+    m_head = p_head;
+    std::atomic_ref(header().head).store(p_head, std::memory_order_release);
+  }
+
+  int m_fd = -1;
+  hal::byte* m_base = nullptr;
+  hal::byte* m_data = nullptr;
+  std::size_t m_size = 0;
+  std::size_t m_capacity = 0;
+  std::uint64_t m_head = 0;
+  std::uint64_t m_tail = 0;
+  std::span<const hal::byte> m_last;
+};
+}  // namespace hal::linux
@@ -0,0 +1,71 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <libhal/error.hpp>
+#include <libhal/steady_clock.hpp>
+#include <libhal/units.hpp>
+
+namespace hal::linux {
+
+/**
+ * @brief A point in time on a hal::steady_clock, usable as a
+ * hal::timeout_function.
+ *
+ * Unlike an opaque timeout function, a deadline can tell drivers how long is
+ * left, so they can sleep in the kernel until data arrives or time runs out
+ * instead of repeatedly calling the timeout in a loop.
+ */
+class deadline
+{
+public:
+  /**
+   * @brief Start counting down from now.
+   * @param p_clock Clock to measure against, must outlive the deadline.
+   * @param p_timeout Time from now until the deadline expires.
+   */
+  deadline(hal::steady_clock& p_clock, hal::time_duration p_timeout)
+    : m_clock(&p_clock)
+    , m_frequency(p_clock.frequency())
+  {
+    const auto ticks = static_cast<double>(p_timeout.count()) *
+                       static_cast<double>(m_frequency) / 1e9;
+    m_end =
+      m_clock->uptime() + static_cast<std::uint64_t>(std::max(ticks, 0.0));
+  }
+
+  /**
+   * @brief Timeout function interface.
+   *
+   * @throws hal::timed_out once the deadline has passed.
+   */
+  void operator()()
+  {
+    if (expired()) {
+      hal::safe_throw(hal::timed_out(this));
+    }
+  }
+
+  bool expired()
+  {
+    return m_clock->uptime() >= m_end;
+  }
+
+  /// Time left until the deadline, zero once it has passed
+  std::chrono::nanoseconds remaining()
+  {
+    const auto now = m_clock->uptime();
+    if (now >= m_end) {
+      return std::chrono::nanoseconds(0);
+    }
+    const auto ns = static_cast<double>(m_end - now) * 1e9 /
+                    static_cast<double>(m_frequency);
+    return std::chrono::nanoseconds(static_cast<std::int64_t>(ns));
+  }
+
+private:
+  hal::steady_clock* m_clock;
+  hertz m_frequency;
+  std::uint64_t m_end = 0;
+};
+}  // namespace hal::linux
@@ -0,0 +1,451 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace hal::linux {
+
+enum class log_level : std::uint8_t
+{
+  debug,
+  info,
+  warning,
+  error,
+};
+
+/// What happened. Each event has a fixed message, so records stay binary
+/// until they are printed.
+enum class log_event : std::uint8_t
+{
+  i2c_write_then_read,
+  i2c_read,
+  i2c_write,
+  i2c_ten_bit,
+  i2c_select,
+  pin_get,
+  pin_set,
+  serial_open,
+  serial_close,
+  serial_configure,
+  serial_read,
+  serial_write,
+  serial_tx_queue,
+  serial_flush,
+  realtime_affinity,
+  realtime_scheduler,
+  realtime_memory_lock,
+  realtime_prefault,
+  realtime_timer_slack,
+};
+
+inline const char* to_string(log_event p_event)
+{
+  switch (p_event) {
+    case log_event::i2c_write_then_read:
+      return "i2c write then read failed";
+    case log_event::i2c_read:
+      return "i2c read failed";
+    case log_event::i2c_write:
+      return "i2c write failed";
+    case log_event::i2c_ten_bit:
+      return "i2c 10 bit mode switch failed";
+    case log_event::i2c_select:
+      return "i2c address select failed";
+    case log_event::pin_get:
+      return "getting pin failed";
+    case log_event::pin_set:
+      return "setting pin failed";
+    case log_event::serial_open:
+      return "opening serial connection failed";
+    case log_event::serial_close:
+      return "closing serial connection failed";
+    case log_event::serial_configure:
+      return "configuring serial device failed";
+    case log_event::serial_read:
+      return "serial read failed";
+    case log_event::serial_write:
+      return "serial write failed";
+    case log_event::serial_tx_queue:
+      return "writing queued serial data failed";
+    case log_event::serial_flush:
+      return "serial flush failed";
+    case log_event::realtime_affinity:
+      return "cpu affinity not applied";
+    case log_event::realtime_scheduler:
+      return "SCHED_FIFO not applied";
+    case log_event::realtime_memory_lock:
+      return "memory not locked";
+    case log_event::realtime_prefault:
+      return "memory only partly pre-faulted";
+    case log_event::realtime_timer_slack:
+      return "timer slack not applied";
+    default:
+      return "unknown event";
+  }
+}
+
+inline const char* to_string(log_level p_level)
+{
+  switch (p_level) {
+    case log_level::debug:
+      return "debug";
+    case log_level::info:
+      return "info";
+    case log_level::warning:
+      return "warning";
+    case log_level::error:
+    default:
+      return "error";
+  }
+}
+
+/// One entry of the deferred log
+struct log_record
+{
+  /// CLOCK_MONOTONIC time the record was taken at
+  std::uint64_t timestamp_ns = 0;
+  /// Id from deferred_log::device_id()
+  std::uint32_t device = 0;
+  /// Event specific detail, such as the pin number or i2c address
+  std::uint32_t argument = 0;
+  /// errno at the time of the event, 0 if none
+  std::int32_t error = 0;
+  log_event event = log_event::i2c_write_then_read;
+  log_level level = log_level::error;
+};
+
+/**
+ * @brief Fixed size, lock-free ring of binary log records.
+ *
+ * Drivers record what went wrong as a log_record instead of formatting text
+ * on the spot, so logging an error costs a clock read and a few atomic
+ * stores, never takes a lock, never allocates and never makes a syscall.
+ * Any number of threads may record at once. Text is produced later by
+ * drain(), either from a log_printer thread or in a post-mortem dump().
+ *
+ * When the ring is full the oldest records are overwritten, so the ring
+ * always holds the most recent history. Overwritten records are counted by
+ * lost().
+ */
+class deferred_log
+{
+public:
+  static constexpr std::size_t default_capacity = 1024;
+
+  /// The log every driver records into
+  static deferred_log& global()
+  {
+    static deferred_log instance(default_capacity);
+    return instance;
+  }
+
+  /**
+   * @param p_capacity Number of records kept, rounded up to a power of two.
+   */
+  explicit deferred_log(std::size_t p_capacity)
+    : m_capacity(std::bit_ceil(std::max<std::size_t>(p_capacity, 2)))
+    , m_slots(std::make_unique<slot[]>(m_capacity))
+  {
+  }
+
+  deferred_log(const deferred_log&) = delete;
+  deferred_log& operator=(const deferred_log&) = delete;
+
+  /**
+   * @brief Intern a device name, such as the path of a device file. Called
+   * once when a driver is constructed, as it allocates and takes a lock.
+   * @return Id to pass to record(), the same for the same name.
+   */
+  static std::uint32_t device_id(std::string_view p_name)
+  {
+    auto& names = device_names();
+    std::lock_guard lock(names.lock);
+    for (std::size_t i = 0; i < names.names.size(); i++) {
+      if (names.names[i] == p_name) {
+        return static_cast<std::uint32_t>(i);
+      }
+    }
+    names.names.emplace_back(p_name);
+    return static_cast<std::uint32_t>(names.names.size() - 1);
+  }
+
+  /// Name a device id was interned from
+  static std::string device_name(std::uint32_t p_device)
+  {
+    auto& names = device_names();
+    std::lock_guard lock(names.lock);
+    if (p_device >= names.names.size()) {
+      return "unknown device";
+    }
+    return names.names[p_device];
+  }
+
+  /// Records below this level are discarded before they are taken
+  void minimum_level(log_level p_level)
+  {
+    m_minimum_level.store(p_level, std::memory_order_relaxed);
+  }
+
+  log_level minimum_level() const
+  {
+    return m_minimum_level.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Append a record. Safe from any thread and wait-free.
+   * @param p_level Severity of the event.
+   * @param p_event What happened.
+   * @param p_device Id from device_id().
+   * @param p_argument Event specific detail.
+   * @param p_error errno at the time of the event, 0 if none.
+   */
+  void record(log_level p_level,
+              log_event p_event,
+              std::uint32_t p_device,
+              std::uint32_t p_argument,
+              int p_error) noexcept
+  {
+    if (p_level < m_minimum_level.load(std::memory_order_relaxed)) {
+      return;
+    }
+    const auto index = m_head.fetch_add(1, std::memory_order_relaxed);
+    auto& entry = m_slots[index & (m_capacity - 1)];
+    // Odd while the slot is being written, so a reader can spot torn records
+    entry.sequence.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    entry.words[0].store(now_ns(), std::memory_order_relaxed);
+    entry.words[1].store(std::uint64_t{ p_device } << 32 |
+                           static_cast<std::uint32_t>(p_error),
+                         std::memory_order_relaxed);
+    entry.words[2].store(std::uint64_t{ p_argument } << 32 |
+                           static_cast<std::uint64_t>(p_event) << 8 |
+                           static_cast<std::uint64_t>(p_level),
+                         std::memory_order_relaxed);
+    entry.sequence.store(2 * index + 2, std::memory_order_release);
+  }
+
+  /**
+   * @brief Pass every record taken since the last drain to p_handler, oldest
+   * first. Records still being written are left for the next call. Only one
+   * thread drains at a time, the others wait.
+   * @return Number of records handed to p_handler.
+   */
+  template<typename Handler>
+  std::size_t drain(Handler&& p_handler)
+  {
+    std::lock_guard lock(m_drain_lock);
+    const auto head = m_head.load(std::memory_order_acquire);
+    if (head - m_tail > m_capacity) {
+      m_lost.fetch_add(head - m_tail - m_capacity, std::memory_order_relaxed);
+      m_tail = head - m_capacity;
+    }
+
+    std::size_t count = 0;
+    while (m_tail < head) {
+      const auto& entry = m_slots[m_tail & (m_capacity - 1)];
+      const auto expected = 2 * m_tail + 2;
+      const auto before = entry.sequence.load(std::memory_order_acquire);
+      if (before < expected) {
+        break;
+      }
+      const auto record = unpack(entry);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      const auto after = entry.sequence.load(std::memory_order_relaxed);
+      m_tail++;
+      if (before != expected || after != expected) {
+        // Overwritten by a writer that lapped the ring
+        m_lost.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+      p_handler(record);
+      count++;
+    }
+    return count;
+  }
+
+  /// Records overwritten before they were drained
+  std::uint64_t lost() const
+  {
+    return m_lost.load(std::memory_order_relaxed);
+  }
+
+  std::size_t capacity() const
+  {
+    return m_capacity;
+  }
+
+  /**
+   * @brief Write one record as a line of text.
+   * @param p_output Stream to write to.
+   * @param p_record Record to format.
+   */
+  static void print(std::FILE* p_output, const log_record& p_record)
+  {
+    const auto message =
+      std::generic_category().message(static_cast<int>(p_record.error));
+    std::fprintf(p_output,
+                 "[%6llu.%06llu] %s: %s (%u): %s: %s (%d)\n",
+                 static_cast<unsigned long long>(p_record.timestamp_ns /
+                                                 1'000'000'000),
+                 static_cast<unsigned long long>(
+                   p_record.timestamp_ns % 1'000'000'000 / 1000),
+                 to_string(p_record.level),
+                 device_name(p_record.device).c_str(),
+                 p_record.argument,
+                 to_string(p_record.event),
+                 message.c_str(),
+                 static_cast<int>(p_record.error));
+  }
+
+  /**
+   * @brief Post-mortem dump, prints every record still in the ring.
+   * @return Number of records printed.
+   */
+  std::size_t dump(std::FILE* p_output = stderr)
+  {
+    const auto count = drain(
+      [p_output](const log_record& p_record) { print(p_output, p_record); });
+    if (lost() != 0) {
+      std::fprintf(p_output,
+                   "%llu log records lost\n",
+                   static_cast<unsigned long long>(lost()));
+    }
+    std::fflush(p_output);
+    return count;
+  }
+
+private:
+  struct alignas(32) slot
+  {
+    std::atomic<std::uint64_t> sequence = 0;
+    std::atomic<std::uint64_t> words[3] = {};
+  };
+
+  struct name_table
+  {
+    std::mutex lock;
+    std::vector<std::string> names;
+  };
+
+  static name_table& device_names()
+  {
+    static name_table instance;
+    return instance;
+  }
+
+  static log_record unpack(const slot& p_slot)
+  {
+    const auto first = p_slot.words[0].load(std::memory_order_relaxed);
+    const auto second = p_slot.words[1].load(std::memory_order_relaxed);
+    const auto third = p_slot.words[2].load(std::memory_order_relaxed);
+    return log_record{
+      .timestamp_ns = first,
+      .device = static_cast<std::uint32_t>(second >> 32),
+      .argument = static_cast<std::uint32_t>(third >> 32),
+      .error = static_cast<std::int32_t>(second & 0xFFFF'FFFF),
+      .event = static_cast<log_event>((third >> 8) & 0xFF),
+      .level = static_cast<log_level>(third & 0xFF),
+    };
+  }
+
+  static std::uint64_t now_ns()
+  {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<std::uint64_t>(now.tv_sec) * 1'000'000'000 +
+           static_cast<std::uint64_t>(now.tv_nsec);
+  }
+
+  std::size_t m_capacity;
+  std::unique_ptr<slot[]> m_slots;
+  std::atomic<log_level> m_minimum_level = log_level::debug;
+  alignas(64) std::atomic<std::uint64_t> m_head = 0;
+  alignas(64) std::mutex m_drain_lock;
+  std::uint64_t m_tail = 0;
+  std::atomic<std::uint64_t> m_lost = 0;
+};
+
+/// Record an error with the errno that caused it into the global log
+inline void log_error(log_event p_event,
+                      std::uint32_t p_device,
+                      std::uint32_t p_argument,
+                      int p_error)
+{
+  deferred_log::global().record(
+    log_level::error, p_event, p_device, p_argument, p_error);
+}
+
+/**
+ * @brief Background thread that prints the records of a deferred_log as
+ * they come in, at most p_period late. Stopping it prints whatever is left.
+ */
+class log_printer
+{
+public:
+  explicit log_printer(
+    std::FILE* p_output = stderr,
+    std::chrono::milliseconds p_period = std::chrono::milliseconds(100),
+    deferred_log& p_log = deferred_log::global())
+    : m_log(&p_log)
+    , m_output(p_output)
+  {
+    m_thread = std::thread([this, p_period] {
+      std::unique_lock lock(m_lock);
+      while (!m_stopping) {
+        m_wake.wait_for(lock, p_period, [this] { return m_stopping; });
+        print();
+      }
+    });
+  }
+
+  log_printer(const log_printer&) = delete;
+  log_printer& operator=(const log_printer&) = delete;
+
+  ~log_printer()
+  {
+    {
+      std::lock_guard lock(m_lock);
+      m_stopping = true;
+    }
+    m_wake.notify_all();
+    m_thread.join();
+  }
+
+private:
+  void print()
+  {
+    const auto printed = m_log->drain(
+      [this](const log_record& p_record) { m_log->print(m_output, p_record); });
+    const auto lost = m_log->lost();
+    if (lost != m_reported_lost) {
+      std::fprintf(m_output,
+                   "%llu log records lost\n",
+                   static_cast<unsigned long long>(lost - m_reported_lost));
+      m_reported_lost = lost;
+    }
+    if (printed != 0) {
+      std::fflush(m_output);
+    }
+  }
+
+  deferred_log* m_log;
+  std::FILE* m_output;
+  std::uint64_t m_reported_lost = 0;
+  std::mutex m_lock;
+  std::condition_variable m_wake;
+  bool m_stopping = false;
+  std::thread m_thread;
+};
+}  // namespace hal::linux
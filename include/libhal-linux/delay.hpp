@@ -0,0 +1,191 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <libhal/steady_clock.hpp>
+#include <libhal/units.hpp>
+
+namespace hal::linux {
+
+/**
+ * @brief Microsecond accurate delays that sleep for most of the wait.
+ *
+ * A plain spin on a steady clock burns a core for the whole wait and can
+ * still be preempted at the very end. This sleeps with an absolute
+ * clock_nanosleep until a margin before the deadline, then spins only for
+ * that last stretch. The margin follows the wake up latency measured on
+ * every sleep: it grows right away when the kernel wakes the thread late
+ * and shrinks slowly while wake ups are on time.
+ *
+ * Not thread safe, use one instance per thread. hal::linux::delay() keeps
+ * one per thread for you.
+ */
+class precise_delay
+{
+public:
+  /// How far past the deadline delays returned
+  struct statistics
+  {
+    std::uint64_t samples = 0;
+    std::int64_t min_ns = 0;
+    std::int64_t max_ns = 0;
+    double mean_ns = 0.0;
+    /// Mean time spent spinning per delay, the CPU cost of the accuracy
+    double mean_spin_ns = 0.0;
+  };
+
+  /**
+   * @param p_initial_margin Spin window to start with, before any wake up
+   * latency has been measured.
+   * @param p_auto_calibrate Adapt the margin to the measured latency.
+   */
+  explicit precise_delay(
+    std::chrono::nanoseconds p_initial_margin = std::chrono::microseconds(100),
+    bool p_auto_calibrate = true)
+    : m_margin_ns(p_initial_margin.count())
+    , m_latency_ns(static_cast<double>(p_initial_margin.count()) / 2)
+    , m_auto_calibrate(p_auto_calibrate)
+  {
+  }
+
+  /**
+   * @brief Wait until a CLOCK_MONOTONIC time, std::chrono::steady_clock on
+   * Linux.
+   */
+  void sleep_until(std::chrono::steady_clock::time_point p_deadline)
+  {
+    const auto deadline = p_deadline.time_since_epoch().count();
+    sleep_phase(deadline);
+    const auto spin_start = now_ns();
+    auto now = spin_start;
+    while (now < deadline) {
+      now = now_ns();
+    }
+    record(now - deadline, now - spin_start);
+  }
+
+  void sleep_for(hal::time_duration p_duration)
+  {
+    sleep_until(std::chrono::steady_clock::now() + p_duration);
+  }
+
+  /**
+   * @brief Wait on any hal::steady_clock, spinning on that clock for the
+   * last stretch, so the delay is exact in its ticks.
+   * @param p_clock Clock to measure the delay with.
+   * @param p_duration Time to wait.
+   */
+  void sleep_for(hal::steady_clock& p_clock, hal::time_duration p_duration)
+  {
+    const auto frequency = static_cast<double>(p_clock.frequency());
+    const auto ticks =
+      static_cast<double>(p_duration.count()) * frequency / 1e9;
+    const auto end = p_clock.uptime() + static_cast<std::uint64_t>(ticks);
+    const auto deadline = now_ns() + p_duration.count();
+
+    sleep_phase(deadline);
+    const auto spin_start = now_ns();
+    while (p_clock.uptime() < end) {
+    }
+    const auto now = now_ns();
+    record(now - deadline, now - spin_start);
+  }
+
+  /**
+   * @brief Measure wake up latency with a few short sleeps so the first real
+   * delays already use a fitting margin. Costs about p_rounds milliseconds.
+   */
+  void calibrate(int p_rounds = 20)
+  {
+    for (int i = 0; i < p_rounds; i++) {
+      sleep_phase(now_ns() + 1'000'000 + m_margin_ns);
+    }
+  }
+
+  /// Current spin window before the deadline
+  std::chrono::nanoseconds margin() const
+  {
+    return std::chrono::nanoseconds(m_margin_ns);
+  }
+
+  statistics stats() const
+  {
+    return m_stats;
+  }
+
+  void reset_stats()
+  {
+    m_stats = {};
+  }
+
+private:
+  static constexpr std::int64_t min_margin_ns = 10'000;
+  static constexpr std::int64_t max_margin_ns = 2'000'000;
+
+  static std::int64_t now_ns()
+  {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1'000'000'000LL + now.tv_nsec;
+  }
+
+  // Sleep until the margin before p_deadline and learn from how late the
+  // kernel woke us up.
+  void sleep_phase(std::int64_t p_deadline)
+  {
+    const auto wake = p_deadline - m_margin_ns;
+    if (wake <= now_ns()) {
+      return;
+    }
+    const timespec at{ .tv_sec = wake / 1'000'000'000,
+                       .tv_nsec = wake % 1'000'000'000 };
+    int error = 0;
+    while ((error = clock_nanosleep(
+              CLOCK_MONOTONIC, TIMER_ABSTIME, &at, nullptr)) == EINTR) {
+      // Interrupted by a signal, go back to sleep
+    }
+    // Anything else, such as EINVAL, leaves the rest to the spin phase
+    if (error != 0 || !m_auto_calibrate) {
+      return;
+    }
+    const auto latency = static_cast<double>(now_ns() - wake);
+    // Decaying maximum: jumps up on a late wake up, drifts down otherwise
+    m_latency_ns = std::max(latency, m_latency_ns * 0.98 + latency * 0.02);
+    const auto margin = static_cast<std::int64_t>(m_latency_ns * 1.5);
+    m_margin_ns = std::clamp(margin, min_margin_ns, max_margin_ns);
+  }
+
+  void record(std::int64_t p_overshoot_ns, std::int64_t p_spin_ns)
+  {
+    const auto samples = m_stats.samples + 1;
+    if (m_stats.samples == 0 || p_overshoot_ns < m_stats.min_ns) {
+      m_stats.min_ns = p_overshoot_ns;
+    }
+    if (m_stats.samples == 0 || p_overshoot_ns > m_stats.max_ns) {
+      m_stats.max_ns = p_overshoot_ns;
+    }
+    m_stats.mean_ns += (p_overshoot_ns - m_stats.mean_ns) / samples;
+    m_stats.mean_spin_ns += (p_spin_ns - m_stats.mean_spin_ns) / samples;
+    m_stats.samples = samples;
+  }
+
+  std::int64_t m_margin_ns;
+  double m_latency_ns;
+  bool m_auto_calibrate;
+  statistics m_stats;
+};
+
+/**
+ * @brief Drop in for hal::delay() that sleeps instead of spinning for all
+ * but the last stretch of the delay. Uses a precise_delay kept per thread.
+ * @param p_clock Clock to measure the delay with.
+ * @param p_duration Time to wait.
+ */
+inline void delay(hal::steady_clock& p_clock, hal::time_duration p_duration)
+{
+  thread_local precise_delay sleeper;
+  sleeper.sleep_for(p_clock, p_duration);
+}
+}  // namespace hal::linux
@@ -0,0 +1,223 @@
+#pragma once
+#include "errors.hpp"
+#include "realtime_context.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <libhal/error.hpp>
+#include <libhal/units.hpp>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace hal::linux {
+
+/**
+ * @brief Process wide epoll loop that runs on a single dedicated thread.
+ *
+ * Drivers that need to react to a file descriptor becoming readable or
+ * writable register it here instead of spawning a thread of their own. The
+ * thread sleeps in epoll_wait until one of the watched descriptors is ready.
+ *
+ * Handlers run on the event thread with the registry locked, so once
+ * unwatch() returns on any other thread the handler is guaranteed not to be
+ * running. Handlers may call watch() and unwatch() themselves. Handlers must
+ * tolerate spurious wake ups, as an event may already be in flight when a
+ * descriptor is unwatched.
+ */
+class event_thread
+{
+public:
+  using handler = void(std::uint32_t p_events);
+
+  /**
+   * @brief Get the process wide event thread, starting it on first use.
+   */
+  static event_thread& shared()
+  {
+    static event_thread instance;
+    return instance;
+  }
+
+  event_thread(const event_thread&) = delete;
+  event_thread& operator=(const event_thread&) = delete;
+
+  ~event_thread()
+  {
+    m_running = false;
+    wake();
+    if (m_thread.joinable()) {
+      m_thread.join();
+    }
+    close(m_wake_fd);
+    close(m_epoll_fd);
+  }
+
+  /**
+   * @brief Start watching a file descriptor, or replace the events and
+   * handler of one that is already watched.
+   * @param p_fd File descriptor to watch.
+   * @param p_events EPOLL* event mask to wait for.
+   * @param p_handler Called on the event thread with the ready events.
+   *
+   * @throws hal::linux::errno_exception if epoll refused the descriptor.
+   */
+  void watch(int p_fd,
+             std::uint32_t p_events,
+             hal::callback<handler> p_handler)
+  {
+    auto entry =
+      std::make_shared<hal::callback<handler>>(std::move(p_handler));
+    auto lock = acquire();
+    const bool exists = m_handlers.contains(p_fd);
+    epoll_event event{ .events = p_events, .data = { .fd = p_fd } };
+    if (epoll_ctl(m_epoll_fd,
+                  exists ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  p_fd,
+                  &event) < 0) {
+      throw errno_exception(errno, std::errc::bad_file_descriptor, this);
+    }
+    m_handlers[p_fd] = std::move(entry);
+  }
+
+  /**
+   * @brief Change the events a watched descriptor waits for, keeping its
+   * handler.
+   * @param p_fd File descriptor that was previously passed to watch().
+   * @param p_events New EPOLL* event mask.
+   *
+   * @throws hal::linux::errno_exception if epoll refused the change.
+   */
+  void modify(int p_fd, std::uint32_t p_events)
+  {
+    epoll_event event{ .events = p_events, .data = { .fd = p_fd } };
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, p_fd, &event) < 0) {
+      throw errno_exception(errno, std::errc::bad_file_descriptor, this);
+    }
+  }
+
+  /**
+   * @brief Stop watching a descriptor. Must be called before the descriptor
+   * is closed.
+   * @param p_fd File descriptor that was previously passed to watch().
+   */
+  void unwatch(int p_fd)
+  {
+    auto lock = acquire();
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, p_fd, nullptr);
+    m_handlers.erase(p_fd);
+  }
+
+  /**
+   * @brief Run the event thread under a hal::linux::realtime_context from
+   * now on, replacing any applied before. The thread applies it to itself
+   * before handling its next events. Settings the process lacks privileges
+   * for are skipped with a warning to hal::linux::deferred_log.
+   * @param p_settings Affinity, priority and memory settings to apply.
+   */
+  void realtime(const realtime_context::settings& p_settings)
+  {
+    {
+      auto lock = acquire();
+      m_realtime_settings = p_settings;
+    }
+    wake();
+  }
+
+  /// True when called from within a handler
+  bool in_event_thread() const
+  {
+    return std::this_thread::get_id() == m_thread_id;
+  }
+
+private:
+  static constexpr int max_events = 32;
+
+  event_thread()
+  {
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll_fd < 0) {
+      throw errno_exception(errno, std::errc::too_many_files_open, this);
+    }
+    m_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_wake_fd < 0) {
+      close(m_epoll_fd);
+      throw errno_exception(errno, std::errc::too_many_files_open, this);
+    }
+    epoll_event event{ .events = EPOLLIN, .data = { .fd = m_wake_fd } };
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &event);
+    m_thread = std::thread([this] { run(); });
+  }
+
+  // Handlers already hold the registry lock, so reentrant calls skip it.
+  std::unique_lock<std::mutex> acquire()
+  {
+    if (in_event_thread()) {
+      return {};
+    }
+    return std::unique_lock(m_lock);
+  }
+
+  void wake()
+  {
+    std::uint64_t one = 1;
+    [[maybe_unused]] auto res = write(m_wake_fd, &one, sizeof(one));
+  }
+
+  void run()
+  {
+    m_thread_id = std::this_thread::get_id();
+    epoll_event events[max_events];
+    while (m_running) {
+      const int count = epoll_wait(m_epoll_fd, events, max_events, -1);
+      if (count < 0) {
+        continue;  // EINTR
+      }
+
+      std::lock_guard lock(m_lock);
+      if (m_realtime_settings) {
+        m_realtime.reset();
+        m_realtime.emplace(*m_realtime_settings);
+        m_realtime_settings.reset();
+      }
+      for (int i = 0; i < count; i++) {
+        const int fd = events[i].data.fd;
+        if (fd == m_wake_fd) {
+          std::uint64_t discard;
+          [[maybe_unused]] auto res =
+            read(m_wake_fd, &discard, sizeof(discard));
+          continue;
+        }
+        auto found = m_handlers.find(fd);
+        if (found == m_handlers.end()) {
+          continue;
+        }
+        // Keep the handler alive even if it unwatches itself
+        auto entry = found->second;
+        try {
+          (*entry)(events[i].events);
+        } catch (...) {
+          // A failing driver must not take the loop down for everyone else
+        }
+      }
+    }
+    // Undo the thread settings on the thread they were applied to
+    m_realtime.reset();
+  }
+
+  int m_epoll_fd = -1;
+  int m_wake_fd = -1;
+  std::atomic<bool> m_running = true;
+  std::mutex m_lock;
+  std::unordered_map<int, std::shared_ptr<hal::callback<handler>>> m_handlers;
+  std::atomic<std::thread::id> m_thread_id;
+  std::optional<realtime_context::settings> m_realtime_settings;
+  std::optional<realtime_context> m_realtime;
+  std::thread m_thread;
+};
+}  // namespace hal::linux
@@ -0,0 +1,657 @@
+#pragma once
+#include "errors.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <libhal/error.hpp>
+#include <libhal/i2c.hpp>
+#include <libhal/steady_clock.hpp>
+#include <libhal/units.hpp>
+#include <linux/gpio.h>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace hal::linux {
+
+template<typename T = void>
+class task;
+
+/// State shared by every task promise
+struct task_promise_base
+{
+  struct final_awaiter
+  {
+    bool await_ready() noexcept
+    {
+      return false;
+    }
+
+    template<typename P>
+    std::coroutine_handle<> await_suspend(
+      std::coroutine_handle<P> p_self) noexcept
+    {
+      if (auto continuation = p_self.promise().m_continuation) {
+        return continuation;
+      }
+      return std::noop_coroutine();
+    }
+
+    void await_resume() noexcept
+    {
+    }
+  };
+
+  std::suspend_always initial_suspend() noexcept
+  {
+    return {};
+  }
+
+  final_awaiter final_suspend() noexcept
+  {
+    return {};
+  }
+
+  void unhandled_exception()
+  {
+    m_exception = std::current_exception();
+  }
+
+  void rethrow_if_failed()
+  {
+    if (m_exception) {
+      std::rethrow_exception(m_exception);
+    }
+  }
+
+  std::coroutine_handle<> m_continuation;
+  std::exception_ptr m_exception;
+};
+
+template<typename T>
+struct task_promise : task_promise_base
+{
+  task<T> get_return_object();
+
+  void return_value(T p_value)
+  {
+    m_value = std::move(p_value);
+  }
+
+  T result()
+  {
+    rethrow_if_failed();
+    return std::move(*m_value);
+  }
+
+  std::optional<T> m_value;
+};
+
+template<>
+struct task_promise<void> : task_promise_base
+{
+  task<void> get_return_object();
+
+  void return_void()
+  {
+  }
+
+  void result()
+  {
+    rethrow_if_failed();
+  }
+};
+
+/**
+ * @brief Lazily started coroutine. A task only runs once it is awaited by
+ * another task or handed to executor::spawn(). Awaiting a task yields its
+ * co_return value and rethrows any exception it let escape.
+ */
+template<typename T>
+class task
+{
+public:
+  using promise_type = task_promise<T>;
+
+  explicit task(std::coroutine_handle<promise_type> p_handle)
+    : m_handle(p_handle)
+  {
+  }
+
+  task(task&& p_other) noexcept
+    : m_handle(std::exchange(p_other.m_handle, {}))
+  {
+  }
+
+  task& operator=(task&& p_other) noexcept
+  {
+    if (this != &p_other) {
+      if (m_handle) {
+        m_handle.destroy();
+      }
+      m_handle = std::exchange(p_other.m_handle, {});
+    }
+    return *this;
+  }
+
+  ~task()
+  {
+    if (m_handle) {
+      m_handle.destroy();
+    }
+  }
+
+  bool await_ready() const noexcept
+  {
+    return !m_handle || m_handle.done();
+  }
+
+  std::coroutine_handle<> await_suspend(
+    std::coroutine_handle<> p_caller) noexcept
+  {
+    m_handle.promise().m_continuation = p_caller;
+    return m_handle;
+  }
+
+  T await_resume()
+  {
+    return m_handle.promise().result();
+  }
+
+  bool done() const
+  {
+    return !m_handle || m_handle.done();
+  }
+
+  std::coroutine_handle<promise_type> handle() const
+  {
+    return m_handle;
+  }
+
+private:
+  std::coroutine_handle<promise_type> m_handle;
+};
+
+template<typename T>
+task<T> task_promise<T>::get_return_object()
+{
+  return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object()
+{
+  return task<void>(
+    std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+/**
+ * @brief Single threaded coroutine executor built on epoll.
+ *
+ * Tasks spawned on the executor run on the thread that calls run(). Whenever
+ * a task waits for a descriptor, a timer or offloaded work it is suspended and
+ * the thread sleeps in epoll_wait, so one core can service many devices
+ * without a thread or context switch per device. Blocking work, such as an
+ * I2C transfer, runs on a single helper thread and its completion is
+ * signalled back through an eventfd.
+ *
+ * Only one task may wait for reads and one for writes on a given descriptor
+ * at a time.
+ */
+class executor
+{
+public:
+  /// Awaitable that resumes once a descriptor is ready
+  struct io_awaitable
+  {
+    bool await_ready() const noexcept
+    {
+      return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> p_handle)
+    {
+      m_executor->wait_for(m_fd, m_events, p_handle);
+    }
+
+    void await_resume() const noexcept
+    {
+    }
+
+    executor* m_executor;
+    int m_fd;
+    std::uint32_t m_events;
+  };
+
+  /// Awaitable that resumes once the executor's clock passes a deadline
+  struct timer_awaitable
+  {
+    bool await_ready() const
+    {
+      return m_executor->m_clock->uptime() >= m_deadline;
+    }
+
+    void await_suspend(std::coroutine_handle<> p_handle)
+    {
+      m_executor->add_timer(m_deadline, p_handle);
+    }
+
+    void await_resume() const noexcept
+    {
+    }
+
+    executor* m_executor;
+    std::uint64_t m_deadline;
+  };
+
+  /// Awaitable that runs a callable on the worker thread
+  struct work_awaitable
+  {
+    bool await_ready() const noexcept
+    {
+      return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> p_handle)
+    {
+      m_handle = p_handle;
+      m_executor->post_work(this);
+    }
+
+    void await_resume()
+    {
+      if (m_error) {
+        std::rethrow_exception(m_error);
+      }
+    }
+
+    executor* m_executor;
+    hal::callback<void(void)> m_work;
+    std::coroutine_handle<> m_handle{};
+    std::exception_ptr m_error{};
+  };
+
+  /**
+   * @brief Create an executor.
+   * @param p_clock Clock used for sleep_for() deadlines. Must outlive the
+   * executor.
+   *
+   * @throws hal::linux::errno_exception if the epoll, timer or eventfd
+   * descriptors could not be created.
+   */
+  explicit executor(hal::steady_clock& p_clock)
+    : m_clock(&p_clock)
+  {
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    m_done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_epoll_fd < 0 || m_timer_fd < 0 || m_done_fd < 0) {
+      const int error = errno;
+      close_descriptors();
+      throw errno_exception(error, std::errc::too_many_files_open, this);
+    }
+    for (int fd : { m_timer_fd, m_done_fd }) {
+      epoll_event event{ .events = EPOLLIN, .data = { .fd = fd } };
+      epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+  }
+
+  executor(const executor&) = delete;
+  executor& operator=(const executor&) = delete;
+
+  ~executor()
+  {
+    {
+      std::lock_guard lock(m_work_lock);
+      m_stopping = true;
+    }
+    m_work_signal.notify_one();
+    if (m_worker.joinable()) {
+      m_worker.join();
+    }
+    m_tasks.clear();
+    close_descriptors();
+  }
+
+  /**
+   * @brief Hand a task to the executor. It starts on the next pass of run().
+   * @param p_task Task to run, owned by the executor from now on.
+   */
+  void spawn(task<> p_task)
+  {
+    m_ready.push_back(p_task.handle());
+    m_tasks.push_back(std::move(p_task));
+  }
+
+  /**
+   * @brief Run spawned tasks on the calling thread until all of them finished.
+   *
+   * @throws Whatever the first failing spawned task let escape. The remaining
+   * tasks stay suspended and may be resumed by calling run() again.
+   */
+  void run()
+  {
+    while (!m_tasks.empty()) {
+      while (!m_ready.empty()) {
+        auto handle = m_ready.front();
+        m_ready.pop_front();
+        handle.resume();
+      }
+      reap();
+      if (m_tasks.empty() || !m_ready.empty()) {
+        continue;
+      }
+      poll_events();
+    }
+  }
+
+  /// Suspend until p_fd is readable
+  [[nodiscard]] io_awaitable readable(int p_fd)
+  {
+    return { this, p_fd, EPOLLIN };
+  }
+
+  /// Suspend until p_fd is writable
+  [[nodiscard]] io_awaitable writable(int p_fd)
+  {
+    return { this, p_fd, EPOLLOUT };
+  }
+
+  /// Suspend until a driver exposing native_handle(), such as
+  /// hal::linux::serial, has data to read
+  template<typename Device>
+  requires requires(Device& p_device) { p_device.native_handle(); }
+  [[nodiscard]] io_awaitable readable(Device& p_device)
+  {
+    return readable(p_device.native_handle());
+  }
+
+  /**
+   * @brief Suspend for a duration measured on the executor's clock.
+   * @param p_duration Time to wait for.
+   */
+  [[nodiscard]] timer_awaitable sleep_for(hal::time_duration p_duration)
+  {
+    const auto ticks_per_ns = m_clock->frequency() / 1e9;
+    const auto ticks =
+      static_cast<std::uint64_t>(p_duration.count() * ticks_per_ns);
+    return { this, m_clock->uptime() + ticks };
+  }
+
+  /**
+   * @brief Run blocking work on the worker thread and resume once it is done.
+   * Any exception thrown by the work is rethrown in the awaiting task.
+   * @param p_work Callable to run, must not touch executor state.
+   */
+  [[nodiscard]] work_awaitable offload(hal::callback<void(void)> p_work)
+  {
+    return { .m_executor = this, .m_work = std::move(p_work) };
+  }
+
+  /**
+   * @brief Wait for the next edge of a line requested with edge detection,
+   * such as hal::linux::interrupt_pin. The line must not also have a handler
+   * installed, as that would drain the events first.
+   * @param p_line_fd Line request file descriptor, opened non-blocking.
+   * @return The kernel's record of the edge, including its timestamp.
+   */
+  task<gpio_v2_line_event> edge(int p_line_fd)
+  {
+    gpio_v2_line_event event;
+    while (true) {
+      co_await readable(p_line_fd);
+      if (read(p_line_fd, &event, sizeof(event)) == sizeof(event)) {
+        co_return event;
+      }
+    }
+  }
+
+  template<typename Device>
+  requires requires(Device& p_device) { p_device.native_handle(); }
+  task<gpio_v2_line_event> edge(Device& p_device)
+  {
+    return edge(p_device.native_handle());
+  }
+
+  /**
+   * @brief Perform an I2C transaction on the worker thread, leaving the
+   * executor free to service other devices while the bus is busy.
+   * @param p_bus Bus to use, must only be used by one transaction at a time.
+   * @param p_address 7 or 10 bit peripheral address.
+   * @param p_data_out Bytes to write, must stay valid until completion.
+   * @param p_data_in Bytes to read into, must stay valid until completion.
+   */
+  task<> transaction(hal::i2c& p_bus,
+                     hal::byte p_address,
+                     std::span<const hal::byte> p_data_out,
+                     std::span<hal::byte> p_data_in)
+  {
+    co_await offload([&p_bus, p_address, p_data_out, p_data_in]() {
+      p_bus.transaction(p_address, p_data_out, p_data_in, []() {});
+    });
+  }
+
+private:
+  struct fd_waiters
+  {
+    std::coroutine_handle<> reader;
+    std::coroutine_handle<> writer;
+  };
+
+  struct timer_entry
+  {
+    std::uint64_t deadline;
+    std::coroutine_handle<> handle;
+
+    bool operator>(const timer_entry& p_other) const
+    {
+      return deadline > p_other.deadline;
+    }
+  };
+
+  void close_descriptors()
+  {
+    for (int fd : { m_epoll_fd, m_timer_fd, m_done_fd }) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+
+  void wait_for(int p_fd, std::uint32_t p_events, std::coroutine_handle<> p_h)
+  {
+    auto [entry, inserted] = m_waiters.try_emplace(p_fd);
+    auto& waiters = entry->second;
+    auto& slot = (p_events & EPOLLIN) ? waiters.reader : waiters.writer;
+    if (slot) {
+      throw hal::device_or_resource_busy(this);
+    }
+    slot = p_h;
+    update_registration(p_fd, waiters, inserted);
+  }
+
+  void update_registration(int p_fd, const fd_waiters& p_waiters, bool p_new)
+  {
+    std::uint32_t events = 0;
+    if (p_waiters.reader) {
+      events |= EPOLLIN;
+    }
+    if (p_waiters.writer) {
+      events |= EPOLLOUT;
+    }
+    if (events == 0) {
+      epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, p_fd, nullptr);
+      m_waiters.erase(p_fd);
+      return;
+    }
+    epoll_event event{ .events = events, .data = { .fd = p_fd } };
+    if (epoll_ctl(
+          m_epoll_fd, p_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, p_fd, &event) <
+        0) {
+      throw errno_exception(errno, std::errc::bad_file_descriptor, this);
+    }
+  }
+
+  void add_timer(std::uint64_t p_deadline, std::coroutine_handle<> p_handle)
+  {
+    m_timers.push_back({ p_deadline, p_handle });
+    std::push_heap(m_timers.begin(), m_timers.end(), std::greater<>{});
+    arm_timer();
+  }
+
+  void arm_timer()
+  {
+    itimerspec when{};
+    if (!m_timers.empty()) {
+      const auto now = m_clock->uptime();
+      const auto deadline = m_timers.front().deadline;
+      const auto ticks = deadline > now ? deadline - now : 0;
+      auto ns = static_cast<std::uint64_t>(ticks * 1e9 / m_clock->frequency());
+      // A zero it_value disarms the timer, so fire as soon as possible instead
+      ns = std::max<std::uint64_t>(ns, 1);
+      when.it_value.tv_sec = ns / 1'000'000'000;
+      when.it_value.tv_nsec = ns % 1'000'000'000;
+    }
+    timerfd_settime(m_timer_fd, 0, &when, nullptr);
+  }
+
+  void expire_timers()
+  {
+    std::uint64_t discard;
+    [[maybe_unused]] auto res = read(m_timer_fd, &discard, sizeof(discard));
+    const auto now = m_clock->uptime();
+    while (!m_timers.empty() && m_timers.front().deadline <= now) {
+      std::pop_heap(m_timers.begin(), m_timers.end(), std::greater<>{});
+      m_ready.push_back(m_timers.back().handle);
+      m_timers.pop_back();
+    }
+    arm_timer();
+  }
+
+  void post_work(work_awaitable* p_work)
+  {
+    {
+      std::lock_guard lock(m_work_lock);
+      m_pending_work.push_back(p_work);
+      if (!m_worker.joinable()) {
+        m_worker = std::thread([this] { work(); });
+      }
+    }
+    m_work_signal.notify_one();
+  }
+
+  void work()
+  {
+    std::unique_lock lock(m_work_lock);
+    while (true) {
+      m_work_signal.wait(
+        lock, [this] { return m_stopping || !m_pending_work.empty(); });
+      if (m_stopping) {
+        return;
+      }
+      auto* item = m_pending_work.front();
+      m_pending_work.pop_front();
+      lock.unlock();
+      try {
+        item->m_work();
+      } catch (...) {
+        item->m_error = std::current_exception();
+      }
+      lock.lock();
+      m_finished_work.push_back(item);
+      std::uint64_t one = 1;
+      [[maybe_unused]] auto res = write(m_done_fd, &one, sizeof(one));
+    }
+  }
+
+  void complete_work()
+  {
+    std::uint64_t discard;
+    [[maybe_unused]] auto res = read(m_done_fd, &discard, sizeof(discard));
+    std::lock_guard lock(m_work_lock);
+    for (auto* item : m_finished_work) {
+      m_ready.push_back(item->m_handle);
+    }
+    m_finished_work.clear();
+  }
+
+  void poll_events()
+  {
+    epoll_event events[max_events];
+    const int count = epoll_wait(m_epoll_fd, events, max_events, -1);
+    for (int i = 0; i < count; i++) {
+      const int fd = events[i].data.fd;
+      const auto ready = events[i].events;
+      if (fd == m_timer_fd) {
+        expire_timers();
+        continue;
+      }
+      if (fd == m_done_fd) {
+        complete_work();
+        continue;
+      }
+      auto found = m_waiters.find(fd);
+      if (found == m_waiters.end()) {
+        continue;
+      }
+      auto& waiters = found->second;
+      const bool failed = ready & (EPOLLERR | EPOLLHUP);
+      if (waiters.reader && (failed || (ready & EPOLLIN))) {
+        m_ready.push_back(std::exchange(waiters.reader, {}));
+      }
+      if (waiters.writer && (failed || (ready & EPOLLOUT))) {
+        m_ready.push_back(std::exchange(waiters.writer, {}));
+      }
+      update_registration(fd, waiters, false);
+    }
+  }
+
+  void reap()
+  {
+    std::exception_ptr error;
+    std::erase_if(m_tasks, [&error](task<>& p_task) {
+      if (!p_task.done()) {
+        return false;
+      }
+      auto& promise = p_task.handle().promise();
+      if (promise.m_exception && !error) {
+        error = promise.m_exception;
+      }
+      return true;
+    });
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  static constexpr int max_events = 32;
+
+  hal::steady_clock* m_clock;
+  int m_epoll_fd = -1;
+  int m_timer_fd = -1;
+  int m_done_fd = -1;
+  std::vector<task<>> m_tasks;
+  std::deque<std::coroutine_handle<>> m_ready;
+  std::unordered_map<int, fd_waiters> m_waiters;
+  std::vector<timer_entry> m_timers;
+
+  std::mutex m_work_lock;
+  std::condition_variable m_work_signal;
+  std::deque<work_awaitable*> m_pending_work;
+  std::vector<work_awaitable*> m_finished_work;
+  bool m_stopping = false;
+  std::thread m_worker;
+};
+}  // namespace hal::linux
@@ -0,0 +1,251 @@
+#pragma once
+#include "errors.hpp"
+#include "line_request.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <libhal/error.hpp>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace hal::linux {
+
+/**
+ * @brief Ref-counted handle to an open GPIO character device.
+ *
+ * Every driver that talks to the same chip path shares one file descriptor
+ * through the process wide registry behind gpio_chip::open(). The device is
+ * opened by the first user and closed when the last handle is released. Once
+ * a chip is open, further lookups only take a shared lock and never touch the
+ * kernel. Each syscall policy has a registry of its own.
+ */
+template<class syscalls>
+class basic_gpio_chip
+{
+public:
+  /**
+   * @brief Get the shared handle for a chip path, opening it if no other
+   * driver currently holds it. Thread safe.
+   * @param p_chip_name Full path to GPIO character device.
+   *
+   * @throws hal::linux::invalid_character_device if the device could not be
+   * opened.
+   */
+  static std::shared_ptr<basic_gpio_chip> open(const std::string& p_chip_name)
+  {
+    auto& chips = registry();
+    {
+      std::shared_lock lock(chips.lock);
+      auto found = chips.handles.find(p_chip_name);
+      if (found != chips.handles.end()) {
+        if (auto chip = found->second.lock()) {
+          return chip;
+        }
+      }
+    }
+
+    std::unique_lock lock(chips.lock);
+    auto& slot = chips.handles[p_chip_name];
+    // Another thread may have opened it while the lock was released
+    if (auto chip = slot.lock()) {
+      return chip;
+    }
+    const int fd = syscalls::open(p_chip_name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      chips.handles.erase(p_chip_name);
+      throw invalid_character_device(p_chip_name, errno, nullptr);
+    }
+    auto chip =
+      std::shared_ptr<basic_gpio_chip>(new basic_gpio_chip(p_chip_name, fd));
+    slot = chip;
+    return chip;
+  }
+
+  basic_gpio_chip(const basic_gpio_chip&) = delete;
+  basic_gpio_chip& operator=(const basic_gpio_chip&) = delete;
+
+  ~basic_gpio_chip()
+  {
+    syscalls::close(m_fd);
+  }
+
+  int fd() const
+  {
+    return m_fd;
+  }
+
+  const std::string& path() const
+  {
+    return m_path;
+  }
+
+private:
+  struct chip_registry
+  {
+    std::shared_mutex lock;
+    std::unordered_map<std::string, std::weak_ptr<basic_gpio_chip>> handles;
+  };
+
+  static chip_registry& registry()
+  {
+    static chip_registry instance;
+    return instance;
+  }
+
+  basic_gpio_chip(std::string p_path, int p_fd)
+    : m_path(std::move(p_path))
+    , m_fd(p_fd)
+  {
+  }
+
+  std::string m_path;
+  int m_fd;
+};
+
+/**
+ * @brief A line within a line request that may be shared with other pins.
+ */
+template<class syscalls>
+struct basic_line_handle
+{
+  std::shared_ptr<basic_gpio_chip<syscalls>> chip;
+  std::shared_ptr<basic_line_request<syscalls>> request;
+  std::size_t index = 0;
+
+  std::uint64_t mask() const
+  {
+    return std::uint64_t{ 1 } << index;
+  }
+};
+
+/**
+ * @brief Configuration phase that merges pins of one chip into as few line
+ * requests as possible.
+ *
+ * Pins constructed from a batch only record their offset and flags. Calling
+ * commit() then issues one GPIO_V2_GET_LINE_IOCTL per GPIO_V2_LINES_MAX lines
+ * instead of one per pin, and all pins of a request share a single line fd.
+ * Pins must not be read or written before the batch is committed. Configuring
+ * them beforehand is free, as their flags are folded into the request.
+ *
+ * If commit() was never called, the destructor commits and ignores errors.
+ */
+template<class syscalls>
+class basic_line_batch
+{
+public:
+  /**
+   * @brief Start a configuration phase for a chip.
+   * @param p_chip_name Full path to GPIO character device.
+   *
+   * @throws hal::linux::invalid_character_device if an invalid chip path was
+   * given.
+   */
+  basic_line_batch(const std::string& p_chip_name)
+    : m_chip(basic_gpio_chip<syscalls>::open(p_chip_name))
+  {
+  }
+
+  basic_line_batch(const basic_line_batch&) = delete;
+  basic_line_batch& operator=(const basic_line_batch&) = delete;
+
+  ~basic_line_batch()
+  {
+    try {
+      commit();
+    } catch (...) {
+      // Pins of a failed request report the error on first use
+    }
+  }
+
+  /**
+   * @brief Reserve a line in the batch, starting a new request once the
+   * current one is full or can no longer describe the per-line flags.
+   * @param p_offset Line offset known to the GPIO character device.
+   * @param p_flags GPIO_V2_LINE_FLAG_* flags for the line.
+   *
+   * @throws hal::operation_not_permitted if the batch was already committed.
+   */
+  basic_line_handle<syscalls> add(std::uint32_t p_offset,
+                                  std::uint64_t p_flags)
+  {
+    if (m_committed) {
+      throw hal::operation_not_permitted(this);
+    }
+    if (m_requests.empty()) {
+      m_requests.push_back(std::make_shared<request_type>());
+    }
+    try {
+      const auto index = m_requests.back()->add(p_offset, p_flags);
+      return { .chip = m_chip, .request = m_requests.back(), .index = index };
+    } catch (const hal::argument_out_of_domain&) {
+      m_requests.push_back(std::make_shared<request_type>());
+      const auto index = m_requests.back()->add(p_offset, p_flags);
+      return { .chip = m_chip, .request = m_requests.back(), .index = index };
+    }
+  }
+
+  /**
+   * @brief Hand every reserved line to the kernel.
+   *
+   * @throws hal::linux::errno_exception if the kernel refused a request.
+   */
+  void commit()
+  {
+    if (m_committed) {
+      return;
+    }
+    m_committed = true;
+    for (auto& request : m_requests) {
+      request->commit(m_chip->fd());
+    }
+  }
+
+  /// Number of line requests the batch has merged its pins into
+  std::size_t request_count() const
+  {
+    return m_requests.size();
+  }
+
+private:
+  using request_type = basic_line_request<syscalls>;
+
+  std::shared_ptr<basic_gpio_chip<syscalls>> m_chip;
+  std::vector<std::shared_ptr<request_type>> m_requests;
+  bool m_committed = false;
+};
+
+/**
+ * @brief Request a single line on its own, going through the chip registry.
+ * @param p_chip_name Full path to GPIO character device.
+ * @param p_offset Line offset known to the GPIO character device.
+ * @param p_flags GPIO_V2_LINE_FLAG_* flags for the line.
+ * @param p_event_buffer_size Kernel event buffer size hint for edge events.
+ *
+ * @throws hal::linux::invalid_character_device if an invalid chip path was
+ * given.
+ * @throws hal::linux::errno_exception if a request to said line failed.
+ */
+template<class syscalls = posix_syscalls>
+basic_line_handle<syscalls> request_line(const std::string& p_chip_name,
+                                         std::uint32_t p_offset,
+                                         std::uint64_t p_flags,
+                                         std::uint32_t p_event_buffer_size = 0)
+{
+  auto chip = basic_gpio_chip<syscalls>::open(p_chip_name);
+  const std::uint32_t offsets[] = { p_offset };
+  const std::uint64_t flags[] = { p_flags };
+  auto request = std::make_shared<basic_line_request<syscalls>>(
+    chip->fd(), offsets, flags, p_event_buffer_size);
+  return { .chip = std::move(chip), .request = std::move(request) };
+}
+
+using gpio_chip = basic_gpio_chip<posix_syscalls>;
+using line_handle = basic_line_handle<posix_syscalls>;
+using line_batch = basic_line_batch<posix_syscalls>;
+}  // namespace hal::linux
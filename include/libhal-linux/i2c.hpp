@@ -1,29 +1,145 @@
 #pragma once
 
+#include "deferred_log.hpp"
+#include "instrumentation.hpp"
+#include "syscalls.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
 #include <errno.h>
 #include <fcntl.h>
+#include <libhal/error.hpp>
 #include <libhal/i2c.hpp>
 #include <linux/i2c-dev.h>
 #include <linux/i2c.h>
-#include <string.h>
+#include <span>
 #include <string>
 #include <sys/ioctl.h>
+#include <system_error>
 #include <unistd.h>
 
-namespace {
-inline auto linux_read(int fd, void* buf, size_t nbytes)
-{
-  return read(fd, buf, nbytes);
-}
+namespace hal::linux {
 
-inline auto linux_write(int fd, const void* buf, size_t nbytes)
+/**
+ * @brief Reads and writes, possibly to several peripherals, that are sent to
+ * the adapter with a single I2C_RDWR ioctl.
+ *
+ * Messages go out in the order they were added, separated by repeated starts
+ * and with one stop at the very end, so a batch samples several devices
+ * within one bus transaction. Buffers are referenced, not copied, and must
+ * stay valid until hal::linux::i2c::transfer() returns. A batch can be reused
+ * for the next cycle as is, or cleared and refilled.
+ */
+class i2c_batch
 {
-  return write(fd, buf, nbytes);
-}
-}  // namespace
+public:
+  static constexpr std::size_t max_messages = I2C_RDWR_IOCTL_MAX_MSGS;
 
-namespace hal::linux {
-class i2c : public hal::i2c
+  /// Outcome of one message of the batch
+  struct result
+  {
+    /// The bytes that were read, or the bytes written for a write
+    std::span<const hal::byte> data;
+    /// Zero on success, std::errc::operation_canceled if the message was
+    /// not sent because an earlier one failed, the kernel's error otherwise.
+    std::errc error = std::errc::operation_canceled;
+
+    bool ok() const
+    {
+      return error == std::errc{};
+    }
+  };
+
+  /**
+   * @brief Append a write.
+   * @param p_address 7 bit address, or 10 bit address if above 0x7F.
+   * @param p_data Bytes to write.
+   * @return Index of the message in the batch.
+   *
+   * @throws hal::argument_out_of_domain if the batch is full.
+   */
+  std::size_t write(std::uint16_t p_address, std::span<const hal::byte> p_data)
+  {
+    auto* data = const_cast<hal::byte*>(p_data.data());
+    return add(p_address, 0, data, p_data.size());
+  }
+
+  /**
+   * @brief Append a read.
+   * @param p_address 7 bit address, or 10 bit address if above 0x7F.
+   * @param p_data Buffer that receives the bytes.
+   * @return Index of the message in the batch.
+   *
+   * @throws hal::argument_out_of_domain if the batch is full.
+   */
+  std::size_t read(std::uint16_t p_address, std::span<hal::byte> p_data)
+  {
+    return add(p_address, I2C_M_RD, p_data.data(), p_data.size());
+  }
+
+  /// Outcome of the message at p_index from the last transfer
+  const result& operator[](std::size_t p_index) const
+  {
+    return m_results[p_index];
+  }
+
+  std::size_t size() const
+  {
+    return m_count;
+  }
+
+  void clear()
+  {
+    m_count = 0;
+  }
+
+private:
+  template<class syscalls>
+  friend class basic_i2c;
+
+  std::size_t add(std::uint16_t p_address,
+                  std::uint16_t p_flags,
+                  hal::byte* p_data,
+                  std::size_t p_size)
+  {
+    if (m_count == max_messages || p_size > UINT16_MAX) {
+      throw hal::argument_out_of_domain(this);
+    }
+    if (p_address > 0x7F) {
+      p_flags |= I2C_M_TEN;
+    }
+    m_messages[m_count] = {
+      .addr = p_address,
+      .flags = p_flags,
+      .len = static_cast<std::uint16_t>(p_size),
+      .buf = p_data,
+    };
+    m_results[m_count] = { .data = { p_data, p_size } };
+    return m_count++;
+  }
+
+  // Mark messages [p_first, p_last) with the outcome of their submission
+  void settle(std::size_t p_first, std::size_t p_last, std::errc p_error)
+  {
+    for (auto i = p_first; i < p_last; i++) {
+      m_results[i].error = p_error;
+    }
+  }
+
+  std::array<i2c_msg, max_messages> m_messages{};
+  std::array<result, max_messages> m_results{};
+  std::size_t m_count = 0;
+};
+
+/**
+ * @brief hal::i2c over an i2c-dev character device, /dev/i2c-N.
+ *
+ * All kernel calls go through the syscalls policy, see
+ * hal::linux::posix_syscalls. Use the hal::linux::i2c alias for real
+ * hardware.
+ */
+template<class syscalls>
+class basic_i2c : public hal::i2c
 {
 public:
   /**
@@ -33,17 +149,211 @@ public:
    * @throws hal::io_error if the device was not found or a file descriptor
    * could not be opened.
    */
-  i2c(const std::string& p_file_path)
+  basic_i2c(const std::string& p_file_path)
+    : m_log_device(deferred_log::device_id(p_file_path))
+    , m_stats(p_file_path)
   {
-    m_fd = open(p_file_path.c_str(), O_RDWR);
+    m_fd = syscalls::open(p_file_path.c_str(), O_RDWR);
     if (m_fd < 0) {
       throw hal::io_error(this);
     }
+    // Adapters that cannot report their capabilities get plain i2c only
+    if (syscalls::ioctl(m_fd, I2C_FUNCS, &m_functionality) < 0) {
+      m_functionality = I2C_FUNC_I2C;
+    }
+  }
+
+  virtual ~basic_i2c()
+  {
+    syscalls::close(m_fd);
+  }
+
+  /// File descriptor of the i2c adapter
+  int native_handle() const
+  {
+    return m_fd;
+  }
+
+  /// I2C_FUNC_* capabilities of the adapter, queried once on construction
+  unsigned long functionality() const
+  {
+    return m_functionality;
+  }
+
+  /// True if the adapter supports every capability in p_functions
+  bool supports(unsigned long p_functions) const
+  {
+    return (m_functionality & p_functions) == p_functions;
+  }
+
+  /// Counters of this bus, empty unless built with HAL_LINUX_INSTRUMENTATION
+  const driver_stats& stats() const
+  {
+    return m_stats;
+  }
+
+  /**
+   * @brief Read an 8 bit register, using an SMBus read byte data transfer
+   * when the adapter offers one and an I2C_RDWR write-then-read otherwise.
+   * @param p_address 7 bit peripheral address.
+   * @param p_register Register to read.
+   *
+   * @throws hal::no_such_device if the peripheral did not acknowledge.
+   * @throws hal::io_error if the transfer failed otherwise.
+   */
+  hal::byte read_register(hal::byte p_address, hal::byte p_register)
+  {
+    if (supports(I2C_FUNC_SMBUS_READ_BYTE_DATA)) {
+      i2c_smbus_data data;
+      smbus(p_address, I2C_SMBUS_READ, p_register, I2C_SMBUS_BYTE_DATA, &data);
+      return data.byte;
+    }
+    hal::byte value = 0;
+    write_then_read(p_address, p_register, { &value, 1 });
+    return value;
+  }
+
+  /**
+   * @brief Read a 16 bit little endian register, the SMBus word layout.
+   * @param p_address 7 bit peripheral address.
+   * @param p_register Register to read.
+   *
+   * @throws hal::no_such_device if the peripheral did not acknowledge.
+   * @throws hal::io_error if the transfer failed otherwise.
+   */
+  std::uint16_t read_register_word(hal::byte p_address, hal::byte p_register)
+  {
+    if (supports(I2C_FUNC_SMBUS_READ_WORD_DATA)) {
+      i2c_smbus_data data;
+      smbus(p_address, I2C_SMBUS_READ, p_register, I2C_SMBUS_WORD_DATA, &data);
+      return data.word;
+    }
+    std::array<hal::byte, 2> value{};
+    write_then_read(p_address, p_register, value);
+    return static_cast<std::uint16_t>(value[0] | value[1] << 8);
+  }
+
+  /**
+   * @brief Write an 8 bit register, using an SMBus write byte data transfer
+   * when the adapter offers one and a single I2C_RDWR message otherwise.
+   * @param p_address 7 bit peripheral address.
+   * @param p_register Register to write.
+   * @param p_value Value to write.
+   *
+   * @throws hal::no_such_device if the peripheral did not acknowledge.
+   * @throws hal::io_error if the transfer failed otherwise.
+   */
+  void write_register(hal::byte p_address,
+                      hal::byte p_register,
+                      hal::byte p_value)
+  {
+    if (supports(I2C_FUNC_SMBUS_WRITE_BYTE_DATA)) {
+      i2c_smbus_data data;
+      data.byte = p_value;
+      smbus(p_address, I2C_SMBUS_WRITE, p_register, I2C_SMBUS_BYTE_DATA, &data);
+      return;
+    }
+    std::array<hal::byte, 2> payload = { p_register, p_value };
+    write_message(p_address, payload);
+  }
+
+  /**
+   * @brief Write a 16 bit little endian register, the SMBus word layout.
+   * @param p_address 7 bit peripheral address.
+   * @param p_register Register to write.
+   * @param p_value Value to write.
+   *
+   * @throws hal::no_such_device if the peripheral did not acknowledge.
+   * @throws hal::io_error if the transfer failed otherwise.
+   */
+  void write_register_word(hal::byte p_address,
+                           hal::byte p_register,
+                           std::uint16_t p_value)
+  {
+    if (supports(I2C_FUNC_SMBUS_WRITE_WORD_DATA)) {
+      i2c_smbus_data data;
+      data.word = p_value;
+      smbus(p_address, I2C_SMBUS_WRITE, p_register, I2C_SMBUS_WORD_DATA, &data);
+      return;
+    }
+    std::array<hal::byte, 3> payload = { p_register,
+                                         static_cast<hal::byte>(p_value),
+                                         static_cast<hal::byte>(p_value >> 8) };
+    write_message(p_address, payload);
+  }
+
+  /**
+   * @brief Read consecutive registers starting at p_register. Uses SMBus
+   * i2c block reads, in chunks of up to 32 bytes, when the adapter offers
+   * them, and one I2C_RDWR write-then-read otherwise.
+   * @param p_address 7 bit peripheral address.
+   * @param p_register First register to read.
+   * @param p_data Buffer to fill.
+   *
+   * @throws hal::no_such_device if the peripheral did not acknowledge.
+   * @throws hal::io_error if the transfer failed otherwise.
+   */
+  void block_read(hal::byte p_address,
+                  hal::byte p_register,
+                  std::span<hal::byte> p_data)
+  {
+    if (!supports(I2C_FUNC_SMBUS_READ_I2C_BLOCK)) {
+      write_then_read(p_address, p_register, p_data);
+      return;
+    }
+    while (!p_data.empty()) {
+      const auto count =
+        std::min<std::size_t>(p_data.size(), I2C_SMBUS_BLOCK_MAX);
+      i2c_smbus_data data;
+      data.block[0] = static_cast<__u8>(count);
+      smbus(p_address,
+            I2C_SMBUS_READ,
+            p_register,
+            I2C_SMBUS_I2C_BLOCK_DATA,
+            &data);
+      std::copy_n(&data.block[1], count, p_data.begin());
+      p_data = p_data.subspan(count);
+      p_register += count;
+    }
   }
 
-  virtual ~i2c()
+  /**
+   * @brief Send every message of a batch with one I2C_RDWR ioctl.
+   *
+   * When the adapter rejects the transfer the kernel does not say which
+   * message failed, so every message is marked with the error. With
+   * p_isolate_failures set, the batch is then resent one peripheral at a time,
+   * each run of consecutive messages to the same address in its own ioctl,
+   * so the failing peripheral is pinned down and the healthy ones still
+   * deliver data. Only enable that for batches whose writes are safe to send
+   * twice.
+   * @param p_batch Messages to send, results are stored back into it.
+   * @param p_isolate_failures Resend per peripheral to attribute a failure.
+   * @return true if every message succeeded.
+   */
+  bool transfer(i2c_batch& p_batch, bool p_isolate_failures = false)
   {
-    close(m_fd);
+    if (p_batch.m_count == 0) {
+      return true;
+    }
+    const bool ok = submit(p_batch, 0, p_batch.m_count);
+    if (ok || !p_isolate_failures) {
+      return ok;
+    }
+
+    const auto& messages = p_batch.m_messages;
+    bool all_ok = true;
+    std::size_t first = 0;
+    while (first < p_batch.m_count) {
+      auto last = first + 1;
+      while (last < p_batch.m_count &&
+             messages[last].addr == messages[first].addr) {
+        last++;
+      }
+      all_ok &= submit(p_batch, first, last);
+      first = last;
+    }
+    return all_ok;
   }
 
 private:
@@ -58,6 +368,10 @@ private:
     std::span<hal::byte> p_data_in,
     hal::function_ref<hal::timeout_function> p_timeout) override
   {
+    HAL_LINUX_PROBE3(
+      i2c_transaction, p_address, p_data_out.size(), p_data_in.size());
+    auto operation = m_stats.measure(p_data_out.size() + p_data_in.size());
+
     // Check if we're a 10 bit address
     // The first 5 bytes MUST be this pattern to be considered a 10 bit address
     constexpr hal::byte ten_bit_mask = 0b1111'0 << 2;
@@ -65,79 +379,195 @@ private:
     std::uint16_t real_address = 0;
 
     if (is_ten_bit) {
-      real_address = p_address << 8 | p_data_out[0];
+      // The two low bits of the prefix are address bits 9:8, the first byte
+      // written holds bits 7:0 and is not part of the payload.
+      if (p_data_out.empty()) {
+        throw hal::argument_out_of_domain(this);
+      }
+      real_address = (p_address & 0b11) << 8 | p_data_out[0];
+      p_data_out = p_data_out.subspan(1);
     } else {
       real_address = p_address;
     }
-    // Enable 10 bit mode if set
-    if (ioctl(m_fd, I2C_TENBIT, is_ten_bit) < 0) {
-      printf("[DEBUG] Failed 10 bit ioctl, errno is: %d, errno says: %s\n",
-             errno,
-             strerror(errno));
-      throw hal::operation_not_supported(this);
-    }
-
-    // Set peripheral address
-    if (ioctl(m_fd, I2C_SLAVE, real_address) < 0) {
-      printf(
-        "[DEBUG] Failed slave setting ioctl, errno is: %d, errno says: %s\n",
-        errno,
-        strerror(errno));
-      throw hal::no_such_device(real_address, this);
-    }
 
     const bool is_reading = p_data_out.empty();
-    const bool write_then_read =
-      &p_data_out.data()[0] != nullptr && &p_data_in.data()[0] != nullptr;
+    const bool write_then_read = !p_data_out.empty() && !p_data_in.empty();
 
     if (write_then_read) {
+      // The address travels inside each message, no setup ioctls needed
+      const std::uint16_t flags = is_ten_bit ? I2C_M_TEN : 0;
       struct i2c_rdwr_ioctl_data data_queue;
       struct i2c_msg msgs[2];
       // First, the message thats to be written
       msgs[0].addr = real_address;
       msgs[0].buf = (__u8*)(&p_data_out.data()[0]);
-      msgs[0].flags = 0;
+      msgs[0].flags = flags;
       msgs[0].len = p_data_out.size();
 
       // Next, the message thats to be read
       msgs[1].addr = real_address;
       msgs[1].buf = (__u8*)(&p_data_in.data()[0]);
-      msgs[1].flags = I2C_M_RD;
-      msgs->len = p_data_in.size();
+      msgs[1].flags = flags | I2C_M_RD;
+      msgs[1].len = p_data_in.size();
 
       data_queue.nmsgs = 2;
       data_queue.msgs = msgs;
-      if (ioctl(m_fd, I2C_RDWR, &data_queue) < 0) {
-        printf("[DEBUG] Failed writing then reading data, errno is: %d, errno "
-               "says: %s\n",
-               errno,
-               strerror(errno));
+      if (syscalls::ioctl(m_fd, I2C_RDWR, &data_queue) < 0) {
+        log_error(
+          log_event::i2c_write_then_read, m_log_device, real_address, errno);
         throw hal::operation_not_permitted(this);
       }
       return;
     }
 
+    select(real_address, is_ten_bit);
+
     if (is_reading) {
-      int res;
-      if ((res = linux_read(m_fd, &p_data_in.data()[0], p_data_in.size())) ==
-          -1) {
-        printf("[DEBUG] Failed reading data, errno is: %d, errno says: %s\n",
-               errno,
-               strerror(errno));
+      if (syscalls::read(m_fd, p_data_in.data(), p_data_in.size()) == -1) {
+        log_error(log_event::i2c_read, m_log_device, real_address, errno);
         throw hal::operation_not_permitted(this);
       }
     } else {
-      int res;
-      if ((res = linux_write(m_fd, &p_data_out.data()[0], p_data_out.size())) ==
-          -1) {
-        printf("[DEBUG] Failed writing data, errno is: %d, errno says: %s\n",
-               errno,
-               strerror(errno));
+      if (syscalls::write(m_fd, p_data_out.data(), p_data_out.size()) == -1) {
+        log_error(log_event::i2c_write, m_log_device, real_address, errno);
         throw hal::operation_not_permitted(this);
       }
     }
   }
 
+  /**
+   * @brief Point plain read() and write() calls at a peripheral. The adapter
+   * remembers the last address and mode, so the ioctls are only issued when
+   * they change.
+   */
+  void select(std::uint16_t p_address, bool p_ten_bit)
+  {
+    // Enable 10 bit mode if set
+    if (p_ten_bit != m_ten_bit) {
+      if (syscalls::ioctl(m_fd, I2C_TENBIT, p_ten_bit) < 0) {
+        log_error(log_event::i2c_ten_bit, m_log_device, p_address, errno);
+        throw hal::operation_not_supported(this);
+      }
+      m_ten_bit = p_ten_bit;
+      // The kernel validates the address against the mode, pick it again
+      m_selected_address = no_address;
+    }
+
+    // Set peripheral address
+    if (p_address != m_selected_address) {
+      if (syscalls::ioctl(m_fd, I2C_SLAVE, p_address) < 0) {
+        log_error(log_event::i2c_select, m_log_device, p_address, errno);
+        m_selected_address = no_address;
+        throw hal::no_such_device(p_address, this);
+      }
+      m_selected_address = p_address;
+    }
+  }
+
+  // SMBus transfers take their address from I2C_SLAVE like read() and write()
+  void smbus(hal::byte p_address,
+             hal::byte p_read_write,
+             hal::byte p_command,
+             std::uint32_t p_size,
+             i2c_smbus_data* p_data)
+  {
+    select(p_address, false);
+    std::size_t bytes = p_size == I2C_SMBUS_WORD_DATA ? 2 : 1;
+    if (p_size == I2C_SMBUS_I2C_BLOCK_DATA) {
+      bytes = p_data->block[0];
+    }
+    auto operation = m_stats.measure(bytes);
+    i2c_smbus_ioctl_data args{
+      .read_write = p_read_write,
+      .command = p_command,
+      .size = p_size,
+      .data = p_data,
+    };
+    if (syscalls::ioctl(m_fd, I2C_SMBUS, &args) < 0) {
+      throw_transfer_error(p_address);
+    }
+  }
+
+  void write_then_read(hal::byte p_address,
+                       hal::byte p_register,
+                       std::span<hal::byte> p_data)
+  {
+    i2c_msg msgs[2] = {
+      { .addr = p_address, .flags = 0, .len = 1, .buf = &p_register },
+      { .addr = p_address,
+        .flags = I2C_M_RD,
+        .len = static_cast<std::uint16_t>(p_data.size()),
+        .buf = p_data.data() },
+    };
+    i2c_rdwr_ioctl_data data_queue{ .msgs = msgs, .nmsgs = 2 };
+    auto operation = m_stats.measure(1 + p_data.size());
+    if (syscalls::ioctl(m_fd, I2C_RDWR, &data_queue) < 0) {
+      throw_transfer_error(p_address);
+    }
+  }
+
+  void write_message(hal::byte p_address, std::span<hal::byte> p_data)
+  {
+    i2c_msg msg = { .addr = p_address,
+                    .flags = 0,
+                    .len = static_cast<std::uint16_t>(p_data.size()),
+                    .buf = p_data.data() };
+    i2c_rdwr_ioctl_data data_queue{ .msgs = &msg, .nmsgs = 1 };
+    auto operation = m_stats.measure(p_data.size());
+    if (syscalls::ioctl(m_fd, I2C_RDWR, &data_queue) < 0) {
+      throw_transfer_error(p_address);
+    }
+  }
+
+  [[noreturn]] void throw_transfer_error(hal::byte p_address)
+  {
+    // No acknowledge from the peripheral
+    if (errno == ENXIO || errno == EREMOTEIO) {
+      throw hal::no_such_device(p_address, this);
+    }
+    throw hal::io_error(this);
+  }
+
+  // Send messages [p_first, p_last) of a batch and record their results
+  bool submit(i2c_batch& p_batch, std::size_t p_first, std::size_t p_last)
+  {
+    i2c_rdwr_ioctl_data data_queue{
+      .msgs = &p_batch.m_messages[p_first],
+      .nmsgs = static_cast<std::uint32_t>(p_last - p_first),
+    };
+    std::size_t bytes = 0;
+    for (auto i = p_first; i < p_last; i++) {
+      bytes += p_batch.m_messages[i].len;
+    }
+    auto operation = m_stats.measure(bytes);
+    const int sent = syscalls::ioctl(m_fd, I2C_RDWR, &data_queue);
+    if (sent < 0) {
+      operation.fail();
+      p_batch.settle(p_first, p_last, static_cast<std::errc>(errno));
+      return false;
+    }
+    // Some adapters stop early and report how many messages went through
+    const auto done = p_first + static_cast<std::size_t>(sent);
+    p_batch.settle(p_first, std::min(done, p_last), std::errc{});
+    if (done < p_last) {
+      operation.fail();
+      p_batch.settle(done, done + 1, std::errc::io_error);
+      p_batch.settle(done + 1, p_last, std::errc::operation_canceled);
+      return false;
+    }
+    return true;
+  }
+
+  /// Never a valid 7 or 10 bit address
+  static constexpr int no_address = -1;
+
   int m_fd = 0;
+  std::uint32_t m_log_device;
+  unsigned long m_functionality = 0;
+  int m_selected_address = no_address;
+  bool m_ten_bit = false;
+  [[no_unique_address]] driver_stats m_stats;
 };
+
+using i2c = basic_i2c<posix_syscalls>;
 }  // namespace hal::linux
\ No newline at end of file
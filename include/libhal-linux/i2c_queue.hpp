@@ -0,0 +1,217 @@
+#pragma once
+#include "errors.hpp"
+#include "ring_buffer.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <future>
+#include <libhal/error.hpp>
+#include <libhal/i2c.hpp>
+#include <libhal/units.hpp>
+#include <memory>
+#include <span>
+#include <sys/eventfd.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+namespace hal::linux {
+
+/**
+ * @brief Runs transactions on an i2c bus from a dedicated worker thread, so
+ * the submitting thread can keep working while a transfer is on the wire.
+ *
+ * Transactions are accepted into bounded lock-free queues and executed one
+ * at a time, oldest first, with every high priority transaction going ahead
+ * of all normal ones. The submitter's buffers are handed to the bus as is,
+ * they must stay valid and untouched until the transaction completes.
+ *
+ * Completion is reported through any combination of a per transaction
+ * callback or future, and an eventfd that counts completed transactions and
+ * can be waited on with poll, epoll or hal::linux::executor.
+ *
+ * The bus must outlive the queue and must not be used directly while the
+ * queue is alive. Transactions still queued on destruction are run first.
+ */
+class i2c_queue
+{
+public:
+  enum class priority : std::uint8_t
+  {
+    normal,
+    high,
+  };
+
+  /// Receives a default constructed std::errc on success, the error of the
+  /// failed transaction otherwise. Runs on the worker thread.
+  using completion = void(std::errc p_error);
+
+  /**
+   * @brief Start the worker thread for a bus.
+   * @param p_bus Bus to run transactions on.
+   * @param p_capacity Minimum number of transactions each priority level can
+   * hold, rounded up to a power of two.
+   *
+   * @throws hal::linux::errno_exception if the completion eventfd could not
+   * be created.
+   */
+  i2c_queue(hal::i2c& p_bus, std::size_t p_capacity = 64)
+    : m_bus(&p_bus)
+    , m_normal(p_capacity)
+    , m_high(p_capacity)
+  {
+    m_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_event_fd < 0) {
+      throw errno_exception(errno, std::errc::too_many_files_open, this);
+    }
+    m_worker = std::thread([this] { run(); });
+  }
+
+  i2c_queue(const i2c_queue&) = delete;
+  i2c_queue& operator=(const i2c_queue&) = delete;
+
+  ~i2c_queue()
+  {
+    m_running = false;
+    signal();
+    m_worker.join();
+    close(m_event_fd);
+  }
+
+  /**
+   * @brief Queue a transaction without waiting for it.
+   * @param p_address 7 bit peripheral address.
+   * @param p_data_out Bytes to write, may be empty.
+   * @param p_data_in Buffer for the bytes to read, may be empty.
+   * @param p_on_complete Called on the worker thread once done, may be empty.
+   * @param p_priority Queue to place the transaction in.
+   * @return false if that queue is full, nothing was queued then.
+   */
+  bool submit(hal::byte p_address,
+              std::span<const hal::byte> p_data_out,
+              std::span<hal::byte> p_data_in,
+              hal::callback<completion> p_on_complete = {},
+              priority p_priority = priority::normal)
+  {
+    job entry{
+      .address = p_address,
+      .data_out = p_data_out,
+      .data_in = p_data_in,
+      .on_complete = std::move(p_on_complete),
+    };
+    auto& queue = p_priority == priority::high ? m_high : m_normal;
+    m_pending.fetch_add(1, std::memory_order_relaxed);
+    if (!queue.try_push(std::move(entry))) {
+      m_pending.fetch_sub(1, std::memory_order_relaxed);
+      return false;
+    }
+    signal();
+    return true;
+  }
+
+  /**
+   * @brief Queue a transaction and get a future for its outcome.
+   * @param p_address 7 bit peripheral address.
+   * @param p_data_out Bytes to write, may be empty.
+   * @param p_data_in Buffer for the bytes to read, may be empty.
+   * @param p_priority Queue to place the transaction in.
+   *
+   * @throws hal::resource_unavailable_try_again if that queue is full.
+   */
+  std::future<std::errc> submit_future(hal::byte p_address,
+                                       std::span<const hal::byte> p_data_out,
+                                       std::span<hal::byte> p_data_in,
+                                       priority p_priority = priority::normal)
+  {
+    auto promise = std::make_shared<std::promise<std::errc>>();
+    auto future = promise->get_future();
+    if (!submit(
+          p_address,
+          p_data_out,
+          p_data_in,
+          [promise](std::errc p_error) { promise->set_value(p_error); },
+          p_priority)) {
+      throw hal::resource_unavailable_try_again(this);
+    }
+    return future;
+  }
+
+  /// Readable eventfd whose counter grows by one per completed transaction
+  int completion_fd() const
+  {
+    return m_event_fd;
+  }
+
+  /// Transactions queued or running
+  std::size_t pending() const
+  {
+    return m_pending.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct job
+  {
+    hal::byte address = 0;
+    std::span<const hal::byte> data_out;
+    std::span<hal::byte> data_in;
+    hal::callback<completion> on_complete;
+  };
+
+  void signal()
+  {
+    m_submitted.fetch_add(1, std::memory_order_release);
+    m_submitted.notify_one();
+  }
+
+  void run()
+  {
+    job current;
+    while (true) {
+      // Read the counter before looking at the queues so a submission that
+      // lands in between makes wait() return right away.
+      const auto seen = m_submitted.load(std::memory_order_acquire);
+      if (m_high.try_pop(current) || m_normal.try_pop(current)) {
+        execute(current);
+        continue;
+      }
+      if (!m_running) {
+        return;
+      }
+      m_submitted.wait(seen, std::memory_order_acquire);
+    }
+  }
+
+  void execute(job& p_job)
+  {
+    std::errc error{};
+    try {
+      m_bus->transaction(p_job.address, p_job.data_out, p_job.data_in, [] {});
+    } catch (const hal::exception& p_error) {
+      error = p_error.error_code();
+    } catch (...) {
+      error = std::errc::io_error;
+    }
+
+    if (p_job.on_complete) {
+      try {
+        p_job.on_complete(error);
+      } catch (...) {
+        // A failing callback must not stop the queue
+      }
+    }
+    std::uint64_t one = 1;
+    [[maybe_unused]] auto res = write(m_event_fd, &one, sizeof(one));
+    p_job = {};
+    m_pending.fetch_sub(1, std::memory_order_release);
+  }
+
+  hal::i2c* m_bus;
+  mpmc_queue<job> m_normal;
+  mpmc_queue<job> m_high;
+  std::atomic<std::uint32_t> m_submitted = 0;
+  std::atomic<std::size_t> m_pending = 0;
+  std::atomic<bool> m_running = true;
+  int m_event_fd = -1;
+  std::thread m_worker;
+};
+}  // namespace hal::linux
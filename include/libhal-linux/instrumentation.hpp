@@ -0,0 +1,336 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#if HAL_LINUX_INSTRUMENTATION
+#include <atomic>
+#include <ctime>
+#include <exception>
+#include <memory>
+#include <mutex>
+#endif
+
+// Driver instrumentation has two opt-in switches, each enabled by defining
+// it to a non-zero value, such as -DHAL_LINUX_USDT=1. Left undefined or set
+// to 0 they compile to nothing.
+//
+// HAL_LINUX_INSTRUMENTATION: every driver keeps a driver_stats with call,
+// byte and error counts and a latency histogram.
+//
+// HAL_LINUX_USDT: static tracepoints for perf, bpftrace and friends, under
+// the hal_linux provider. Needs the systemtap sys/sdt.h header, without it
+// the probes expand to nothing.
+#if HAL_LINUX_USDT && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAL_LINUX_PROBE2(name, a, b) DTRACE_PROBE2(hal_linux, name, a, b)
+#define HAL_LINUX_PROBE3(name, a, b, c) DTRACE_PROBE3(hal_linux, name, a, b, c)
+#else
+#define HAL_LINUX_PROBE2(name, a, b)
+#define HAL_LINUX_PROBE3(name, a, b, c)
+#endif
+
+namespace hal::linux {
+
+/// Counters of one driver, summed over every thread that used it
+struct driver_counters
+{
+  static constexpr std::size_t latency_buckets = 32;
+
+  /// Measured driver calls
+  std::uint64_t operations = 0;
+  /// Payload bytes moved by those calls
+  std::uint64_t bytes = 0;
+  /// Calls that failed
+  std::uint64_t errors = 0;
+  /// Bucket n counts calls that took less than 2^(n+1) ns and, above bucket
+  /// 0, at least 2^n ns. The last bucket also holds everything slower.
+  std::array<std::uint64_t, latency_buckets> latency{};
+
+  /**
+   * @brief Upper bound of the latency bucket holding a quantile.
+   * @param p_fraction Quantile to look up, 0.99 for the 99th percentile.
+   * @return Bound in nanoseconds, 0 if nothing was recorded.
+   */
+  std::uint64_t latency_percentile_ns(double p_fraction) const
+  {
+    if (operations == 0) {
+      return 0;
+    }
+    const auto rank = static_cast<std::uint64_t>(
+      p_fraction * static_cast<double>(operations - 1));
+    std::uint64_t seen = 0;
+    for (std::size_t bucket = 0; bucket < latency_buckets; bucket++) {
+      seen += latency[bucket];
+      if (seen > rank) {
+        return std::uint64_t{ 2 } << bucket;
+      }
+    }
+    return std::uint64_t{ 2 } << (latency_buckets - 1);
+  }
+};
+
+#if HAL_LINUX_INSTRUMENTATION
+
+/**
+ * @brief Operation, byte and error counts plus a latency histogram of one
+ * driver, enabled by building with HAL_LINUX_INSTRUMENTATION=1.
+ *
+ * Counters are split into cache line aligned shards and every thread updates
+ * the shard it was assigned, so threads sharing a driver do not bounce cache
+ * lines or take locks. snapshot() sums the shards. Every live instance is
+ * listed by driver_stats::snapshot_all() to find which driver is slow.
+ *
+ * Without HAL_LINUX_INSTRUMENTATION the class is empty and every member is a
+ * no-op, so drivers pay nothing for holding one.
+ */
+class driver_stats
+{
+public:
+  static constexpr bool enabled = true;
+
+  /**
+   * @brief Times one driver call from construction to destruction. The call
+   * counts as failed if it leaves by an exception or fail() was called.
+   */
+  class operation
+  {
+  public:
+    operation(driver_stats& p_stats, std::size_t p_bytes)
+      : m_stats(&p_stats)
+      , m_bytes(p_bytes)
+      , m_exceptions(std::uncaught_exceptions())
+      , m_start_ns(now_ns())
+    {
+    }
+
+    operation(const operation&) = delete;
+    operation& operator=(const operation&) = delete;
+
+    ~operation()
+    {
+      const bool failed =
+        m_failed || std::uncaught_exceptions() > m_exceptions;
+      m_stats->record(now_ns() - m_start_ns, m_bytes, failed);
+    }
+
+    /// Replace the byte count, for calls that learn it at the end
+    void bytes(std::size_t p_bytes)
+    {
+      m_bytes = p_bytes;
+    }
+
+    /// Count the call as failed without throwing
+    void fail()
+    {
+      m_failed = true;
+    }
+
+  private:
+    driver_stats* m_stats;
+    std::size_t m_bytes;
+    int m_exceptions;
+    bool m_failed = false;
+    std::uint64_t m_start_ns;
+  };
+
+  /**
+   * @param p_name Shown by snapshot_all(), usually the device path.
+   * @param p_index Line or channel on that device, appended to the name
+   * unless negative.
+   */
+  explicit driver_stats(std::string_view p_name, int p_index = -1)
+    : m_name(p_name)
+    , m_shards(std::make_unique<shard[]>(shard_count))
+  {
+    if (p_index >= 0) {
+      m_name += ':' + std::to_string(p_index);
+    }
+    auto& all = registry();
+    std::lock_guard lock(all.lock);
+    all.drivers.push_back(this);
+  }
+
+  /// A copy starts counting from zero under the same name
+  driver_stats(const driver_stats& p_other)
+    : driver_stats(p_other.m_name)
+  {
+  }
+
+  driver_stats& operator=(const driver_stats&)
+  {
+    return *this;
+  }
+
+  ~driver_stats()
+  {
+    auto& all = registry();
+    std::lock_guard lock(all.lock);
+    std::erase(all.drivers, this);
+  }
+
+  /// Start timing a call that moves p_bytes of payload
+  operation measure(std::size_t p_bytes = 0)
+  {
+    return operation(*this, p_bytes);
+  }
+
+  void record(std::uint64_t p_latency_ns, std::size_t p_bytes, bool p_failed)
+  {
+    auto& local = m_shards[shard_index()];
+    local.operations.fetch_add(1, std::memory_order_relaxed);
+    local.bytes.fetch_add(p_bytes, std::memory_order_relaxed);
+    if (p_failed) {
+      local.errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    local.latency[bucket(p_latency_ns)].fetch_add(1,
+                                                  std::memory_order_relaxed);
+  }
+
+  /// Sum of every shard. Counters keep moving while it is taken, so it is
+  /// exact only once the driver is idle.
+  driver_counters snapshot() const
+  {
+    driver_counters total;
+    for (std::size_t i = 0; i < shard_count; i++) {
+      const auto& part = m_shards[i];
+      total.operations += part.operations.load(std::memory_order_relaxed);
+      total.bytes += part.bytes.load(std::memory_order_relaxed);
+      total.errors += part.errors.load(std::memory_order_relaxed);
+      for (std::size_t b = 0; b < driver_counters::latency_buckets; b++) {
+        total.latency[b] += part.latency[b].load(std::memory_order_relaxed);
+      }
+    }
+    return total;
+  }
+
+  const std::string& name() const
+  {
+    return m_name;
+  }
+
+  /// Name and counters of every instrumented driver alive in the process
+  static std::vector<std::pair<std::string, driver_counters>> snapshot_all()
+  {
+    std::vector<std::pair<std::string, driver_counters>> result;
+    auto& all = registry();
+    std::lock_guard lock(all.lock);
+    result.reserve(all.drivers.size());
+    for (const auto* driver : all.drivers) {
+      result.emplace_back(driver->m_name, driver->snapshot());
+    }
+    return result;
+  }
+
+private:
+  static constexpr std::size_t shard_count = 16;
+
+  struct alignas(64) shard
+  {
+    std::atomic<std::uint64_t> operations = 0;
+    std::atomic<std::uint64_t> bytes = 0;
+    std::atomic<std::uint64_t> errors = 0;
+    std::array<std::atomic<std::uint64_t>, driver_counters::latency_buckets>
+      latency{};
+  };
+
+  struct registry_type
+  {
+    std::mutex lock;
+    std::vector<driver_stats*> drivers;
+  };
+
+  static registry_type& registry()
+  {
+    static registry_type instance;
+    return instance;
+  }
+
+  // Threads get shards round robin, in the order they first record
+  static std::size_t shard_index()
+  {
+    static std::atomic<std::size_t> next_index = 0;
+    thread_local const std::size_t index =
+      next_index.fetch_add(1, std::memory_order_relaxed) % shard_count;
+    return index;
+  }
+
+  static std::size_t bucket(std::uint64_t p_latency_ns)
+  {
+    if (p_latency_ns < 2) {
+      return 0;
+    }
+    // Index of the highest set bit, the floor of log2
+    const auto log2 = std::bit_width(p_latency_ns) - 1;
+    return std::min<std::size_t>(log2, driver_counters::latency_buckets - 1);
+  }
+
+  static std::uint64_t now_ns()
+  {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<std::uint64_t>(now.tv_sec) * 1'000'000'000 +
+           static_cast<std::uint64_t>(now.tv_nsec);
+  }
+
+  std::string m_name;
+  std::unique_ptr<shard[]> m_shards;
+};
+
+#else
+
+class driver_stats
+{
+public:
+  static constexpr bool enabled = false;
+
+  class [[maybe_unused]] operation
+  {
+  public:
+    void bytes(std::size_t)
+    {
+    }
+
+    void fail()
+    {
+    }
+  };
+
+  explicit driver_stats(std::string_view, int = -1)
+  {
+  }
+
+  operation measure(std::size_t = 0)
+  {
+    return {};
+  }
+
+  void record(std::uint64_t, std::size_t, bool)
+  {
+  }
+
+  driver_counters snapshot() const
+  {
+    return {};
+  }
+
+  const std::string& name() const
+  {
+    static const std::string none;
+    return none;
+  }
+
+  static std::vector<std::pair<std::string, driver_counters>> snapshot_all()
+  {
+    return {};
+  }
+};
+
+#endif
+}  // namespace hal::linux
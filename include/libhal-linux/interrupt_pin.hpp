@@ -0,0 +1,215 @@
+#pragma once
+
+#include "errors.hpp"
+#include "event_thread.hpp"
+#include "gpio_chip.hpp"
+#include "instrumentation.hpp"
+#include "line_request.hpp"
+#include "syscalls.hpp"
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <libhal/error.hpp>
+#include <libhal/interrupt_pin.hpp>
+#include <linux/gpio.h>
+#include <memory>
+#include <string>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <vector>
+
+namespace hal::linux {
+
+/**
+ * @brief Interrupt pin for the linux kernel, backed by GPIO v2 edge events.
+ *
+ * The line is requested with edge detection enabled so the kernel queues a
+ * timestamped gpio_v2_line_event for every edge. Once a handler is installed
+ * the line is watched by the shared hal::linux::event_thread, which sleeps in
+ * epoll until an edge arrives and then drains the queued events in batches of
+ * up to `event_buffer_size` records per read.
+ *
+ * All kernel calls go through the syscalls policy, see
+ * hal::linux::posix_syscalls. Use the hal::linux::interrupt_pin alias for real
+ * hardware.
+ */
+template<class syscalls>
+class basic_interrupt_pin : public hal::interrupt_pin
+{
+public:
+  /// Handler that also receives the kernel timestamp of the edge in
+  /// nanoseconds on CLOCK_MONOTONIC.
+  using edge_handler = void(bool p_state, std::uint64_t p_timestamp_ns);
+
+  /**
+   * @brief Constructor. Takes a *full path* to the GPIO character device and a
+   * number that is known to said device. The line starts with its pull up
+   * enabled and triggers on rising edges, matching the default settings. The
+   * chip is opened through the shared hal::linux::gpio_chip registry.
+   * @param p_chip_name Full path to GPIO character device.
+   * @param p_pin Pin number for said device
+   * @param p_event_buffer_size Number of events the kernel may queue for this
+   * line and the most drained in a single read.
+   *
+   * @throws hal::linux::invalid_character_device if an invalid chip path was
+   * given.
+   * @throws hal::linux::errno_exception if a request to said line failed.
+   */
+  basic_interrupt_pin(const std::string& p_chip_name,
+                      const std::uint16_t p_pin,
+                      const std::uint32_t p_event_buffer_size = 16)
+    : m_events(p_event_buffer_size == 0 ? 1 : p_event_buffer_size)
+    , m_line(request_line<syscalls>(
+        p_chip_name, p_pin, to_flags(settings{}), m_events.size()))
+    , m_stats(m_line.chip->path(), p_pin)
+  {
+    // Never let a spurious wake up block the shared event thread
+    const int fd = m_line.request->fd();
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+
+  basic_interrupt_pin(const basic_interrupt_pin&) = delete;
+  basic_interrupt_pin& operator=(const basic_interrupt_pin&) = delete;
+
+  virtual ~basic_interrupt_pin()
+  {
+    if (m_watched) {
+      event_thread::shared().unwatch(m_line.request->fd());
+    }
+  }
+
+  /**
+   * @brief Install a handler that also receives the kernel's timestamp for
+   * every edge. Replaces any handler set through on_trigger().
+   * @param p_handler Called from the shared event thread for every edge.
+   */
+  void on_edge(hal::callback<edge_handler> p_handler)
+  {
+    m_watched = true;
+    event_thread::shared().watch(
+      m_line.request->fd(),
+      EPOLLIN,
+      [this, handler = std::move(p_handler)](std::uint32_t) {
+        drain(handler);
+      });
+  }
+
+  /// Line request file descriptor. Readable whenever an edge event is queued,
+  /// for waiting on edges without installing a handler.
+  int native_handle() const
+  {
+    return m_line.request->fd();
+  }
+
+  /// Kernel timestamp, in nanoseconds on CLOCK_MONOTONIC, of the last edge
+  /// dispatched to a handler.
+  std::uint64_t last_timestamp() const
+  {
+    return m_last_timestamp.load(std::memory_order_relaxed);
+  }
+
+  /// Number of edges the kernel dropped because its event buffer was full
+  std::uint64_t dropped_events() const
+  {
+    return m_dropped.load(std::memory_order_relaxed);
+  }
+
+  /// Counters of this pin, empty unless built with HAL_LINUX_INSTRUMENTATION.
+  /// Every wake up of the event thread counts as one call, from draining the
+  /// queued edges through running the handler for each of them.
+  const driver_stats& stats() const
+  {
+    return m_stats;
+  }
+
+private:
+  static std::uint64_t to_flags(const settings& p_settings)
+  {
+    std::uint64_t flags = GPIO_V2_LINE_FLAG_INPUT;
+    switch (p_settings.resistor) {
+      default:
+      case hal::pin_resistor::none:
+        break;
+      case hal::pin_resistor::pull_up:
+        flags |= GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+        break;
+      case hal::pin_resistor::pull_down:
+        flags |= GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN;
+        break;
+    }
+    switch (p_settings.trigger) {
+      case trigger_edge::falling:
+        flags |= GPIO_V2_LINE_FLAG_EDGE_FALLING;
+        break;
+      default:
+      case trigger_edge::rising:
+        flags |= GPIO_V2_LINE_FLAG_EDGE_RISING;
+        break;
+      case trigger_edge::both:
+        flags |=
+          GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+        break;
+    }
+    return flags;
+  }
+
+  void drain(const hal::callback<edge_handler>& p_handler)
+  {
+    auto operation = m_stats.measure();
+    std::size_t drained = 0;
+    const auto buffer_bytes = m_events.size() * sizeof(gpio_v2_line_event);
+    while (true) {
+      const auto bytes =
+        syscalls::read(m_line.request->fd(), m_events.data(), buffer_bytes);
+      if (bytes < static_cast<ssize_t>(sizeof(gpio_v2_line_event))) {
+        if (bytes < 0 && errno != EAGAIN) {
+          operation.fail();
+        }
+        return;
+      }
+      drained += static_cast<std::size_t>(bytes);
+      operation.bytes(drained);
+      const auto count = bytes / sizeof(gpio_v2_line_event);
+      for (std::size_t i = 0; i < count; i++) {
+        const auto& event = m_events[i];
+        // Sequence numbers are consecutive unless the kernel's fifo overflowed
+        if (m_last_seqno != 0 && event.line_seqno > m_last_seqno + 1) {
+          m_dropped.fetch_add(event.line_seqno - m_last_seqno - 1,
+                              std::memory_order_relaxed);
+        }
+        m_last_seqno = event.line_seqno;
+        m_last_timestamp.store(event.timestamp_ns, std::memory_order_relaxed);
+        p_handler(event.id == GPIO_V2_LINE_EVENT_RISING_EDGE,
+                  event.timestamp_ns);
+      }
+      if (count < m_events.size()) {
+        return;
+      }
+    }
+  }
+
+  void driver_configure(const settings& p_settings) override
+  {
+    m_line.request->line_flags(m_line.index, to_flags(p_settings));
+  }
+
+  void driver_on_trigger(hal::callback<handler> p_callback) override
+  {
+    on_edge([callback = std::move(p_callback)](bool p_state, std::uint64_t) {
+      callback(p_state);
+    });
+  }
+
+  bool m_watched = false;
+  std::uint32_t m_last_seqno = 0;
+  std::atomic<std::uint64_t> m_last_timestamp = 0;
+  std::atomic<std::uint64_t> m_dropped = 0;
+  std::vector<gpio_v2_line_event> m_events;
+  basic_line_handle<syscalls> m_line;
+  [[no_unique_address]] driver_stats m_stats;
+};
+
+using interrupt_pin = basic_interrupt_pin<posix_syscalls>;
+}  // namespace hal::linux
@@ -0,0 +1,321 @@
+#pragma once
+#include "errors.hpp"
+#include "syscalls.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <libhal/error.hpp>
+#include <linux/gpio.h>
+#include <span>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+namespace hal::linux {
+
+/**
+ * @brief Owns a single gpio_v2 line request that spans up to
+ * GPIO_V2_LINES_MAX offsets of one GPIO character device.
+ *
+ * Every line keeps its own flags. The most common flags become the request
+ * wide default and the rest are packed into `gpio_v2_line_config.attrs`, so
+ * lines with a different direction, bias or drive can still live in the same
+ * request and be read or written with a single masked ioctl.
+ *
+ * Bit `n` of every value and mask refers to the `n`th offset handed to the
+ * constructor, not to the offset itself.
+ *
+ * A request can also be built up line by line with add() and handed to the
+ * kernel later with commit(), which is how hal::linux::line_batch merges pins
+ * created during a configuration phase into one request.
+ *
+ * All kernel calls go through the syscalls policy, see
+ * hal::linux::posix_syscalls.
+ */
+template<class syscalls>
+class basic_line_request
+{
+public:
+  static constexpr std::size_t max_lines = GPIO_V2_LINES_MAX;
+
+  /**
+   * @brief Requests all lines from the chip in one GPIO_V2_GET_LINE_IOCTL.
+   * @param p_chip_fd An open file descriptor to the GPIO character device.
+   * @param p_offsets Line offsets known to said device.
+   * @param p_flags Initial GPIO_V2_LINE_FLAG_* flags for each offset. Must be
+   * the same length as p_offsets.
+   * @param p_event_buffer_size Kernel event buffer size hint, only used by
+   * lines requested with edge detection. Zero lets the kernel pick.
+   *
+   * @throws hal::argument_out_of_domain if the number of lines is zero, greater
+   * than GPIO_V2_LINES_MAX or the per-line flags cannot be described with
+   * GPIO_V2_LINE_NUM_ATTRS_MAX attributes, one of which is kept free for the
+   * output values line_flags() has to carry.
+   * @throws hal::linux::errno_exception if the kernel refused the request.
+   */
+  basic_line_request(int p_chip_fd,
+                     std::span<const std::uint32_t> p_offsets,
+                     std::span<const std::uint64_t> p_flags,
+                     std::uint32_t p_event_buffer_size = 0)
+  {
+    if (p_offsets.empty() || p_offsets.size() > max_lines ||
+        p_offsets.size() != p_flags.size()) {
+      throw hal::argument_out_of_domain(this);
+    }
+    memset(&m_request, 0, sizeof(m_request));
+    m_request.num_lines = p_offsets.size();
+    m_request.event_buffer_size = p_event_buffer_size;
+    std::copy(p_offsets.begin(), p_offsets.end(), m_request.offsets);
+    std::copy(p_flags.begin(), p_flags.end(), m_flags.begin());
+    m_request.config = build_config(m_flags);
+    if (syscalls::ioctl(p_chip_fd, GPIO_V2_GET_LINE_IOCTL, &m_request) < 0) {
+      throw errno_exception(errno, std::errc::connection_refused, this);
+    }
+  }
+
+  /**
+   * @brief Creates an empty, uncommitted request. Lines are added with add()
+   * and requested from the kernel all at once with commit().
+   */
+  basic_line_request()
+  {
+    memset(&m_request, 0, sizeof(m_request));
+    m_request.fd = -1;
+  }
+
+  basic_line_request(const basic_line_request&) = delete;
+  basic_line_request& operator=(const basic_line_request&) = delete;
+
+  ~basic_line_request()
+  {
+    if (committed()) {
+      syscalls::close(m_request.fd);
+    }
+  }
+
+  /**
+   * @brief Add a line to an uncommitted request.
+   * @param p_offset Line offset known to the GPIO character device.
+   * @param p_flags GPIO_V2_LINE_FLAG_* flags for the line.
+   * @return Index of the line within this request.
+   *
+   * @throws hal::argument_out_of_domain if the request is full or the flags
+   * would need too many attributes.
+   * @throws hal::operation_not_permitted if the request was already committed.
+   */
+  std::size_t add(std::uint32_t p_offset, std::uint64_t p_flags)
+  {
+    if (committed()) {
+      throw hal::operation_not_permitted(this);
+    }
+    if (size() == max_lines) {
+      throw hal::argument_out_of_domain(this);
+    }
+    const auto index = size();
+    m_request.offsets[index] = p_offset;
+    m_flags[index] = p_flags;
+    m_request.num_lines++;
+    try {
+      m_request.config = build_config(m_flags);
+    } catch (...) {
+      m_request.num_lines--;
+      throw;
+    }
+    return index;
+  }
+
+  /**
+   * @brief Request every added line from the kernel in one
+   * GPIO_V2_GET_LINE_IOCTL. Does nothing if already committed or empty.
+   * @param p_chip_fd An open file descriptor to the GPIO character device.
+   *
+   * @throws hal::linux::errno_exception if the kernel refused the request.
+   */
+  void commit(int p_chip_fd)
+  {
+    if (committed() || size() == 0) {
+      return;
+    }
+    if (syscalls::ioctl(p_chip_fd, GPIO_V2_GET_LINE_IOCTL, &m_request) < 0) {
+      m_request.fd = -1;
+      throw errno_exception(errno, std::errc::connection_refused, this);
+    }
+  }
+
+  /// True once the lines have been handed to the kernel
+  bool committed() const
+  {
+    return m_request.fd >= 0;
+  }
+
+  /**
+   * @brief Drive every line selected by p_mask in one ioctl.
+   * @param p_bits New line values, one bit per requested line.
+   * @param p_mask Lines to update, lines outside the mask are left as is.
+   *
+   * @throws hal::io_error if the kernel rejected the update.
+   */
+  void values(std::uint64_t p_bits, std::uint64_t p_mask)
+  {
+    gpio_v2_line_values values{ .bits = p_bits & p_mask, .mask = p_mask };
+    const auto request = GPIO_V2_LINE_SET_VALUES_IOCTL;
+    if (syscalls::ioctl(m_request.fd, request, &values) < 0) {
+      throw hal::io_error(this);
+    }
+  }
+
+  /**
+   * @brief Sample every line selected by p_mask in one ioctl.
+   * @param p_mask Lines to sample.
+   * @return The sampled values, bits outside of p_mask are zero.
+   *
+   * @throws hal::io_error if the kernel rejected the read.
+   */
+  std::uint64_t values(std::uint64_t p_mask)
+  {
+    gpio_v2_line_values values{ .bits = 0, .mask = p_mask };
+    const auto request = GPIO_V2_LINE_GET_VALUES_IOCTL;
+    if (syscalls::ioctl(m_request.fd, request, &values) < 0) {
+      throw hal::io_error(this);
+    }
+    return values.bits & p_mask;
+  }
+
+  /**
+   * @brief Replace the flags of a single line and push the new config.
+   * @param p_index Index of the line within this request.
+   * @param p_flags New GPIO_V2_LINE_FLAG_* flags for the line.
+   *
+   * GPIO_V2_LINE_SET_CONFIG_IOCTL drives every output line of the request to
+   * the values in the config, so the current levels of the outputs are read
+   * first and passed along. The other lines keep their flags and levels.
+   * On an uncommitted request the flags are only recorded and take effect on
+   * commit().
+   *
+   * @throws hal::argument_out_of_domain if p_index is not part of the request
+   * or the resulting config needs too many attributes.
+   * @throws hal::operation_not_permitted if the kernel refused the config or
+   * the output levels could not be read.
+   */
+  void line_flags(std::size_t p_index, std::uint64_t p_flags)
+  {
+    if (p_index >= size()) {
+      throw hal::argument_out_of_domain(this);
+    }
+    // Keep the recorded state as it is until the kernel accepted the change
+    auto flags = m_flags;
+    flags[p_index] = p_flags;
+    auto config = build_config(flags);
+    if (committed()) {
+      const auto outputs = output_mask(flags);
+      if (outputs != 0) {
+        gpio_v2_line_values current{ .bits = 0, .mask = outputs };
+        const auto request = GPIO_V2_LINE_GET_VALUES_IOCTL;
+        if (syscalls::ioctl(m_request.fd, request, &current) < 0) {
+          throw hal::operation_not_permitted(this);
+        }
+        // build_config() kept this attribute free
+        auto& attr = config.attrs[config.num_attrs++];
+        attr.attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+        attr.attr.values = current.bits & outputs;
+        attr.mask = outputs;
+      }
+      const auto request = GPIO_V2_LINE_SET_CONFIG_IOCTL;
+      if (syscalls::ioctl(m_request.fd, request, &config) < 0) {
+        throw hal::operation_not_permitted(this);
+      }
+    }
+    m_flags = flags;
+    m_request.config = config;
+  }
+
+  std::uint64_t line_flags(std::size_t p_index) const
+  {
+    return m_flags.at(p_index);
+  }
+
+  std::size_t size() const
+  {
+    return m_request.num_lines;
+  }
+
+  /// Mask covering every line in the request
+  std::uint64_t mask() const
+  {
+    return size() == max_lines ? ~std::uint64_t{ 0 }
+                               : (std::uint64_t{ 1 } << size()) - 1;
+  }
+
+  /// Line request file descriptor, readable for edge events
+  int fd() const
+  {
+    return m_request.fd;
+  }
+
+private:
+  std::uint64_t output_mask(
+    const std::array<std::uint64_t, max_lines>& p_flags) const
+  {
+    std::uint64_t outputs = 0;
+    for (std::size_t i = 0; i < size(); i++) {
+      if (p_flags[i] & GPIO_V2_LINE_FLAG_OUTPUT) {
+        outputs |= std::uint64_t{ 1 } << i;
+      }
+    }
+    return outputs;
+  }
+
+  // Flags for every line, in the request wide default and attributes. One
+  // attribute stays free for output values when the request has outputs.
+  gpio_v2_line_config build_config(
+    const std::array<std::uint64_t, max_lines>& p_flags)
+  {
+    gpio_v2_line_config config;
+    memset(&config, 0, sizeof(config));
+
+    // The most common flags become the request default, so a homogeneous
+    // request needs no attributes at all.
+    std::array<std::uint64_t, max_lines> distinct{};
+    std::array<std::uint64_t, max_lines> masks{};
+    std::array<std::size_t, max_lines> counts{};
+    std::size_t distinct_count = 0;
+    for (std::size_t i = 0; i < size(); i++) {
+      auto end = distinct.begin() + distinct_count;
+      auto match = std::find(distinct.begin(), end, p_flags[i]);
+      if (match == end) {
+        *match = p_flags[i];
+        distinct_count++;
+      }
+      const auto slot = match - distinct.begin();
+      masks[slot] |= std::uint64_t{ 1 } << i;
+      counts[slot]++;
+    }
+
+    const auto common =
+      std::max_element(counts.begin(), counts.begin() + distinct_count) -
+      counts.begin();
+    const std::size_t reserved = output_mask(p_flags) != 0 ? 1 : 0;
+    if (distinct_count - 1 + reserved > GPIO_V2_LINE_NUM_ATTRS_MAX) {
+      throw hal::argument_out_of_domain(this);
+    }
+
+    config.flags = distinct[common];
+    for (std::size_t slot = 0; slot < distinct_count; slot++) {
+      if (static_cast<std::ptrdiff_t>(slot) == common) {
+        continue;
+      }
+      auto& attr = config.attrs[config.num_attrs++];
+      attr.attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+      attr.attr.flags = distinct[slot];
+      attr.mask = masks[slot];
+    }
+    return config;
+  }
+
+  gpio_v2_line_request m_request;
+  std::array<std::uint64_t, max_lines> m_flags{};
+};
+
+using line_request = basic_line_request<posix_syscalls>;
+}  // namespace hal::linux
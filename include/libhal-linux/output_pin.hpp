@@ -1,9 +1,11 @@
 #pragma once
+#include "include/libhal-linux/deferred_log.hpp"
 #include "include/libhal-linux/errors.hpp"
+#include "include/libhal-linux/gpio_chip.hpp"
+#include "include/libhal-linux/instrumentation.hpp"
+#include "include/libhal-linux/syscalls.hpp"
 #include <cerrno>
-#include <cstdio>
 #include <cstring>
-#include <fcntl.h>
 #include <libhal/error.hpp>
 #include <libhal/output_pin.hpp>
 #include <libhal/units.hpp>
@@ -13,9 +15,7 @@
 #include <unistd.h>
 
 namespace {
-typedef struct gpio_v2_line_request gpio_line_request;
 typedef struct gpio_v2_line_values gpio_values;
-typedef struct gpio_v2_line_config gpio_config;
 
 }  // namespace
 
@@ -25,98 +25,165 @@ namespace hal::linux {
  * @brief Output pin for the linux kernel. Wraps libgpiod 2.1 at the earlist.
  * Assumes a GPIO driver exists and is properly written for the specific
  * hardware to interface with the linux kernel.
+ *
+ * All kernel calls go through the syscalls policy, see
+ * hal::linux::posix_syscalls. Use the hal::linux::output_pin alias for real
+ * hardware.
  */
-class output_pin : public hal::output_pin
+template<class syscalls>
+class basic_output_pin : public hal::output_pin
 {
 public:
   /**
    * @brief Constructor. Takes a *full path* to the GPIO character device and a
-   * numeber that is known to said device.
+   * numeber that is known to said device. The chip is opened through the
+   * shared hal::linux::gpio_chip registry.
    * @param p_chip_name Full path to GPIO character device.
    * @param p_pin Pin number for said device
    *
    * @throws std::invalid_argument if an invalid chip path was given, an invalid
    * pin number was given, or if a request to said line failed.
    */
-  output_pin(const std::string& p_chip_name, const std::uint16_t p_pin)
+  basic_output_pin(const std::string& p_chip_name, const std::uint16_t p_pin)
     : m_pin(p_pin)
+    , m_line(
+        request_line<syscalls>(p_chip_name, p_pin, GPIO_V2_LINE_FLAG_OUTPUT))
+    , m_log_device(deferred_log::device_id(m_line.chip->path()))
+    , m_stats(m_line.chip->path(), p_pin)
   {
-    m_chip_fd = open(p_chip_name.c_str(), O_RDONLY);
-    if (m_chip_fd < 0) {
-      throw invalid_character_device(p_chip_name, errno, this);
-    }
-    memset(&m_line_request, 0, sizeof(gpio_line_request));
     memset(&m_values, 0, sizeof(gpio_values));
-    m_line_request.offsets[0] = p_pin;
-    m_line_request.num_lines = 1;
-    m_line_request.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
-    if (ioctl(m_chip_fd, GPIO_V2_GET_LINE_IOCTL, &m_line_request) < 0) {
-      throw errno_exception(errno, std::errc::connection_refused, this);
-    }
-    m_values.mask = 1;  // only use a single channel
+    m_values.mask = m_line.mask();
+  }
+
+  /**
+   * @brief Constructor. Reserves the pin in a configuration phase, so it
+   * shares a line request with the other pins of the batch. The pin may only
+   * be used once the batch is committed.
+   * @param p_batch Configuration phase of the chip the pin belongs to.
+   * @param p_pin Pin number for said device
+   *
+   * @throws hal::operation_not_permitted if the batch was already committed.
+   */
+  basic_output_pin(basic_line_batch<syscalls>& p_batch,
+                   const std::uint16_t p_pin)
+    : m_pin(p_pin)
+    , m_line(p_batch.add(p_pin, GPIO_V2_LINE_FLAG_OUTPUT))
+    , m_log_device(deferred_log::device_id(m_line.chip->path()))
+    , m_stats(m_line.chip->path(), p_pin)
+  {
+    memset(&m_values, 0, sizeof(gpio_values));
+    m_values.mask = m_line.mask();
+  }
+
+  virtual ~basic_output_pin() = default;
+
+  /// Counters of this pin, empty unless built with HAL_LINUX_INSTRUMENTATION
+  const driver_stats& stats() const
+  {
+    return m_stats;
+  }
+
+  /**
+   * @brief Opt in to shadow-state caching. While enabled, the pin remembers
+   * the last level written by this process, level() answers from that copy
+   * without an ioctl and writes that would not change the level are skipped.
+   *
+   * Lines that something else can drive, such as a shared open drain line,
+   * should use read_back() to see the real state of the line.
+   * @param p_enabled true to enable caching. Toggling it forgets the cached
+   * level.
+   */
+  void cache_level(bool p_enabled)
+  {
+    m_cached = p_enabled;
+    m_shadow_valid = false;
   }
-  virtual ~output_pin()
+
+  /**
+   * @brief Read the level of the line from the kernel, bypassing the cache.
+   * When caching is enabled the cached level is refreshed with the result.
+   *
+   * @throws hal::io_error if the kernel rejected the read.
+   */
+  bool read_back()
   {
-    close(m_line_request.fd);
-    close(m_chip_fd);
+    HAL_LINUX_PROBE2(pin_level, m_pin, -1);
+    auto operation = m_stats.measure();
+    const auto fd = m_line.request->fd();
+    if (syscalls::ioctl(fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &m_values) < 0) {
+      log_error(log_event::pin_get, m_log_device, m_pin, errno);
+      throw hal::io_error(this);
+    }
+    m_shadow = static_cast<bool>(m_values.bits & m_values.mask);
+    m_shadow_valid = m_cached;
+    return m_shadow;
   }
 
 private:
-  int m_chip_fd = -1;
   int m_pin;
-  gpio_line_request m_line_request;
+  basic_line_handle<syscalls> m_line;
+  std::uint32_t m_log_device;
   gpio_values m_values;
+  bool m_cached = false;
+  bool m_shadow_valid = false;
+  bool m_shadow = false;
+  [[no_unique_address]] driver_stats m_stats;
 
   void driver_level(bool p_high) override
   {
-    m_values.bits = p_high & m_values.mask;
-    if (ioctl(m_line_request.fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &m_values) <
-        0) {
-      char err_msg[20];
-      sprintf(err_msg, "Setting Pin: %d", m_pin);
-      perror(err_msg);
+    if (m_shadow_valid && m_shadow == p_high) {
+      return;
+    }
+    HAL_LINUX_PROBE2(pin_level, m_pin, static_cast<int>(p_high));
+    auto operation = m_stats.measure();
+    m_values.bits = p_high ? m_values.mask : 0;
+    const auto fd = m_line.request->fd();
+    if (syscalls::ioctl(fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &m_values) < 0) {
+      log_error(log_event::pin_set, m_log_device, m_pin, errno);
+      m_shadow_valid = false;
       throw hal::io_error(this);
     }
+    m_shadow = p_high;
+    m_shadow_valid = m_cached;
   }
 
   bool driver_level() override
   {
-    if (ioctl(m_line_request.fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &m_values) <
-        0) {
-      char err_msg[20];
-      sprintf(err_msg, "Getting Pin: %d", m_pin);
-      perror(err_msg);
-      throw hal::io_error(this);
+    if (m_shadow_valid) {
+      return m_shadow;
     }
-    return static_cast<bool>(m_values.bits & m_values.mask);
+    return read_back();
   }
 
   void driver_configure(const settings& p_settings) override
   {
+    std::uint64_t flags = GPIO_V2_LINE_FLAG_OUTPUT;
+
     // Resistor settings
     switch (p_settings.resistor) {
       default:
       case hal::pin_resistor::none:
         break;
       case hal::pin_resistor::pull_up:
-        m_line_request.config.flags |= GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+        flags |= GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
         break;
       case hal::pin_resistor::pull_down:
-        m_line_request.config.flags |= GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN;
+        flags |= GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN;
         break;
     }
 
     // Open Drain
     if (p_settings.open_drain) {
-      m_line_request.config.flags |= GPIO_V2_LINE_FLAG_OPEN_DRAIN;
+      flags |= GPIO_V2_LINE_FLAG_OPEN_DRAIN;
     }
 
-    if (ioctl(m_line_request.fd,
-              GPIO_V2_LINE_SET_CONFIG_IOCTL,
-              &m_line_request.config) < 0) {
-      perror("Failed to configured");
-      throw hal::operation_not_permitted(this);
-    }
+    // Bias and drive changes can move the line, read it again next time
+    m_shadow_valid = false;
+    // Other lines of a shared request keep their flags and output levels,
+    // line_flags() carries the current levels through SET_CONFIG
+    m_line.request->line_flags(m_line.index, flags);
   }
 };
+
+using output_pin = basic_output_pin<posix_syscalls>;
 }  // namespace hal::linux
\ No newline at end of file
@@ -0,0 +1,195 @@
+#pragma once
+#include "errors.hpp"
+#include "gpio_chip.hpp"
+#include "instrumentation.hpp"
+#include "line_request.hpp"
+#include "syscalls.hpp"
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <libhal/error.hpp>
+#include <libhal/output_pin.hpp>
+#include <linux/gpio.h>
+#include <memory>
+#include <span>
+#include <string>
+#include <unistd.h>
+
+namespace hal::linux {
+
+/**
+ * @brief A group of up to 64 output lines on one GPIO character device that
+ * share a single gpio_v2 line request. Every line in the port is written with
+ * one ioctl, so parallel bus updates are atomic from the kernel's point of
+ * view.
+ *
+ * All kernel calls go through the syscalls policy, see
+ * hal::linux::posix_syscalls. Use the hal::linux::output_port alias for real
+ * hardware.
+ */
+template<class syscalls>
+class basic_output_port
+{
+public:
+  /**
+   * @brief Per-bit view of an output_port, usable anywhere a hal::output_pin
+   * is expected. Each call costs a single masked ioctl on the shared request.
+   * The view must not outlive the port that created it.
+   */
+  class pin_view : public hal::output_pin
+  {
+  public:
+    pin_view(basic_output_port& p_port, std::size_t p_index)
+      : m_port(&p_port)
+      , m_index(p_index)
+    {
+    }
+
+  private:
+    void driver_configure(const settings& p_settings) override
+    {
+      m_port->configure(m_index, p_settings);
+    }
+
+    void driver_level(bool p_high) override
+    {
+      const std::uint64_t mask = std::uint64_t{ 1 } << m_index;
+      m_port->level(p_high ? mask : 0, mask);
+    }
+
+    bool driver_level() override
+    {
+      const std::uint64_t mask = std::uint64_t{ 1 } << m_index;
+      return static_cast<bool>(m_port->level() & mask);
+    }
+
+    basic_output_port* m_port;
+    std::size_t m_index;
+  };
+
+  /**
+   * @brief Constructor. Takes a *full path* to the GPIO character device and
+   * the line numbers, known to said device, that make up the port. The chip is
+   * opened through the shared hal::linux::gpio_chip registry.
+   * @param p_chip_name Full path to GPIO character device.
+   * @param p_pins Pin numbers for said device, at most GPIO_V2_LINES_MAX. Bit
+   * `n` of the port maps to `p_pins[n]`.
+   *
+   * @throws hal::linux::invalid_character_device if an invalid chip path was
+   * given.
+   * @throws hal::argument_out_of_domain if no pins or too many pins were given.
+   * @throws hal::linux::errno_exception if a request to said lines failed.
+   */
+  basic_output_port(const std::string& p_chip_name,
+                    std::span<const std::uint16_t> p_pins)
+    : m_stats(p_chip_name)
+  {
+    if (p_pins.empty() || p_pins.size() > request_type::max_lines) {
+      throw hal::argument_out_of_domain(this);
+    }
+    m_chip = basic_gpio_chip<syscalls>::open(p_chip_name);
+
+    std::array<std::uint32_t, request_type::max_lines> offsets{};
+    std::array<std::uint64_t, request_type::max_lines> flags{};
+    std::copy(p_pins.begin(), p_pins.end(), offsets.begin());
+    flags.fill(GPIO_V2_LINE_FLAG_OUTPUT);
+    m_request = std::make_unique<request_type>(
+      m_chip->fd(),
+      std::span(offsets).first(p_pins.size()),
+      std::span<const std::uint64_t>(flags).first(p_pins.size()));
+  }
+
+  basic_output_port(const basic_output_port&) = delete;
+  basic_output_port& operator=(const basic_output_port&) = delete;
+
+  virtual ~basic_output_port() = default;
+
+  /**
+   * @brief Drive every line selected by p_mask at once.
+   * @param p_bits New levels, bit `n` drives the `n`th pin of the port.
+   * @param p_mask Lines to update, defaults to the whole port.
+   *
+   * @throws hal::io_error if the kernel rejected the update.
+   */
+  void level(std::uint64_t p_bits, std::uint64_t p_mask = ~std::uint64_t{ 0 })
+  {
+    auto operation = m_stats.measure();
+    m_request->values(p_bits, p_mask & m_request->mask());
+  }
+
+  /**
+   * @brief Read back the level of every line in the port with one ioctl.
+   *
+   * @throws hal::io_error if the kernel rejected the read.
+   */
+  std::uint64_t level()
+  {
+    auto operation = m_stats.measure();
+    return m_request->values(m_request->mask());
+  }
+
+  /**
+   * @brief Configure a single line of the port. The other lines keep their
+   * settings, and every line keeps the level it is driven to.
+   * @param p_index Bit position of the line within the port.
+   * @param p_settings Resistor and drive settings for that line.
+   *
+   * @throws hal::argument_out_of_domain if p_index is outside the port.
+   * @throws hal::operation_not_permitted if the kernel refused the config.
+   */
+  void configure(std::size_t p_index,
+                 const hal::output_pin::settings& p_settings)
+  {
+    std::uint64_t flags = GPIO_V2_LINE_FLAG_OUTPUT;
+    switch (p_settings.resistor) {
+      default:
+      case hal::pin_resistor::none:
+        break;
+      case hal::pin_resistor::pull_up:
+        flags |= GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+        break;
+      case hal::pin_resistor::pull_down:
+        flags |= GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN;
+        break;
+    }
+    if (p_settings.open_drain) {
+      flags |= GPIO_V2_LINE_FLAG_OPEN_DRAIN;
+    }
+    m_request->line_flags(p_index, flags);
+  }
+
+  /**
+   * @brief Get a hal::output_pin view of a single line of the port.
+   * @param p_index Bit position of the line within the port.
+   *
+   * @throws hal::argument_out_of_domain if p_index is outside the port.
+   */
+  pin_view pin(std::size_t p_index)
+  {
+    if (p_index >= size()) {
+      throw hal::argument_out_of_domain(this);
+    }
+    return pin_view(*this, p_index);
+  }
+
+  std::size_t size() const
+  {
+    return m_request->size();
+  }
+
+  /// Counters of this port, empty unless built with HAL_LINUX_INSTRUMENTATION
+  const driver_stats& stats() const
+  {
+    return m_stats;
+  }
+
+private:
+  using request_type = basic_line_request<syscalls>;
+
+  std::shared_ptr<basic_gpio_chip<syscalls>> m_chip;
+  std::unique_ptr<request_type> m_request;
+  [[no_unique_address]] driver_stats m_stats;
+};
+
+using output_port = basic_output_port<posix_syscalls>;
+}  // namespace hal::linux
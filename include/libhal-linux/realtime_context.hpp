@@ -0,0 +1,323 @@
+#pragma once
+#include "deferred_log.hpp"
+#include <algorithm>
+#include <alloca.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+#include <vector>
+
+namespace hal::linux {
+
+/**
+ * @brief Puts the calling thread into a state fit for a deterministic control
+ * loop for as long as the object lives.
+ *
+ * On construction it pins the thread to CPUs, switches it to SCHED_FIFO,
+ * locks the process memory, pre-faults stack and heap so later page faults
+ * cannot stall driver calls, and tightens the thread's timer slack. Each
+ * step is optional. A step the process lacks the privileges or limits for is
+ * skipped: a warning goes to hal::linux::deferred_log, the errno is kept in
+ * applied(), and the remaining steps still apply. Destruction restores the
+ * affinity, scheduler and timer slack and unlocks memory once no context
+ * holds it locked anymore.
+ *
+ * Affinity, scheduler and timer slack belong to the thread, so create and
+ * destroy the context on the thread it is meant for. Memory locking and the
+ * heap settings apply to the whole process.
+ */
+class realtime_context
+{
+public:
+  struct settings
+  {
+    /// CPUs to pin the thread to, empty keeps the current affinity
+    std::vector<int> cpus = {};
+    /// SCHED_FIFO priority from 1 to 99, 0 keeps the current scheduler
+    int priority = 0;
+    /// Lock current and future memory with mlockall
+    bool lock_memory = true;
+    /// Bytes of stack to touch up front
+    std::size_t prefault_stack = 256 * 1024;
+    /// Bytes of heap to fault in and keep for later allocations. Also stops
+    /// malloc from handing memory back to the kernel, for the whole process.
+    std::size_t prefault_heap = 0;
+    /// How far the kernel may delay timer wake ups to batch them, 0 keeps
+    /// the default of 50 us
+    std::chrono::nanoseconds timer_slack = std::chrono::nanoseconds(1);
+  };
+
+  /// errno of each step, 0 if it was applied or not asked for
+  struct status
+  {
+    int affinity = 0;
+    int scheduler = 0;
+    int memory_lock = 0;
+    int prefault = 0;
+    int timer_slack = 0;
+
+    bool fully_applied() const
+    {
+      return affinity == 0 && scheduler == 0 && memory_lock == 0 &&
+             prefault == 0 && timer_slack == 0;
+    }
+  };
+
+  /// How late wake ups were compared to the time they were asked for
+  struct jitter_stats
+  {
+    std::uint64_t samples = 0;
+    std::int64_t min_ns = 0;
+    std::int64_t max_ns = 0;
+    double mean_ns = 0.0;
+    std::int64_t p99_ns = 0;
+  };
+
+  /// Apply the default settings, see settings
+  realtime_context()
+    : realtime_context(settings{})
+  {
+  }
+
+  /**
+   * @brief Apply p_settings to the calling thread. Never throws for missing
+   * privileges, check applied() for what took effect.
+   */
+  explicit realtime_context(const settings& p_settings)
+    : m_thread(gettid())
+    , m_log_device(deferred_log::device_id("realtime_context"))
+  {
+    apply_affinity(p_settings.cpus);
+    apply_scheduler(p_settings.priority);
+    if (p_settings.lock_memory) {
+      lock_memory();
+    }
+    prefault(p_settings.prefault_stack, p_settings.prefault_heap);
+    apply_timer_slack(p_settings.timer_slack);
+  }
+
+  realtime_context(const realtime_context&) = delete;
+  realtime_context& operator=(const realtime_context&) = delete;
+
+  ~realtime_context()
+  {
+    if (m_saved_slack >= 0) {
+      prctl(PR_SET_TIMERSLACK, static_cast<unsigned long>(m_saved_slack));
+    }
+    if (m_memory_locked && memory_locks().fetch_sub(1) == 1) {
+      munlockall();
+    }
+    if (m_scheduler_saved) {
+      sched_setscheduler(m_thread, m_saved_policy, &m_saved_param);
+    }
+    if (m_affinity_saved) {
+      sched_setaffinity(m_thread, sizeof(m_saved_affinity), &m_saved_affinity);
+    }
+  }
+
+  const status& applied() const
+  {
+    return m_status;
+  }
+
+  /**
+   * @brief Measure wake up lateness of the calling thread by sleeping until
+   * absolute CLOCK_MONOTONIC deadlines, as a periodic control loop would.
+   * @param p_period Time between wake ups.
+   * @param p_samples Number of wake ups to measure.
+   * @return Lateness statistics, in the state the thread is in right now.
+   */
+  static jitter_stats measure_jitter(
+    std::chrono::nanoseconds p_period = std::chrono::milliseconds(1),
+    std::size_t p_samples = 1000)
+  {
+    std::vector<std::int64_t> lateness(std::max<std::size_t>(p_samples, 1));
+    std::int64_t deadline = now_ns();
+    for (auto& sample : lateness) {
+      deadline += p_period.count();
+      const timespec wake_up{
+        .tv_sec = static_cast<time_t>(deadline / 1'000'000'000),
+        .tv_nsec = static_cast<long>(deadline % 1'000'000'000),
+      };
+      while (clock_nanosleep(
+               CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_up, nullptr) == EINTR) {
+      }
+      sample = now_ns() - deadline;
+    }
+
+    jitter_stats stats{ .samples = lateness.size() };
+    double total = 0.0;
+    for (const auto sample : lateness) {
+      total += static_cast<double>(sample);
+    }
+    stats.mean_ns = total / static_cast<double>(lateness.size());
+    std::sort(lateness.begin(), lateness.end());
+    stats.min_ns = lateness.front();
+    stats.max_ns = lateness.back();
+    stats.p99_ns = lateness[(lateness.size() - 1) * 99 / 100];
+    return stats;
+  }
+
+private:
+  static std::int64_t now_ns()
+  {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1'000'000'000LL + now.tv_nsec;
+  }
+
+  // Contexts holding memory locked, munlockall waits for the last one
+  static std::atomic<int>& memory_locks()
+  {
+    static std::atomic<int> count = 0;
+    return count;
+  }
+
+  void warn(log_event p_event, int& p_status, int p_error)
+  {
+    p_status = p_error;
+    deferred_log::global().record(
+      log_level::warning, p_event, m_log_device, m_thread, p_error);
+  }
+
+  void apply_affinity(const std::vector<int>& p_cpus)
+  {
+    if (p_cpus.empty()) {
+      return;
+    }
+    const auto size = sizeof(m_saved_affinity);
+    if (sched_getaffinity(m_thread, size, &m_saved_affinity) < 0) {
+      warn(log_event::realtime_affinity, m_status.affinity, errno);
+      return;
+    }
+    cpu_set_t wanted;
+    CPU_ZERO(&wanted);
+    for (const auto cpu : p_cpus) {
+      if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        warn(log_event::realtime_affinity, m_status.affinity, EINVAL);
+        return;
+      }
+      CPU_SET(cpu, &wanted);
+    }
+    if (sched_setaffinity(m_thread, sizeof(wanted), &wanted) < 0) {
+      warn(log_event::realtime_affinity, m_status.affinity, errno);
+      return;
+    }
+    m_affinity_saved = true;
+  }
+
+  void apply_scheduler(int p_priority)
+  {
+    if (p_priority == 0) {
+      return;
+    }
+    m_saved_policy = sched_getscheduler(m_thread);
+    if (m_saved_policy < 0 || sched_getparam(m_thread, &m_saved_param) < 0) {
+      warn(log_event::realtime_scheduler, m_status.scheduler, errno);
+      return;
+    }
+    const sched_param param{ .sched_priority = std::clamp(
+                               p_priority,
+                               sched_get_priority_min(SCHED_FIFO),
+                               sched_get_priority_max(SCHED_FIFO)) };
+    // EPERM without CAP_SYS_NICE or a high enough RLIMIT_RTPRIO
+    if (sched_setscheduler(m_thread, SCHED_FIFO, &param) < 0) {
+      warn(log_event::realtime_scheduler, m_status.scheduler, errno);
+      return;
+    }
+    m_scheduler_saved = true;
+  }
+
+  void lock_memory()
+  {
+    // ENOMEM or EPERM when RLIMIT_MEMLOCK is below what the process maps
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+      warn(log_event::realtime_memory_lock, m_status.memory_lock, errno);
+      return;
+    }
+    memory_locks().fetch_add(1);
+    m_memory_locked = true;
+  }
+
+  void prefault(std::size_t p_stack, std::size_t p_heap)
+  {
+    // Leave room below the pre-faulted part for the frames still to come
+    pthread_attr_t attributes;
+    if (pthread_getattr_np(pthread_self(), &attributes) == 0) {
+      std::size_t stack_size = 0;
+      pthread_attr_getstacksize(&attributes, &stack_size);
+      pthread_attr_destroy(&attributes);
+      constexpr std::size_t reserve = 64 * 1024;
+      const auto usable = stack_size > reserve ? stack_size - reserve : 0;
+      if (p_stack > usable) {
+        warn(log_event::realtime_prefault, m_status.prefault, ENOMEM);
+        p_stack = usable;
+      }
+    }
+    if (p_stack > 0) {
+      touch_stack(p_stack);
+    }
+
+    if (p_heap > 0) {
+      // Keep freed memory in the process and serve large blocks from the
+      // heap, so pre-faulted pages are reused instead of unmapped
+      mallopt(M_TRIM_THRESHOLD, -1);
+      mallopt(M_MMAP_MAX, 0);
+      auto* heap = static_cast<volatile char*>(malloc(p_heap));
+      if (!heap) {
+        warn(log_event::realtime_prefault, m_status.prefault, ENOMEM);
+        return;
+      }
+      const auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+      for (std::size_t offset = 0; offset < p_heap; offset += page) {
+        heap[offset] = 0;
+      }
+      free(const_cast<char*>(heap));
+    }
+  }
+
+  [[gnu::noinline]] static void touch_stack(std::size_t p_bytes)
+  {
+    auto* stack = static_cast<volatile char*>(alloca(p_bytes));
+    const auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    for (std::size_t offset = 0; offset < p_bytes; offset += page) {
+      stack[offset] = 0;
+    }
+  }
+
+  void apply_timer_slack(std::chrono::nanoseconds p_slack)
+  {
+    // Zero would reset the slack to the default instead
+    if (p_slack.count() <= 0) {
+      return;
+    }
+    const auto slack = static_cast<unsigned long>(p_slack.count());
+    const int saved = prctl(PR_GET_TIMERSLACK);
+    if (saved < 0 || prctl(PR_SET_TIMERSLACK, slack) < 0) {
+      warn(log_event::realtime_timer_slack, m_status.timer_slack, errno);
+      return;
+    }
+    m_saved_slack = saved;
+  }
+
+  pid_t m_thread;
+  std::uint32_t m_log_device;
+  status m_status;
+  cpu_set_t m_saved_affinity{};
+  bool m_affinity_saved = false;
+  int m_saved_policy = SCHED_OTHER;
+  sched_param m_saved_param{};
+  bool m_scheduler_saved = false;
+  bool m_memory_locked = false;
+  int m_saved_slack = -1;
+};
+}  // namespace hal::linux
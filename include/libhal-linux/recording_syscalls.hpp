@@ -0,0 +1,265 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace hal::linux {
+
+/**
+ * @brief Records every call a driver makes through
+ * hal::linux::recording_syscalls, for testing drivers of devices that
+ * hal::linux::simulated_kernel does not model, such as spidev.
+ *
+ * open() hands out real eventfds, so descriptors can be closed and polled.
+ * Every ioctl is recorded with a copy of the _IOC_SIZE(request) bytes its
+ * argument points to, so the structures a driver passed can be checked after
+ * the call returned. Pointers inside them, such as spi_ioc_transfer::tx_buf,
+ * still point into the driver. Writes are recorded with the bytes written,
+ * reads fail with EAGAIN.
+ *
+ * Tests answer ioctls, or make them fail, with on_ioctl() and make the next
+ * open fail with fail_open(). All state is behind a single mutex.
+ */
+class syscall_recorder
+{
+public:
+  enum class call_type
+  {
+    open,
+    close,
+    ioctl,
+    read,
+    write,
+  };
+
+  struct call
+  {
+    call_type type = call_type::ioctl;
+    int fd = -1;
+    /// ioctl request, or open flags
+    unsigned long request = 0;
+    /// Argument of ioctls that take it by value
+    unsigned long value = 0;
+    /// Path passed to open
+    std::string path = {};
+    /// Copy of the ioctl argument, or the bytes written
+    std::vector<std::uint8_t> data = {};
+  };
+
+  /// Returns like ioctl(). For requests that take their argument by value
+  /// p_argument holds the value itself.
+  using ioctl_handler =
+    std::function<int(int p_fd, unsigned long p_request, void* p_argument)>;
+
+  static syscall_recorder& instance()
+  {
+    static syscall_recorder recorder;
+    return recorder;
+  }
+
+  syscall_recorder(const syscall_recorder&) = delete;
+  syscall_recorder& operator=(const syscall_recorder&) = delete;
+
+  /// Make the next open() fail with p_errno
+  void fail_open(int p_errno)
+  {
+    std::lock_guard lock(m_lock);
+    m_open_error = p_errno;
+  }
+
+  /// Answer every following ioctl with p_handler instead of returning 0
+  void on_ioctl(ioctl_handler p_handler)
+  {
+    std::lock_guard lock(m_lock);
+    m_ioctl_handler = std::move(p_handler);
+  }
+
+  /// Every call recorded so far, oldest first
+  std::vector<call> calls() const
+  {
+    std::lock_guard lock(m_lock);
+    return m_calls;
+  }
+
+  /// Recorded ioctls with request p_request
+  std::vector<call> ioctls(unsigned long p_request) const
+  {
+    std::lock_guard lock(m_lock);
+    std::vector<call> matches;
+    std::copy_if(m_calls.begin(),
+                 m_calls.end(),
+                 std::back_inserter(matches),
+                 [p_request](const call& p_call) {
+                   return p_call.type == call_type::ioctl &&
+                          p_call.request == p_request;
+                 });
+    return matches;
+  }
+
+  /// Forget the recorded calls, keeping the handler
+  void clear()
+  {
+    std::lock_guard lock(m_lock);
+    m_calls.clear();
+  }
+
+  /// Forget the recorded calls, the handler and a pending open failure
+  void reset()
+  {
+    std::lock_guard lock(m_lock);
+    m_calls.clear();
+    m_ioctl_handler = nullptr;
+    m_open_error = 0;
+  }
+
+  int open(const char* p_path, int p_flags)
+  {
+    std::lock_guard lock(m_lock);
+    if (m_open_error != 0) {
+      errno = std::exchange(m_open_error, 0);
+      return -1;
+    }
+    const int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd >= 0) {
+      m_calls.push_back({ .type = call_type::open,
+                          .fd = fd,
+                          .request = static_cast<unsigned long>(p_flags),
+                          .path = p_path });
+    }
+    return fd;
+  }
+
+  int close(int p_fd)
+  {
+    {
+      std::lock_guard lock(m_lock);
+      m_calls.push_back({ .type = call_type::close, .fd = p_fd });
+    }
+    return ::close(p_fd);
+  }
+
+  int ioctl(int p_fd, unsigned long p_request, void* p_argument)
+  {
+    call record{ .type = call_type::ioctl, .fd = p_fd, .request = p_request };
+    if (p_argument) {
+      const auto* bytes = static_cast<const std::uint8_t*>(p_argument);
+      record.data.assign(bytes, bytes + _IOC_SIZE(p_request));
+    }
+    return answer(std::move(record), p_argument);
+  }
+
+  int ioctl(int p_fd, unsigned long p_request, unsigned long p_value)
+  {
+    return answer({ .type = call_type::ioctl,
+                    .fd = p_fd,
+                    .request = p_request,
+                    .value = p_value },
+                  reinterpret_cast<void*>(p_value));
+  }
+
+  ssize_t read(int p_fd, void*, std::size_t p_size)
+  {
+    std::lock_guard lock(m_lock);
+    m_calls.push_back({ .type = call_type::read, .fd = p_fd, .value = p_size });
+    errno = EAGAIN;
+    return -1;
+  }
+
+  ssize_t write(int p_fd, const void* p_buffer, std::size_t p_size)
+  {
+    const iovec vector{ const_cast<void*>(p_buffer), p_size };
+    return writev(p_fd, &vector, 1);
+  }
+
+  ssize_t writev(int p_fd, const iovec* p_vectors, int p_count)
+  {
+    call record{ .type = call_type::write, .fd = p_fd };
+    for (int i = 0; i < p_count; i++) {
+      const auto& vector = p_vectors[i];
+      const auto* bytes = static_cast<const std::uint8_t*>(vector.iov_base);
+      record.data.insert(record.data.end(), bytes, bytes + vector.iov_len);
+    }
+    const auto size = static_cast<ssize_t>(record.data.size());
+    std::lock_guard lock(m_lock);
+    m_calls.push_back(std::move(record));
+    return size;
+  }
+
+private:
+  syscall_recorder() = default;
+
+  // The handler runs without the lock, so it may use the recorder itself
+  int answer(call p_record, void* p_argument)
+  {
+    ioctl_handler handler;
+    {
+      std::lock_guard lock(m_lock);
+      handler = m_ioctl_handler;
+      m_calls.push_back(p_record);
+    }
+    if (!handler) {
+      return 0;
+    }
+    return handler(p_record.fd, p_record.request, p_argument);
+  }
+
+  mutable std::mutex m_lock;
+  std::vector<call> m_calls;
+  ioctl_handler m_ioctl_handler;
+  int m_open_error = 0;
+};
+
+/**
+ * @brief Syscall policy that records the calls of a driver in
+ * syscall_recorder::instance(), see hal::linux::posix_syscalls.
+ */
+struct recording_syscalls
+{
+  static int open(const char* p_path, int p_flags)
+  {
+    return syscall_recorder::instance().open(p_path, p_flags);
+  }
+
+  static int close(int p_fd)
+  {
+    return syscall_recorder::instance().close(p_fd);
+  }
+
+  static int ioctl(int p_fd, unsigned long p_request, void* p_argument)
+  {
+    return syscall_recorder::instance().ioctl(p_fd, p_request, p_argument);
+  }
+
+  static int ioctl(int p_fd, unsigned long p_request, unsigned long p_value)
+  {
+    return syscall_recorder::instance().ioctl(p_fd, p_request, p_value);
+  }
+
+  static ssize_t read(int p_fd, void* p_buffer, std::size_t p_size)
+  {
+    return syscall_recorder::instance().read(p_fd, p_buffer, p_size);
+  }
+
+  static ssize_t write(int p_fd, const void* p_buffer, std::size_t p_size)
+  {
+    return syscall_recorder::instance().write(p_fd, p_buffer, p_size);
+  }
+
+  static ssize_t writev(int p_fd, const iovec* p_vectors, int p_count)
+  {
+    return syscall_recorder::instance().writev(p_fd, p_vectors, p_count);
+  }
+};
+}  // namespace hal::linux
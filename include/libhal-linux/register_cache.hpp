@@ -0,0 +1,257 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <libhal/error.hpp>
+#include <libhal/i2c.hpp>
+#include <libhal/units.hpp>
+#include <span>
+
+namespace hal::linux {
+
+/**
+ * @brief Register map of an i2c peripheral with 8 bit register addresses,
+ * cached on the host in the style of the kernel's regmap.
+ *
+ * Registers are cached unless declared volatile. A cached register is read
+ * from the bus at most once, and writing the value it already holds costs
+ * nothing, so update_bits() on a cached register costs at most one write.
+ * Volatile registers, such as status and data registers, always go to the
+ * bus.
+ *
+ * Writes go through to the peripheral immediately. During device
+ * initialization, cache_only() defers writes to cached registers instead. A
+ * later sync() merges runs of adjacent dirty registers into burst writes,
+ * which relies on the common register auto-increment behaviour.
+ *
+ * Not thread safe. The bus may be shared with other peripherals.
+ */
+class register_cache
+{
+public:
+  static constexpr std::size_t register_count = 256;
+
+  /// Inclusive range of register addresses
+  struct register_range
+  {
+    hal::byte first;
+    hal::byte last;
+  };
+
+  /**
+   * @param p_bus Bus the peripheral sits on, must outlive the cache.
+   * @param p_address 7 bit address of the peripheral.
+   * @param p_volatile Registers the peripheral may change on its own.
+   * @param p_max_burst Longest burst sync() may write, in registers.
+   */
+  register_cache(hal::i2c& p_bus,
+                 hal::byte p_address,
+                 std::initializer_list<register_range> p_volatile = {},
+                 std::size_t p_max_burst = 32)
+    : m_bus(&p_bus)
+    , m_address(p_address)
+    , m_max_burst(std::clamp<std::size_t>(p_max_burst, 1, max_burst_limit))
+  {
+    for (const auto& range : p_volatile) {
+      mark_volatile(range);
+    }
+  }
+
+  /// Stop caching a range of registers, dropping what was cached for them
+  void mark_volatile(register_range p_range)
+  {
+    for (std::size_t reg = p_range.first; reg <= p_range.last; reg++) {
+      m_volatile.set(reg);
+      m_valid.reset(reg);
+      m_dirty.reset(reg);
+    }
+  }
+
+  /**
+   * @brief Read a register, from the cache if possible.
+   *
+   * @throws any exception the bus throws.
+   */
+  hal::byte read(hal::byte p_register)
+  {
+    if (m_valid.test(p_register)) {
+      return m_values[p_register];
+    }
+    hal::byte value = 0;
+    bus_read(p_register, { &value, 1 });
+    store(p_register, value);
+    return value;
+  }
+
+  /**
+   * @brief Read consecutive registers, with one bus transaction if any of
+   * them is volatile or not cached yet.
+   * @param p_first First register to read.
+   * @param p_data Receives the values, must not run past register 0xFF.
+   *
+   * @throws hal::argument_out_of_domain if the range runs past 0xFF.
+   * @throws any exception the bus throws.
+   */
+  void read(hal::byte p_first, std::span<hal::byte> p_data)
+  {
+    check_range(p_first, p_data.size());
+    bool cached = true;
+    for (std::size_t i = 0; i < p_data.size(); i++) {
+      cached = cached && m_valid.test(p_first + i);
+    }
+    if (cached) {
+      std::copy_n(&m_values[p_first], p_data.size(), p_data.begin());
+      return;
+    }
+    bus_read(p_first, p_data);
+    for (std::size_t i = 0; i < p_data.size(); i++) {
+      // Dirty registers hold a deferred write the bus has not seen yet
+      if (!m_dirty.test(p_first + i)) {
+        store(p_first + i, p_data[i]);
+      } else {
+        p_data[i] = m_values[p_first + i];
+      }
+    }
+  }
+
+  /**
+   * @brief Write a register. Skipped when the cache already holds p_value,
+   * deferred to sync() in cache only mode.
+   *
+   * @throws any exception the bus throws.
+   */
+  void write(hal::byte p_register, hal::byte p_value)
+  {
+    const bool is_volatile = m_volatile.test(p_register);
+    if (!is_volatile && m_valid.test(p_register) &&
+        m_values[p_register] == p_value) {
+      return;
+    }
+    if (!is_volatile && m_cache_only) {
+      m_values[p_register] = p_value;
+      m_valid.set(p_register);
+      m_dirty.set(p_register);
+      return;
+    }
+    const std::array<hal::byte, 2> payload = { p_register, p_value };
+    bus_write(payload);
+    store(p_register, p_value);
+    m_dirty.reset(p_register);
+  }
+
+  /**
+   * @brief Read-modify-write the bits of p_mask. Costs one write, or nothing
+   * if the bits already match, for a register that is cached.
+   * @param p_register Register to update.
+   * @param p_mask Bits to change.
+   * @param p_value New value of those bits, other bits are ignored.
+   *
+   * @throws any exception the bus throws.
+   */
+  void update_bits(hal::byte p_register, hal::byte p_mask, hal::byte p_value)
+  {
+    const auto current = read(p_register);
+    write(p_register,
+          static_cast<hal::byte>((current & ~p_mask) | (p_value & p_mask)));
+  }
+
+  /**
+   * @brief Defer writes to cached registers until sync(), or go back to
+   * writing through. Leaving cache only mode does not sync by itself.
+   */
+  void cache_only(bool p_enable)
+  {
+    m_cache_only = p_enable;
+  }
+
+  /**
+   * @brief Write every deferred register, merging adjacent ones into burst
+   * writes of up to the burst limit.
+   * @return Number of bus writes issued.
+   *
+   * @throws any exception the bus throws. Registers not written yet stay
+   * dirty.
+   */
+  std::size_t sync()
+  {
+    std::size_t writes = 0;
+    std::size_t reg = 0;
+    while (reg < register_count) {
+      if (!m_dirty.test(reg)) {
+        reg++;
+        continue;
+      }
+      auto end = reg;
+      while (end < register_count && m_dirty.test(end) &&
+             end - reg < m_max_burst) {
+        end++;
+      }
+      std::array<hal::byte, max_burst_limit + 1> payload;
+      payload[0] = static_cast<hal::byte>(reg);
+      std::copy(&m_values[reg], &m_values[0] + end, payload.begin() + 1);
+      bus_write(std::span(payload).first(end - reg + 1));
+      for (auto i = reg; i < end; i++) {
+        m_dirty.reset(i);
+      }
+      writes++;
+      reg = end;
+    }
+    return writes;
+  }
+
+  /// Forget every cached value, for example after resetting the device.
+  /// Deferred writes are dropped as well.
+  void invalidate()
+  {
+    m_valid.reset();
+    m_dirty.reset();
+  }
+
+  /// Registers waiting for sync()
+  std::size_t dirty_count() const
+  {
+    return m_dirty.count();
+  }
+
+private:
+  static constexpr std::size_t max_burst_limit = 64;
+
+  void check_range(hal::byte p_first, std::size_t p_count)
+  {
+    if (p_first + p_count > register_count) {
+      throw hal::argument_out_of_domain(this);
+    }
+  }
+
+  void store(std::size_t p_register, hal::byte p_value)
+  {
+    if (!m_volatile.test(p_register)) {
+      m_values[p_register] = p_value;
+      m_valid.set(p_register);
+    }
+  }
+
+  void bus_read(hal::byte p_first, std::span<hal::byte> p_data)
+  {
+    const std::array<hal::byte, 1> select = { p_first };
+    m_bus->transaction(m_address, select, p_data, [] {});
+  }
+
+  void bus_write(std::span<const hal::byte> p_payload)
+  {
+    m_bus->transaction(m_address, p_payload, {}, [] {});
+  }
+
+  hal::i2c* m_bus;
+  hal::byte m_address;
+  std::size_t m_max_burst;
+  bool m_cache_only = false;
+  std::array<hal::byte, register_count> m_values{};
+  std::bitset<register_count> m_valid;
+  std::bitset<register_count> m_dirty;
+  std::bitset<register_count> m_volatile;
+};
+}  // namespace hal::linux
@@ -0,0 +1,199 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstring>
+#include <libhal/units.hpp>
+#include <memory>
+#include <span>
+#include <utility>
+
+namespace hal::linux {
+
+/**
+ * @brief Lock-free single producer, single consumer byte ring.
+ *
+ * The producer fills the ring in place through write_region() and
+ * commit_write(), so a driver can read() from the kernel straight into it.
+ * The consumer copies bytes out with read(). Capacity is rounded up to a
+ * power of two so wrapping is a mask instead of a division.
+ */
+class spsc_ring
+{
+public:
+  /**
+   * @param p_capacity Minimum number of bytes the ring can hold.
+   */
+  explicit spsc_ring(std::size_t p_capacity)
+    : m_capacity(std::bit_ceil(std::max<std::size_t>(p_capacity, 1)))
+    , m_storage(std::make_unique<hal::byte[]>(m_capacity))
+  {
+  }
+
+  std::size_t capacity() const
+  {
+    return m_capacity;
+  }
+
+  /// Bytes waiting to be read. Exact on the consumer side, a lower bound of
+  /// the free space on the producer side.
+  std::size_t size() const
+  {
+    return m_head.load(std::memory_order_acquire) -
+           m_tail.load(std::memory_order_acquire);
+  }
+
+  /**
+   * @brief Producer only. Contiguous free space starting at the write
+   * position. Empty when the ring is full. Call again after commit_write() to
+   * get the part that wrapped around.
+   */
+  std::span<hal::byte> write_region()
+  {
+    const auto head = m_head.load(std::memory_order_relaxed);
+    const auto tail = m_tail.load(std::memory_order_acquire);
+    const auto free = m_capacity - (head - tail);
+    const auto offset = head & (m_capacity - 1);
+    return { m_storage.get() + offset, std::min(free, m_capacity - offset) };
+  }
+
+  /// Producer only. Publish p_count bytes written into write_region().
+  void commit_write(std::size_t p_count)
+  {
+    m_head.fetch_add(p_count, std::memory_order_release);
+  }
+
+  /**
+   * @brief Consumer only. Copy out as many bytes as fit in p_data.
+   * @return Number of bytes copied.
+   */
+  std::size_t read(std::span<hal::byte> p_data)
+  {
+    const auto tail = m_tail.load(std::memory_order_relaxed);
+    const auto head = m_head.load(std::memory_order_acquire);
+    const auto count = std::min(p_data.size(), head - tail);
+    const auto offset = tail & (m_capacity - 1);
+    const auto first = std::min(count, m_capacity - offset);
+    memcpy(p_data.data(), m_storage.get() + offset, first);
+    memcpy(p_data.data() + first, m_storage.get(), count - first);
+    m_tail.store(tail + count, std::memory_order_release);
+    return count;
+  }
+
+  /// Consumer only. Drop every byte currently in the ring.
+  void clear()
+  {
+    m_tail.store(m_head.load(std::memory_order_acquire),
+                 std::memory_order_release);
+  }
+
+private:
+  std::size_t m_capacity;
+  std::unique_ptr<hal::byte[]> m_storage;
+  // Producer and consumer indices live on separate cache lines so the two
+  // threads never bounce a line between them.
+  alignas(64) std::atomic<std::size_t> m_head = 0;
+  alignas(64) std::atomic<std::size_t> m_tail = 0;
+};
+
+/**
+ * @brief Bounded lock-free queue for any number of producers and consumers.
+ *
+ * Each slot carries a sequence number that tells producers and consumers
+ * whether it is free or filled for their lap around the ring, so claiming a
+ * slot is one compare and swap and no thread ever waits on another. Capacity
+ * is rounded up to a power of two. T must be default constructible and
+ * movable.
+ */
+template<typename T>
+class mpmc_queue
+{
+public:
+  /**
+   * @param p_capacity Minimum number of elements the queue can hold.
+   */
+  explicit mpmc_queue(std::size_t p_capacity)
+    : m_mask(std::bit_ceil(std::max<std::size_t>(p_capacity, 2)) - 1)
+    , m_cells(std::make_unique<cell[]>(m_mask + 1))
+  {
+    for (std::size_t i = 0; i <= m_mask; i++) {
+      m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  std::size_t capacity() const
+  {
+    return m_mask + 1;
+  }
+
+  /**
+   * @brief Append an element.
+   * @return false if the queue is full, p_value is left untouched then.
+   */
+  bool try_push(T&& p_value)
+  {
+    auto position = m_enqueue.load(std::memory_order_relaxed);
+    cell* slot = nullptr;
+    while (true) {
+      slot = &m_cells[position & m_mask];
+      const auto sequence = slot->sequence.load(std::memory_order_acquire);
+      const auto lap = static_cast<std::ptrdiff_t>(sequence - position);
+      if (lap == 0) {
+        if (m_enqueue.compare_exchange_weak(
+              position, position + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (lap < 0) {
+        return false;  // Slot still holds an element from the previous lap
+      } else {
+        position = m_enqueue.load(std::memory_order_relaxed);
+      }
+    }
+    slot->value = std::move(p_value);
+    slot->sequence.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Remove the oldest element.
+   * @return false if the queue is empty.
+   */
+  bool try_pop(T& p_value)
+  {
+    auto position = m_dequeue.load(std::memory_order_relaxed);
+    cell* slot = nullptr;
+    while (true) {
+      slot = &m_cells[position & m_mask];
+      const auto sequence = slot->sequence.load(std::memory_order_acquire);
+      const auto lap = static_cast<std::ptrdiff_t>(sequence - (position + 1));
+      if (lap == 0) {
+        if (m_dequeue.compare_exchange_weak(
+              position, position + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (lap < 0) {
+        return false;  // Nothing published in this slot yet
+      } else {
+        position = m_dequeue.load(std::memory_order_relaxed);
+      }
+    }
+    p_value = std::move(slot->value);
+    slot->value = T{};
+    slot->sequence.store(position + m_mask + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  struct cell
+  {
+    std::atomic<std::size_t> sequence;
+    T value;
+  };
+
+  std::size_t m_mask;
+  std::unique_ptr<cell[]> m_cells;
+  alignas(64) std::atomic<std::size_t> m_enqueue = 0;
+  alignas(64) std::atomic<std::size_t> m_dequeue = 0;
+};
+}  // namespace hal::linux
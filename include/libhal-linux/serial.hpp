@@ -4,53 +4,380 @@
 #include <libhal/serial.hpp>
 
 // Internal includes TODO: move to source
+#include "capture_ring.hpp"
 #include "errors.hpp"
+#include "deadline.hpp"
+#include "deferred_log.hpp"
+#include "event_thread.hpp"
+#include "instrumentation.hpp"
+#include "ring_buffer.hpp"
+#include "syscalls.hpp"
+#include "termios2.hpp"
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/serial.h>
+#include <memory>
+#include <mutex>
+#include <poll.h>
 #include <string.h>
 #include <string>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
-
-namespace {
-inline auto linux_read(int fd, void* buf, size_t nbytes)
-{
-  return read(fd, buf, nbytes);
-}
-
-inline auto linux_write(int fd, const void* buf, size_t nbytes)
-{
-  return write(fd, buf, nbytes);
-}
-}  // namespace
+#include <utility>
+#include <vector>
 
 namespace hal::linux {
-class serial : public hal::serial
+/**
+ * @brief Serial port on a linux tty.
+ *
+ * All kernel calls go through the syscalls policy, see
+ * hal::linux::posix_syscalls. Use the hal::linux::serial alias for real
+ * hardware.
+ */
+template<class syscalls>
+class basic_serial : public hal::serial
 {
 
 public:
-  serial(const std::string& p_file_path, serial::settings p_settings = {})
+  /**
+   * @brief Latency related tty settings that hal::serial::settings does not
+   * cover.
+   */
+  struct latency_settings
   {
-    m_fd = open(p_file_path.c_str(), O_RDWR | O_NDELAY | O_NOCTTY);
+    /// Ask the UART driver to push received bytes to the tty layer right
+    /// away instead of batching them (ASYNC_LOW_LATENCY).
+    bool low_latency = true;
+    /// Minimum bytes for a blocking read to return (VMIN). Only affects
+    /// descriptors that are read in blocking mode.
+    cc_t minimum_bytes = 0;
+    /// Inter-byte timeout for blocking reads, in tenths of a second (VTIME).
+    cc_t timeout_deciseconds = 0;
+    /// RTS/CTS hardware flow control (CRTSCTS).
+    bool hardware_flow_control = false;
+  };
+
+  basic_serial(const std::string& p_file_path, settings p_settings = {})
+    : m_log_device(deferred_log::device_id(p_file_path))
+    , m_stats(p_file_path)
+  {
+    m_fd = syscalls::open(p_file_path.c_str(), O_RDWR | O_NDELAY | O_NOCTTY);
     if (m_fd < 0) {
-      perror("Error opening serial connection");
+      log_error(log_event::serial_open, m_log_device, 0, errno);
       hal::safe_throw(
         hal::linux::invalid_character_device(p_file_path, errno, this));
     }
     configure(p_settings);
   };
 
-  virtual ~serial()
+  virtual ~basic_serial()
   {
-    int res = close(m_fd);
+    if (m_rx_buffer || m_tx_enabled) {
+      event_thread::shared().unwatch(m_fd);
+    }
+    int res = syscalls::close(m_fd);
     if (res < 0) {
-      perror("Failed to close serial connection\n");
+      log_error(log_event::serial_close, m_log_device, 0, errno);
+      hal::safe_throw(hal::io_error(this));
+    }
+  };
+
+  /// File descriptor of the tty, for waiting on it with poll or epoll
+  int native_handle() const
+  {
+    return m_fd;
+  }
+
+  /// Counters of this port, empty unless built with HAL_LINUX_INSTRUMENTATION
+  const driver_stats& stats() const
+  {
+    return m_stats;
+  }
+
+  /**
+   * @brief Apply a latency profile on top of the settings last passed to
+   * configure().
+   * @param p_latency Low latency flag, VMIN/VTIME policy and flow control.
+   * @return false if the UART driver does not support the low_latency flag,
+   * which is common for USB and pseudo terminals. The rest of the profile is
+   * still applied.
+   */
+  bool configure_latency(const latency_settings& p_latency)
+  {
+    m_latency = p_latency;
+    configure(m_settings);
+
+    serial_struct info;
+    if (syscalls::ioctl(m_fd, TIOCGSERIAL, &info) < 0) {
+      return !p_latency.low_latency;
+    }
+    if (p_latency.low_latency) {
+      info.flags |= ASYNC_LOW_LATENCY;
+    } else {
+      info.flags &= ~ASYNC_LOW_LATENCY;
+    }
+    return syscalls::ioctl(m_fd, TIOCSSERIAL, &info) >= 0 ||
+           !p_latency.low_latency;
+  }
+
+  /**
+   * @brief Switch to buffered receive mode. From now on the shared
+   * hal::linux::event_thread drains the tty into a lock-free ring as soon as
+   * data arrives, and read() only copies out of that ring without a syscall.
+   * Bytes that arrive while the ring is full are dropped and counted by
+   * rx_overruns().
+   *
+   * In this mode the tty descriptor is owned by the event thread, so it must
+   * no longer be waited on for readability directly. If the tty hangs up,
+   * for example when a USB adapter is unplugged, the event thread stops
+   * watching it and read() throws once the ring has been emptied.
+   * @param p_capacity Minimum size of the ring in bytes, rounded up to a power
+   * of two. Calling again with buffering enabled does nothing.
+   *
+   * @throws hal::linux::errno_exception if the tty could not be watched.
+   */
+  void enable_rx_buffer(std::size_t p_capacity = 4096)
+  {
+    if (m_rx_buffer) {
+      return;
+    }
+    m_rx_buffer = std::make_unique<spsc_ring>(p_capacity);
+    watch_events();
+  }
+
+  /**
+   * @brief Tee everything received from the tty into a size capped, memory
+   * mapped capture file, see hal::linux::capture_ring for its layout. Bytes
+   * are read from the tty straight into the file mapping and stamped with
+   * the time they arrived, so capturing adds neither a syscall nor a write
+   * to disk per read. read() still returns the same bytes as before. Bytes
+   * dropped by a full receive ring are captured all the same.
+   *
+   * Enable capture before enable_rx_buffer() and before other threads read
+   * from the port.
+   * @param p_path Capture file, created or truncated.
+   * @param p_capacity Bytes of chunks to keep before the oldest are
+   * overwritten. Calling again starts a new capture file.
+   *
+   * @throws hal::operation_not_permitted if buffered receive is enabled.
+   * @throws hal::linux::errno_exception if the file could not be set up.
+   */
+  void enable_capture(const std::string& p_path,
+                      std::size_t p_capacity = 1024 * 1024)
+  {
+    if (m_rx_buffer) {
+      hal::safe_throw(hal::operation_not_permitted(this));
+    }
+    m_capture.reset();
+    m_capture = std::make_unique<capture_ring>(p_path, p_capacity);
+  }
+
+  /// The capture file, or nullptr while capture is off
+  capture_ring* capture()
+  {
+    return m_capture.get();
+  }
+
+  /**
+   * @brief Read without copying, for capture mode. Receives the next chunk
+   * into the capture file and returns it where it landed in the mapping.
+   * @param p_max Most bytes to receive.
+   * @return The received bytes, empty if none were pending. Valid until the
+   * next read from the port.
+   *
+   * @throws hal::operation_not_permitted if capture is off or buffered
+   * receive is enabled.
+   * @throws hal::io_error if the tty could not be read.
+   */
+  std::span<const hal::byte> read_in_place(std::size_t p_max = 4096)
+  {
+    if (!m_capture || m_rx_buffer) {
+      hal::safe_throw(hal::operation_not_permitted(this));
+    }
+    HAL_LINUX_PROBE2(serial_read, m_fd, p_max);
+    auto operation = m_stats.measure();
+    const auto read_res = m_capture->receive(p_max, tty_reader());
+    if (read_res < 0 && errno != EAGAIN) {
+      log_error(log_event::serial_read, m_log_device, p_max, errno);
       hal::safe_throw(hal::io_error(this));
     }
+    if (read_res <= 0) {
+      return {};  // Nothing received yet
+    }
+    operation.bytes(static_cast<std::size_t>(read_res));
+    return m_capture->last();
+  }
+
+  /// How enqueue() treats the bytes it is given
+  enum class tx_ownership
+  {
+    /// Copy the bytes, the caller may reuse its buffer right away
+    copy,
+    /// Queue the span itself. The bytes must stay valid and unchanged until
+    /// wait_tx_empty() returns. Spans shorter than a few dozen bytes are
+    /// copied anyway, as that is cheaper than an extra iovec.
+    borrow,
   };
 
+  /**
+   * @brief Switch to queued transmit mode. From now on write() and enqueue()
+   * never block and never drop bytes silently. Data is written straight away
+   * while the tty accepts it, the rest is queued and the shared
+   * hal::linux::event_thread flushes it with gather writes as soon as the tty
+   * becomes writable again. Small writes are coalesced into shared chunks.
+   *
+   * Once more than p_high_water bytes are queued, enqueue() refuses new data
+   * and write() reports a partial write, so producers can back off instead of
+   * growing the queue without bounds.
+   *
+   * Enable the queue before other threads start writing to the port.
+   * @param p_high_water Queue size in bytes above which new data is refused.
+   * Calling again only updates the limit.
+   *
+   * @throws hal::linux::errno_exception if the tty could not be watched.
+   */
+  void enable_tx_queue(std::size_t p_high_water = 16 * 1024)
+  {
+    {
+      std::lock_guard lock(m_tx_lock);
+      m_tx_high_water = p_high_water;
+      if (m_tx_enabled) {
+        return;
+      }
+      m_tx_enabled = true;
+    }
+    watch_events();
+  }
+
+  /**
+   * @brief Queue bytes for transmission without blocking.
+   * @param p_data Bytes to send.
+   * @param p_ownership Whether to copy p_data or borrow it until sent.
+   * @return false if the queue is above its high water mark, nothing was
+   * queued in that case.
+   *
+   * @throws hal::operation_not_permitted if enable_tx_queue() was not called.
+   * @throws hal::io_error if a previous flush of the queue failed or the tty
+   * hung up.
+   */
+  bool enqueue(std::span<const hal::byte> p_data,
+               tx_ownership p_ownership = tx_ownership::copy)
+  {
+    std::lock_guard lock(m_tx_lock);
+    if (!m_tx_enabled) {
+      hal::safe_throw(hal::operation_not_permitted(this));
+    }
+    throw_on_tx_error();
+    if (tx_queued() >= m_tx_high_water) {
+      return false;
+    }
+    push_tx(p_data, p_ownership);
+    flush_tx();
+    return true;
+  }
+
+  /// Bytes waiting in the transmit queue
+  std::size_t tx_queued() const
+  {
+    return m_tx_queued.load(std::memory_order_relaxed);
+  }
+
+  /// Queue size above which new data is refused
+  std::size_t tx_high_water() const
+  {
+    return m_tx_high_water;
+  }
+
+  /**
+   * @brief Block until every queued byte has been handed to the tty, after
+   * which borrowed spans may be reused.
+   *
+   * @throws hal::io_error if flushing the queue failed or the tty hung up,
+   * the queue is dropped in both cases.
+   */
+  void wait_tx_empty()
+  {
+    std::unique_lock lock(m_tx_lock);
+    m_tx_drained.wait(lock, [this] { return m_tx_queue.empty(); });
+    throw_on_tx_error();
+  }
+
+  /// Bytes dropped because the receive ring was full
+  std::uint64_t rx_overruns() const
+  {
+    return m_rx_overruns.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Read until p_data is full or the deadline passes. While no data is
+   * available the calling thread sleeps in the kernel, or on the receive ring
+   * in buffered mode, so waiting costs no CPU. Bytes that already arrived are
+   * returned without waiting.
+   * @param p_data Buffer to fill.
+   * @param p_deadline Point in time at which to give up.
+   * @return The filled part of p_data, shorter than p_data only if the
+   * deadline passed.
+   *
+   * @throws hal::io_error if reading the tty failed.
+   */
+  std::span<hal::byte> read_until(std::span<hal::byte> p_data,
+                                  deadline& p_deadline)
+  {
+    std::size_t filled = 0;
+    while (true) {
+      filled += driver_read(p_data.subspan(filled)).data.size();
+      if (filled == p_data.size()) {
+        break;
+      }
+      const auto remaining = p_deadline.remaining();
+      if (remaining.count() == 0) {
+        break;
+      }
+      wait_readable(remaining);
+    }
+    return p_data.first(filled);
+  }
+
+  /**
+   * @brief Read until p_data is full, giving up when p_timeout throws. An
+   * opaque timeout cannot say how much time is left, so the thread sleeps in
+   * slices of p_poll_interval and calls p_timeout in between. Prefer the
+   * hal::linux::deadline overload where possible, it never wakes up early.
+   * @param p_data Buffer to fill.
+   * @param p_timeout Timeout function, such as one made by
+   * hal::create_timeout().
+   * @param p_poll_interval Longest time to sleep between timeout checks.
+   * @return p_data, completely filled.
+   *
+   * @throws hal::io_error if reading the tty failed.
+   * @throws hal::timed_out, or whatever else p_timeout throws.
+   */
+  std::span<hal::byte> read_until(
+    std::span<hal::byte> p_data,
+    hal::function_ref<hal::timeout_function> p_timeout,
+    std::chrono::nanoseconds p_poll_interval = std::chrono::milliseconds(1))
+  {
+    std::size_t filled = 0;
+    while (true) {
+      filled += driver_read(p_data.subspan(filled)).data.size();
+      if (filled == p_data.size()) {
+        break;
+      }
+      p_timeout();
+      wait_readable(p_poll_interval);
+    }
+    return p_data;
+  }
+
 private:
   void driver_configure(const settings& p_settings) override
   {
@@ -80,143 +407,395 @@ private:
         hal::safe_throw(hal::operation_not_supported(this));
     }
 
-    // Baudrate settings
-    uint64_t baud = static_cast<int>(p_settings.baud_rate);
-    int internal_baud = 0;
-
-    switch (baud) {
-      case 0:
-        internal_baud = B0;
-        break;
-      case 50:
-        internal_baud = B50;
-        break;
-      case 75:
-        internal_baud = B75;
-        break;
-      case 110:
-        internal_baud = B110;
-        break;
-      case 134:
-        internal_baud = B134;
-        break;
-      case 150:
-        internal_baud = B150;
-        break;
-      case 200:
-        internal_baud = B200;
-        break;
-      case 300:
-        internal_baud = B300;
-        break;
-      case 600:
-        internal_baud = B600;
-        break;
-      case 1200:
-        internal_baud = B1200;
-        break;
-      case 1800:
-        internal_baud = B1800;
-        break;
-      case 2400:
-        internal_baud = B2400;
-        break;
-      case 4800:
-        internal_baud = B4800;
-        break;
-      case 9600:
-        internal_baud = B9600;
-        break;
-      case 19200:
-        internal_baud = B19200;
-        break;
-      case 38400:
-        internal_baud = B38400;
-        break;
-      case 57600:
-        internal_baud = B57600;
-        break;
-      case 115200:
-        internal_baud = B115200;
-        break;
-      case 230400:
-        internal_baud = B230400;
-        break;
-      case 460800:
-        internal_baud = B460800;
-        break;
-      case 500000:
-        internal_baud = B500000;
-        break;
-      case 576000:
-        internal_baud = B576000;
-        break;
-      case 921600:
-        internal_baud = B921600;
-        break;
-      case 1000000:
-        internal_baud = B1000000;
-        break;
-      case 1152000:
-        internal_baud = B1152000;
-        break;
-      case 1500000:
-        internal_baud = B1500000;
-        break;
-      case 2000000:
-        internal_baud = B2000000;
-        break;
-      default:
-        hal::safe_throw(hal::argument_out_of_domain(this));
+    // Baudrate settings, any integer rate through termios2 and BOTHER
+    if (p_settings.baud_rate < 0.0f ||
+        p_settings.baud_rate > static_cast<float>(UINT32_MAX)) {
+      hal::safe_throw(hal::argument_out_of_domain(this));
+    }
+    const auto baud = static_cast<speed_t>(p_settings.baud_rate);
+    if (baud == 0) {
+      control_flags |= B0;  // Hang up
+    } else {
+      control_flags |= linux_bother;
     }
 
-    control_flags |= internal_baud;
+    if (m_latency.hardware_flow_control) {
+      control_flags |= CRTSCTS;
+    }
 
+    memset(&m_options, 0, sizeof(m_options));
     m_options.c_cflag = control_flags;
     m_options.c_iflag = input_flags;
     m_options.c_oflag = 0;
     m_options.c_lflag = 0;
+    m_options.c_ispeed = baud;
+    m_options.c_ospeed = baud;
+    m_options.c_cc[VMIN] = m_latency.minimum_bytes;
+    m_options.c_cc[VTIME] = m_latency.timeout_deciseconds;
 
+    m_settings = p_settings;
     flush();
-    int res = tcsetattr(m_fd, TCSANOW, &m_options);
+    int res = syscalls::ioctl(m_fd, linux_tcsets2, &m_options);
     if (res < 0) {
-      perror("Unable to configure serial device");
+      log_error(log_event::serial_configure, m_log_device, baud, errno);
     }
   }
 
   write_t driver_write(std::span<const hal::byte> p_data) override
   {
-    uint32_t write_res = linux_write(m_fd, &p_data.data()[0], p_data.size());
+    HAL_LINUX_PROBE2(serial_write, m_fd, p_data.size());
+    auto operation = m_stats.measure();
+    if (m_tx_enabled) {
+      std::lock_guard lock(m_tx_lock);
+      throw_on_tx_error();
+      const auto queued = tx_queued();
+      const auto room = queued < m_tx_high_water ? m_tx_high_water - queued : 0;
+      const auto accepted = p_data.first(std::min(room, p_data.size()));
+      if (!accepted.empty()) {
+        push_tx(accepted, tx_ownership::copy);
+        flush_tx();
+      }
+      operation.bytes(accepted.size());
+      return write_t{ .data = accepted };
+    }
+
+    auto write_res = syscalls::write(m_fd, p_data.data(), p_data.size());
     if (write_res < 0) {
-      perror("Failed to write\n");
-      hal::safe_throw(hal::io_error(this));
+      if (errno != EAGAIN) {
+        log_error(
+          log_event::serial_write, m_log_device, p_data.size(), errno);
+        hal::safe_throw(hal::io_error(this));
+      }
+      write_res = 0;  // Transmit buffer of the tty is full
     }
-    return write_t{ .data = p_data.subspan(0, write_res) };
+    operation.bytes(static_cast<std::size_t>(write_res));
+    return write_t{ .data = p_data.first(static_cast<std::size_t>(write_res)) };
   }
 
   read_t driver_read(std::span<hal::byte> p_data) override
   {
-    uint32_t read_res = linux_read(m_fd, &p_data.data()[0], p_data.size());
+    HAL_LINUX_PROBE2(serial_read, m_fd, p_data.size());
+    auto operation = m_stats.measure();
+    if (m_rx_buffer) {
+      const auto count = m_rx_buffer->read(p_data);
+      if (count == 0 && hung_up()) {
+        hal::safe_throw(hal::io_error(this));
+      }
+      operation.bytes(count);
+      return read_t{ .data = p_data.subspan(0, count),
+                     .available = m_rx_buffer->size(),
+                     .capacity = m_rx_buffer->capacity() };
+    }
+
+    auto read_res = receive(p_data.data(), p_data.size());
     if (read_res < 0) {
-      perror("Failed to read\n");
-      hal::safe_throw(hal::io_error(this));
+      if (errno != EAGAIN) {
+        log_error(log_event::serial_read, m_log_device, p_data.size(), errno);
+        hal::safe_throw(hal::io_error(this));
+      }
+      read_res = 0;  // Nothing received yet
     }
-    return read_t{ .data = p_data.subspan(0, read_res),
-                   .available = read_res,
+    const auto count = static_cast<std::size_t>(read_res);
+    operation.bytes(count);
+    return read_t{ .data = p_data.subspan(0, count),
+                   .available = count,
                    .capacity = p_data.size() };
   }
 
+  /// Bytes queued for transmission. Either points into storage, which is
+  /// reserved up front and never reallocated, or at borrowed memory.
+  struct tx_entry
+  {
+    const hal::byte* data;
+    std::size_t size;
+    std::vector<hal::byte> storage;
+  };
+
+  /// Writes shorter than this are copied into a shared chunk
+  static constexpr std::size_t tx_copy_threshold = 64;
+  static constexpr std::size_t tx_chunk_size = 1024;
+  static constexpr int tx_max_iovecs = 64;
+
+  // (Re)registers the tty with the event thread for the events that
+  // currently matter. Must not hold m_tx_lock, as the event thread takes it
+  // while holding its own registry lock.
+  void watch_events()
+  {
+    if (hung_up()) {
+      return;
+    }
+    std::uint32_t events = 0;
+    {
+      std::lock_guard lock(m_tx_lock);
+      m_tx_armed = false;
+      events = tty_events();
+    }
+    event_thread::shared().watch(
+      m_fd, events, [this](std::uint32_t p_events) {
+        if (p_events & EPOLLIN && m_rx_buffer) {
+          fill_rx_buffer();
+          // Taking the lock orders the fill before a reader's size check
+          {
+            std::lock_guard lock(m_rx_lock);
+          }
+          m_rx_ready.notify_all();
+        }
+        if (p_events & (EPOLLHUP | EPOLLERR)) {
+          hang_up();
+          return;
+        }
+        if (p_events & EPOLLOUT) {
+          std::lock_guard lock(m_tx_lock);
+          flush_tx();
+        }
+      });
+    // Re-arm EPOLLOUT if data was queued in the meantime
+    std::lock_guard lock(m_tx_lock);
+    flush_tx();
+  }
+
+  bool hung_up() const
+  {
+    return m_hang_up_error.load(std::memory_order_acquire) != 0;
+  }
+
+  // Runs on the event thread. epoll reports a hang up whatever events are
+  // asked for, so the tty has to be unwatched or the shared event thread
+  // spins on it. Queued data can no longer be sent and is dropped.
+  void hang_up()
+  {
+    m_hang_up_error.store(EIO, std::memory_order_release);
+    log_error(log_event::serial_read, m_log_device, 0, EIO);
+    event_thread::shared().unwatch(m_fd);
+    {
+      std::lock_guard lock(m_rx_lock);
+    }
+    m_rx_ready.notify_all();
+
+    std::lock_guard lock(m_tx_lock);
+    const auto dropped = m_tx_queued.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+      log_error(log_event::serial_tx_queue, m_log_device, dropped, EIO);
+    }
+    m_tx_queue.clear();
+    m_tx_armed = false;
+    m_tx_drained.notify_all();
+  }
+
+  // Called with m_tx_lock held
+  std::uint32_t tty_events() const
+  {
+    std::uint32_t events = 0;
+    if (m_rx_buffer) {
+      events |= EPOLLIN;
+    }
+    if (m_tx_armed) {
+      events |= EPOLLOUT;
+    }
+    return events;
+  }
+
+  // Called with m_tx_lock held
+  void push_tx(std::span<const hal::byte> p_data, tx_ownership p_ownership)
+  {
+    if (p_ownership == tx_ownership::borrow &&
+        p_data.size() >= tx_copy_threshold) {
+      m_tx_queue.push_back({ p_data.data(), p_data.size(), {} });
+      m_tx_queued.fetch_add(p_data.size(), std::memory_order_relaxed);
+      return;
+    }
+
+    while (!p_data.empty()) {
+      auto* tail = m_tx_queue.empty() ? nullptr : &m_tx_queue.back();
+      // A partially sent chunk has data ahead of storage, append at the end
+      std::size_t used = 0;
+      if (tail && !tail->storage.empty()) {
+        used = static_cast<std::size_t>(tail->data + tail->size -
+                                        tail->storage.data());
+      }
+      if (!tail || tail->storage.empty() || used == tail->storage.size()) {
+        tx_entry chunk{ nullptr, 0, {} };
+        chunk.storage.resize(std::max(tx_chunk_size, p_data.size()));
+        chunk.data = chunk.storage.data();
+        m_tx_queue.push_back(std::move(chunk));
+        tail = &m_tx_queue.back();
+        used = 0;
+      }
+      const auto count = std::min(p_data.size(), tail->storage.size() - used);
+      memcpy(tail->storage.data() + used, p_data.data(), count);
+      tail->size += count;
+      m_tx_queued.fetch_add(count, std::memory_order_relaxed);
+      p_data = p_data.subspan(count);
+    }
+  }
+
+  // Called with m_tx_lock held. Writes as much of the queue as the tty
+  // accepts with gather writes, then waits for EPOLLOUT if anything is left.
+  void flush_tx()
+  {
+    while (!m_tx_queue.empty()) {
+      std::array<iovec, tx_max_iovecs> iov;
+      int count = 0;
+      for (auto& entry : m_tx_queue) {
+        if (count == tx_max_iovecs) {
+          break;
+        }
+        iov[count++] = { const_cast<hal::byte*>(entry.data), entry.size };
+      }
+
+      auto sent = syscalls::writev(m_fd, iov.data(), count);
+      if (sent < 0) {
+        if (errno == EAGAIN) {
+          break;
+        }
+        if (errno == EINTR) {
+          continue;
+        }
+        // The queue can no longer be delivered in order, drop it and report
+        // the failure to the next producer.
+        m_tx_error = errno;
+        m_tx_queue.clear();
+        m_tx_queued.store(0, std::memory_order_relaxed);
+        break;
+      }
+
+      m_tx_queued.fetch_sub(sent, std::memory_order_relaxed);
+      auto remaining = static_cast<std::size_t>(sent);
+      while (remaining > 0) {
+        auto& head = m_tx_queue.front();
+        const auto consumed = std::min(remaining, head.size);
+        head.data += consumed;
+        head.size -= consumed;
+        remaining -= consumed;
+        if (head.size == 0) {
+          m_tx_queue.pop_front();
+        }
+      }
+    }
+
+    const bool pending = !m_tx_queue.empty();
+    if (pending != m_tx_armed) {
+      m_tx_armed = pending;
+      event_thread::shared().modify(m_fd, tty_events());
+    }
+    if (!pending) {
+      m_tx_drained.notify_all();
+    }
+  }
+
+  // Called with m_tx_lock held
+  void throw_on_tx_error()
+  {
+    if (hung_up()) {
+      hal::safe_throw(hal::io_error(this));
+    }
+    if (m_tx_error != 0) {
+      errno = std::exchange(m_tx_error, 0);
+      log_error(log_event::serial_tx_queue, m_log_device, 0, errno);
+      hal::safe_throw(hal::io_error(this));
+    }
+  }
+
+  // Sleep until the tty, or the receive ring in buffered mode, has data or
+  // p_timeout passed. Spurious returns are fine, callers loop.
+  void wait_readable(std::chrono::nanoseconds p_timeout)
+  {
+    if (m_rx_buffer) {
+      std::unique_lock lock(m_rx_lock);
+      m_rx_ready.wait_for(lock, p_timeout, [this] {
+        return m_rx_buffer->size() > 0 || hung_up();
+      });
+      return;
+    }
+    pollfd fd{ .fd = m_fd, .events = POLLIN, .revents = 0 };
+    const timespec timeout{
+      .tv_sec = static_cast<time_t>(p_timeout.count() / 1'000'000'000),
+      .tv_nsec = static_cast<long>(p_timeout.count() % 1'000'000'000),
+    };
+    ppoll(&fd, 1, &timeout, nullptr);
+  }
+
+  auto tty_reader()
+  {
+    return [this](hal::byte* p_buffer, std::size_t p_size) {
+      return syscalls::read(m_fd, p_buffer, p_size);
+    };
+  }
+
+  // Reads from the tty, through the capture file while capture is on
+  ssize_t receive(hal::byte* p_buffer, std::size_t p_size)
+  {
+    if (!m_capture) {
+      return syscalls::read(m_fd, p_buffer, p_size);
+    }
+    const auto received = m_capture->receive(p_size, tty_reader());
+    if (received > 0) {
+      std::copy_n(m_capture->last().data(), received, p_buffer);
+    }
+    return received;
+  }
+
+  // Runs on the event thread, the only producer of the receive ring
+  void fill_rx_buffer()
+  {
+    while (true) {
+      auto region = m_rx_buffer->write_region();
+      if (region.empty()) {
+        std::array<hal::byte, 256> discard;
+        const auto dropped = receive(discard.data(), discard.size());
+        if (dropped <= 0) {
+          return;
+        }
+        m_rx_overruns.fetch_add(dropped, std::memory_order_relaxed);
+        continue;
+      }
+      const auto received = receive(region.data(), region.size());
+      if (received <= 0) {
+        return;
+      }
+      m_rx_buffer->commit_write(received);
+      if (static_cast<std::size_t>(received) < region.size()) {
+        return;
+      }
+    }
+  }
+
   void driver_flush() override
   {
     if (m_fd < 0) {
-      printf("[DEBUG] Failed to flush\n");
+      log_error(log_event::serial_flush, m_log_device, 0, EBADF);
       hal::safe_throw(hal::operation_not_permitted(this));
     }
-    tcflush(m_fd, TCIFLUSH);  // Flushes both TX and RX
+    // Same as tcflush(), which has no policy equivalent
+    syscalls::ioctl(m_fd, TCFLSH, static_cast<unsigned long>(TCIFLUSH));
+    if (m_rx_buffer) {
+      m_rx_buffer->clear();
+    }
   }
 
   int m_fd = 0;
-  struct termios m_options;
+  std::uint32_t m_log_device;
+  linux_termios2 m_options;
+  settings m_settings;
+  // Only the termios parts apply on construction, ASYNC_LOW_LATENCY is left
+  // as the UART driver set it until configure_latency() is called
+  latency_settings m_latency{ .low_latency = false };
+  std::unique_ptr<spsc_ring> m_rx_buffer;
+  std::unique_ptr<capture_ring> m_capture;
+  std::atomic<std::uint64_t> m_rx_overruns = 0;
+  std::atomic<int> m_hang_up_error = 0;
+  std::mutex m_rx_lock;
+  std::condition_variable m_rx_ready;
+  std::mutex m_tx_lock;
+  std::condition_variable m_tx_drained;
+  std::deque<tx_entry> m_tx_queue;
+  std::atomic<std::size_t> m_tx_queued = 0;
+  std::size_t m_tx_high_water = 0;
+  int m_tx_error = 0;
+  bool m_tx_enabled = false;
+  bool m_tx_armed = false;
+  [[no_unique_address]] driver_stats m_stats;
 };
 
+using serial = basic_serial<posix_syscalls>;
 }  // namespace hal::linux
\ No newline at end of file
@@ -0,0 +1,995 @@
+#pragma once
+#include "termios2.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <linux/gpio.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/eventfd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace hal::linux {
+
+/**
+ * @brief In-memory stand-in for the GPIO, i2c and tty character devices.
+ *
+ * Devices are added by path, after which the drivers open them through
+ * hal::linux::simulated_syscalls exactly like real ones, for example
+ * `basic_i2c<simulated_syscalls>("/sim/i2c-1")`. Tests then drive input
+ * lines, fill register files and inject serial data through the members of
+ * this class and check what the drivers did.
+ *
+ * - GPIO chips have a fixed number of lines. A line reads the level it
+ *   drives as an output, else the level driven from outside, else the level
+ *   its bias pulls it to. Lines can only be requested once, edges on lines
+ *   requested with edge detection are queued on the request and read as
+ *   gpio_v2_line_event records. A full queue drops the oldest event, as the
+ *   kernel does.
+ * - i2c buses hold devices by address, each a 256 byte register file with an
+ *   auto-incrementing register pointer. A write sets the pointer with its
+ *   first byte and stores the rest, a read returns registers from the
+ *   pointer on. Plain read/write, I2C_RDWR and the byte, word and i2c block
+ *   SMBus transfers are supported. Missing devices fail with ENXIO.
+ * - ttys have an unbounded receive and transmit buffer. Loopback copies
+ *   everything written back into the receive buffer.
+ *
+ * Every descriptor handed out is a real eventfd, so drivers can wait on it
+ * with poll and epoll and change its flags with fcntl. It reports readable
+ * while a line request has queued events or a tty has received data. Reads
+ * never block, they fail with EAGAIN instead. All state is behind a single
+ * mutex, so drivers and tests may run on any thread.
+ */
+class simulated_kernel
+{
+public:
+  static simulated_kernel& instance()
+  {
+    static simulated_kernel kernel;
+    return kernel;
+  }
+
+  simulated_kernel(const simulated_kernel&) = delete;
+  simulated_kernel& operator=(const simulated_kernel&) = delete;
+
+  ~simulated_kernel()
+  {
+    reset();
+  }
+
+  /**
+   * @brief Add a GPIO character device.
+   * @param p_path Path the drivers open it by.
+   * @param p_lines Number of lines on the chip.
+   */
+  void add_gpio_chip(std::string_view p_path, std::uint32_t p_lines = 64)
+  {
+    std::lock_guard lock(m_lock);
+    auto chip = std::make_unique<gpio_chip_model>();
+    chip->lines.resize(p_lines);
+    m_chips.insert_or_assign(std::string(p_path), std::move(chip));
+  }
+
+  /**
+   * @brief Drive a line from outside the chip, like a button or another
+   * device would. An output line keeps reading the level it drives itself.
+   *
+   * @throws std::out_of_range if the chip or line does not exist.
+   */
+  void drive_line(std::string_view p_path, std::uint32_t p_line, bool p_high)
+  {
+    std::lock_guard lock(m_lock);
+    auto& line = find(m_chips, p_path).lines.at(p_line);
+    const bool before = physical_level(line);
+    line.driven = true;
+    line.external = p_high;
+    on_level_change(line, p_line, before);
+  }
+
+  /**
+   * @brief Stop driving a line from outside, it falls back to its bias.
+   *
+   * @throws std::out_of_range if the chip or line does not exist.
+   */
+  void release_line(std::string_view p_path, std::uint32_t p_line)
+  {
+    std::lock_guard lock(m_lock);
+    auto& line = find(m_chips, p_path).lines.at(p_line);
+    const bool before = physical_level(line);
+    line.driven = false;
+    on_level_change(line, p_line, before);
+  }
+
+  /**
+   * @brief Electrical level of a line, before any active low inversion.
+   *
+   * @throws std::out_of_range if the chip or line does not exist.
+   */
+  bool line_level(std::string_view p_path, std::uint32_t p_line)
+  {
+    std::lock_guard lock(m_lock);
+    return physical_level(find(m_chips, p_path).lines.at(p_line));
+  }
+
+  /// Add an i2c adapter without any devices on it
+  void add_i2c_bus(std::string_view p_path)
+  {
+    std::lock_guard lock(m_lock);
+    m_buses.insert_or_assign(std::string(p_path),
+                             std::make_unique<i2c_bus_model>());
+  }
+
+  /**
+   * @brief Attach a device to an i2c bus, its registers start out as zero.
+   *
+   * @throws std::out_of_range if the bus does not exist.
+   */
+  void add_i2c_device(std::string_view p_path, std::uint16_t p_address)
+  {
+    std::lock_guard lock(m_lock);
+    find(m_buses, p_path).devices[p_address] = {};
+  }
+
+  /**
+   * @brief Register of an i2c device, as last written by a driver or test.
+   *
+   * @throws std::out_of_range if the bus or device does not exist.
+   */
+  std::uint8_t i2c_register(std::string_view p_path,
+                            std::uint16_t p_address,
+                            std::uint8_t p_register)
+  {
+    std::lock_guard lock(m_lock);
+    return find(m_buses, p_path).devices.at(p_address).registers[p_register];
+  }
+
+  /**
+   * @brief Set a register of an i2c device, as the device itself would.
+   *
+   * @throws std::out_of_range if the bus or device does not exist.
+   */
+  void set_i2c_register(std::string_view p_path,
+                        std::uint16_t p_address,
+                        std::uint8_t p_register,
+                        std::uint8_t p_value)
+  {
+    std::lock_guard lock(m_lock);
+    auto& device = find(m_buses, p_path).devices.at(p_address);
+    device.registers[p_register] = p_value;
+  }
+
+  /// Add a tty with empty buffers and loopback off
+  void add_tty(std::string_view p_path)
+  {
+    std::lock_guard lock(m_lock);
+    m_ttys.insert_or_assign(std::string(p_path),
+                            std::make_unique<tty_model>());
+  }
+
+  /**
+   * @brief Deliver bytes to a tty as if they arrived on the wire.
+   *
+   * @throws std::out_of_range if the tty does not exist.
+   */
+  void tty_inject(std::string_view p_path,
+                  std::span<const std::uint8_t> p_data)
+  {
+    std::lock_guard lock(m_lock);
+    receive(find(m_ttys, p_path), p_data);
+  }
+
+  /**
+   * @brief Take everything written to a tty since the last call.
+   *
+   * @throws std::out_of_range if the tty does not exist.
+   */
+  std::vector<std::uint8_t> tty_take_output(std::string_view p_path)
+  {
+    std::lock_guard lock(m_lock);
+    return std::exchange(find(m_ttys, p_path).transmitted, {});
+  }
+
+  /**
+   * @brief Feed every byte written to a tty back into its receive buffer,
+   * like a wire between TX and RX. Looped back bytes are not kept for
+   * tty_take_output().
+   *
+   * @throws std::out_of_range if the tty does not exist.
+   */
+  void tty_loopback(std::string_view p_path, bool p_enabled)
+  {
+    std::lock_guard lock(m_lock);
+    find(m_ttys, p_path).loopback = p_enabled;
+  }
+
+  /**
+   * @brief Baud rate last configured with TCSETS2, 0 if never configured.
+   *
+   * @throws std::out_of_range if the tty does not exist.
+   */
+  speed_t tty_baud_rate(std::string_view p_path)
+  {
+    std::lock_guard lock(m_lock);
+    return find(m_ttys, p_path).settings.c_ospeed;
+  }
+
+  /**
+   * @brief Remove every device and close every descriptor. Only call this
+   * once no driver uses a simulated device anymore.
+   */
+  void reset()
+  {
+    std::lock_guard lock(m_lock);
+    for (const auto& [fd, file] : m_files) {
+      ::close(fd);
+    }
+    m_files.clear();
+    m_chips.clear();
+    m_buses.clear();
+    m_ttys.clear();
+  }
+
+  int open(const char* p_path, int)
+  {
+    std::lock_guard lock(m_lock);
+    const std::string_view path(p_path);
+    open_file file;
+    if (auto chip = m_chips.find(path); chip != m_chips.end()) {
+      file.kind = device::gpio_chip;
+      file.chip = chip->second.get();
+    } else if (auto bus = m_buses.find(path); bus != m_buses.end()) {
+      file.kind = device::i2c_bus;
+      file.bus = bus->second.get();
+    } else if (auto tty = m_ttys.find(path); tty != m_ttys.end()) {
+      file.kind = device::tty;
+      file.tty = tty->second.get();
+    } else {
+      return fail(ENOENT);
+    }
+
+    const int fd = add_file(std::move(file));
+    if (fd >= 0 && m_files[fd].kind == device::tty) {
+      auto& tty = *m_files[fd].tty;
+      tty.fds.push_back(fd);
+      signal(fd, !tty.received.empty());
+    }
+    return fd;
+  }
+
+  int close(int p_fd)
+  {
+    std::lock_guard lock(m_lock);
+    auto file = m_files.find(p_fd);
+    if (file == m_files.end()) {
+      return fail(EBADF);
+    }
+    if (file->second.kind == device::gpio_lines) {
+      auto& request = *file->second.request;
+      for (auto offset : request.offsets) {
+        auto& line = request.chip->lines[offset];
+        const bool before = physical_level(line);
+        line = gpio_line{ .driven = line.driven, .external = line.external };
+        on_level_change(line, offset, before);
+      }
+    }
+    if (file->second.kind == device::tty) {
+      std::erase(file->second.tty->fds, p_fd);
+    }
+    m_files.erase(file);
+    return ::close(p_fd);
+  }
+
+  int ioctl(int p_fd, unsigned long p_request, void* p_argument)
+  {
+    std::lock_guard lock(m_lock);
+    auto file = m_files.find(p_fd);
+    if (file == m_files.end()) {
+      return fail(EBADF);
+    }
+    switch (file->second.kind) {
+      case device::gpio_chip:
+        return chip_ioctl(*file->second.chip, p_request, p_argument);
+      case device::gpio_lines:
+        return lines_ioctl(file->second, p_request, p_argument);
+      case device::i2c_bus:
+        return i2c_ioctl(file->second, p_request, p_argument);
+      case device::tty:
+      default:
+        return tty_ioctl(*file->second.tty, p_request, p_argument);
+    }
+  }
+
+  int ioctl(int p_fd, unsigned long p_request, unsigned long p_value)
+  {
+    std::lock_guard lock(m_lock);
+    auto file = m_files.find(p_fd);
+    if (file == m_files.end()) {
+      return fail(EBADF);
+    }
+    auto& opened = file->second;
+    if (opened.kind == device::i2c_bus) {
+      switch (p_request) {
+        case I2C_TENBIT:
+          opened.ten_bit = p_value != 0;
+          return 0;
+        case I2C_SLAVE:
+        case I2C_SLAVE_FORCE:
+          if (p_value > (opened.ten_bit ? 0x3FFUL : 0x7FUL)) {
+            return fail(EINVAL);
+          }
+          opened.address = static_cast<std::uint16_t>(p_value);
+          return 0;
+        default:
+          break;
+      }
+    }
+    if (opened.kind == device::tty && p_request == TCFLSH) {
+      if (p_value == TCIFLUSH || p_value == TCIOFLUSH) {
+        opened.tty->received.clear();
+        signal_tty(*opened.tty);
+      }
+      if (p_value == TCOFLUSH || p_value == TCIOFLUSH) {
+        opened.tty->transmitted.clear();
+      }
+      return 0;
+    }
+    return fail(ENOTTY);
+  }
+
+  ssize_t read(int p_fd, void* p_buffer, std::size_t p_size)
+  {
+    std::lock_guard lock(m_lock);
+    auto file = m_files.find(p_fd);
+    if (file == m_files.end()) {
+      return fail(EBADF);
+    }
+    auto* buffer = static_cast<std::uint8_t*>(p_buffer);
+    auto& opened = file->second;
+    switch (opened.kind) {
+      case device::gpio_lines:
+        return read_events(opened, buffer, p_size);
+      case device::i2c_bus: {
+        auto* target = device_at(opened, opened.address);
+        if (!target) {
+          return fail(ENXIO);
+        }
+        target->read({ buffer, p_size });
+        return static_cast<ssize_t>(p_size);
+      }
+      case device::tty: {
+        auto& received = opened.tty->received;
+        if (received.empty() && p_size > 0) {
+          return fail(EAGAIN);
+        }
+        const auto count = std::min(p_size, received.size());
+        std::copy_n(received.begin(), count, buffer);
+        received.erase(received.begin(), received.begin() + count);
+        signal_tty(*opened.tty);
+        return static_cast<ssize_t>(count);
+      }
+      case device::gpio_chip:
+      default:
+        return fail(EINVAL);
+    }
+  }
+
+  ssize_t write(int p_fd, const void* p_buffer, std::size_t p_size)
+  {
+    const iovec vector{ const_cast<void*>(p_buffer), p_size };
+    return writev(p_fd, &vector, 1);
+  }
+
+  ssize_t writev(int p_fd, const iovec* p_vectors, int p_count)
+  {
+    std::lock_guard lock(m_lock);
+    auto file = m_files.find(p_fd);
+    if (file == m_files.end()) {
+      return fail(EBADF);
+    }
+    auto& opened = file->second;
+    std::size_t total = 0;
+    for (int i = 0; i < p_count; i++) {
+      total += p_vectors[i].iov_len;
+    }
+
+    if (opened.kind == device::i2c_bus) {
+      auto* target = device_at(opened, opened.address);
+      if (!target) {
+        return fail(ENXIO);
+      }
+      std::vector<std::uint8_t> message;
+      message.reserve(total);
+      for (int i = 0; i < p_count; i++) {
+        const auto* data =
+          static_cast<const std::uint8_t*>(p_vectors[i].iov_base);
+        message.insert(message.end(), data, data + p_vectors[i].iov_len);
+      }
+      target->write(message);
+      return static_cast<ssize_t>(total);
+    }
+    if (opened.kind != device::tty) {
+      return fail(EINVAL);
+    }
+
+    auto& tty = *opened.tty;
+    for (int i = 0; i < p_count; i++) {
+      const std::span data(
+        static_cast<const std::uint8_t*>(p_vectors[i].iov_base),
+        p_vectors[i].iov_len);
+      if (tty.loopback) {
+        receive(tty, data);
+      } else {
+        auto& sent = tty.transmitted;
+        sent.insert(sent.end(), data.begin(), data.end());
+      }
+    }
+    return static_cast<ssize_t>(total);
+  }
+
+private:
+  enum class device : std::uint8_t
+  {
+    gpio_chip,
+    gpio_lines,
+    i2c_bus,
+    tty,
+  };
+
+  struct gpio_line
+  {
+    /// Flags of the request holding the line, 0 while free
+    std::uint64_t flags = 0;
+    /// Descriptor of the request holding the line, -1 while free
+    int owner = -1;
+    bool output = false;
+    bool driven = false;
+    bool external = false;
+  };
+
+  struct gpio_chip_model
+  {
+    std::vector<gpio_line> lines;
+  };
+
+  struct line_request_state
+  {
+    /// Descriptor of the request itself
+    int fd = -1;
+    gpio_chip_model* chip = nullptr;
+    std::vector<std::uint32_t> offsets;
+    std::vector<std::uint32_t> line_seqno;
+    std::deque<gpio_v2_line_event> events;
+    std::size_t event_capacity = 0;
+    std::uint32_t seqno = 0;
+  };
+
+  struct i2c_device_model
+  {
+    std::array<std::uint8_t, 256> registers{};
+    std::uint8_t pointer = 0;
+
+    void write(std::span<const std::uint8_t> p_data)
+    {
+      if (p_data.empty()) {
+        return;
+      }
+      pointer = p_data[0];
+      for (auto value : p_data.subspan(1)) {
+        registers[pointer++] = value;
+      }
+    }
+
+    void read(std::span<std::uint8_t> p_data)
+    {
+      for (auto& value : p_data) {
+        value = registers[pointer++];
+      }
+    }
+  };
+
+  struct i2c_bus_model
+  {
+    std::map<std::uint16_t, i2c_device_model> devices;
+  };
+
+  struct tty_model
+  {
+    std::deque<std::uint8_t> received;
+    std::vector<std::uint8_t> transmitted;
+    linux_termios2 settings{};
+    bool loopback = false;
+    /// Open descriptors, all of which are signalled when data arrives
+    std::vector<int> fds;
+  };
+
+  struct open_file
+  {
+    device kind = device::gpio_chip;
+    gpio_chip_model* chip = nullptr;
+    std::unique_ptr<line_request_state> request;
+    i2c_bus_model* bus = nullptr;
+    std::uint16_t address = 0;
+    bool ten_bit = false;
+    tty_model* tty = nullptr;
+    /// Whether the eventfd currently reports readable
+    bool readable = false;
+  };
+
+  template<typename T>
+  using registry = std::map<std::string, std::unique_ptr<T>, std::less<>>;
+
+  simulated_kernel() = default;
+
+  template<typename T>
+  static T& find(registry<T>& p_registry, std::string_view p_path)
+  {
+    auto entry = p_registry.find(p_path);
+    if (entry == p_registry.end()) {
+      throw std::out_of_range(std::string(p_path));
+    }
+    return *entry->second;
+  }
+
+  static int fail(int p_error)
+  {
+    errno = p_error;
+    return -1;
+  }
+
+  int add_file(open_file&& p_file)
+  {
+    const int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd >= 0) {
+      m_files[fd] = std::move(p_file);
+    }
+    return fd;
+  }
+
+  // Make the eventfd of p_fd report readable or not, only touching it when
+  // that changes
+  void signal(int p_fd, bool p_readable)
+  {
+    auto& file = m_files[p_fd];
+    if (file.readable == p_readable) {
+      return;
+    }
+    file.readable = p_readable;
+    if (p_readable) {
+      eventfd_write(p_fd, 1);
+    } else {
+      eventfd_t discard;
+      eventfd_read(p_fd, &discard);
+    }
+  }
+
+  void signal_tty(tty_model& p_tty)
+  {
+    for (auto fd : p_tty.fds) {
+      signal(fd, !p_tty.received.empty());
+    }
+  }
+
+  void receive(tty_model& p_tty, std::span<const std::uint8_t> p_data)
+  {
+    p_tty.received.insert(p_tty.received.end(), p_data.begin(), p_data.end());
+    signal_tty(p_tty);
+  }
+
+  static bool physical_level(const gpio_line& p_line)
+  {
+    if (p_line.flags & GPIO_V2_LINE_FLAG_OUTPUT) {
+      return p_line.output;
+    }
+    if (p_line.driven) {
+      return p_line.external;
+    }
+    return p_line.flags & GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+  }
+
+  static bool logical_level(const gpio_line& p_line)
+  {
+    const bool inverted = p_line.flags & GPIO_V2_LINE_FLAG_ACTIVE_LOW;
+    return physical_level(p_line) != inverted;
+  }
+
+  // Queue an edge event if the line is watched for it
+  void on_level_change(const gpio_line& p_line,
+                       std::uint32_t p_offset,
+                       bool p_before)
+  {
+    const bool now = physical_level(p_line);
+    if (now == p_before || p_line.owner < 0) {
+      return;
+    }
+    const bool inverted = p_line.flags & GPIO_V2_LINE_FLAG_ACTIVE_LOW;
+    const bool rising = now != inverted;
+    const auto wanted = rising ? GPIO_V2_LINE_FLAG_EDGE_RISING
+                               : GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    if (!(p_line.flags & wanted)) {
+      return;
+    }
+
+    auto& request = *m_files[p_line.owner].request;
+    const auto index = static_cast<std::size_t>(
+      std::find(request.offsets.begin(), request.offsets.end(), p_offset) -
+      request.offsets.begin());
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    gpio_v2_line_event event{};
+    event.timestamp_ns = static_cast<std::uint64_t>(time.tv_sec) *
+                           1'000'000'000 +
+                         static_cast<std::uint64_t>(time.tv_nsec);
+    event.id = rising ? GPIO_V2_LINE_EVENT_RISING_EDGE
+                      : GPIO_V2_LINE_EVENT_FALLING_EDGE;
+    event.offset = p_offset;
+    event.seqno = ++request.seqno;
+    event.line_seqno = ++request.line_seqno[index];
+    if (request.events.size() == request.event_capacity) {
+      request.events.pop_front();
+    }
+    request.events.push_back(event);
+    signal(p_line.owner, true);
+  }
+
+  // Flags and output value of line p_index of a request, with attributes
+  // overriding the request wide flags
+  static std::uint64_t line_flags(const gpio_v2_line_config& p_config,
+                                  std::size_t p_index,
+                                  bool& p_value)
+  {
+    std::uint64_t flags = p_config.flags;
+    p_value = false;
+    const auto bit = std::uint64_t{ 1 } << p_index;
+    for (std::uint32_t i = 0; i < p_config.num_attrs; i++) {
+      const auto& entry = p_config.attrs[i];
+      if (!(entry.mask & bit)) {
+        continue;
+      }
+      if (entry.attr.id == GPIO_V2_LINE_ATTR_ID_FLAGS) {
+        flags = entry.attr.flags;
+      } else if (entry.attr.id == GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES) {
+        p_value = entry.attr.values & bit;
+      }
+    }
+    return flags;
+  }
+
+  static bool valid_flags(std::uint64_t p_flags)
+  {
+    constexpr auto direction =
+      GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_OUTPUT;
+    constexpr auto edges =
+      GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    if ((p_flags & direction) == direction) {
+      return false;
+    }
+    return !(p_flags & edges) || (p_flags & GPIO_V2_LINE_FLAG_INPUT);
+  }
+
+  // Apply p_config to every line of a request
+  int configure(line_request_state& p_request,
+                const gpio_v2_line_config& p_config)
+  {
+    if (p_config.num_attrs > GPIO_V2_LINE_NUM_ATTRS_MAX) {
+      return fail(EINVAL);
+    }
+    for (std::size_t i = 0; i < p_request.offsets.size(); i++) {
+      bool value = false;
+      if (!valid_flags(line_flags(p_config, i, value))) {
+        return fail(EINVAL);
+      }
+    }
+    for (std::size_t i = 0; i < p_request.offsets.size(); i++) {
+      auto& line = p_request.chip->lines[p_request.offsets[i]];
+      const bool before = physical_level(line);
+      bool value = false;
+      line.flags = line_flags(p_config, i, value);
+      line.owner = p_request.fd;
+      const bool inverted = line.flags & GPIO_V2_LINE_FLAG_ACTIVE_LOW;
+      line.output = value != inverted;
+      on_level_change(line, p_request.offsets[i], before);
+    }
+    return 0;
+  }
+
+  int chip_ioctl(gpio_chip_model& p_chip,
+                 unsigned long p_request,
+                 void* p_argument)
+  {
+    if (p_request != GPIO_V2_GET_LINE_IOCTL) {
+      return fail(ENOTTY);
+    }
+    auto& request = *static_cast<gpio_v2_line_request*>(p_argument);
+    if (request.num_lines == 0 || request.num_lines > GPIO_V2_LINES_MAX) {
+      return fail(EINVAL);
+    }
+    for (std::uint32_t i = 0; i < request.num_lines; i++) {
+      if (request.offsets[i] >= p_chip.lines.size()) {
+        return fail(EINVAL);
+      }
+      if (p_chip.lines[request.offsets[i]].owner >= 0) {
+        return fail(EBUSY);
+      }
+    }
+
+    auto state = std::make_unique<line_request_state>();
+    state->chip = &p_chip;
+    state->offsets.assign(request.offsets,
+                          request.offsets + request.num_lines);
+    state->line_seqno.resize(request.num_lines);
+    state->event_capacity = request.event_buffer_size != 0
+                              ? request.event_buffer_size
+                              : 16 * request.num_lines;
+
+    open_file file;
+    file.kind = device::gpio_lines;
+    file.chip = &p_chip;
+    file.request = std::move(state);
+    const int fd = add_file(std::move(file));
+    if (fd < 0) {
+      return -1;
+    }
+    auto& added = *m_files[fd].request;
+    added.fd = fd;
+    if (configure(added, request.config) < 0) {
+      const int error = errno;
+      m_files.erase(fd);
+      ::close(fd);
+      return fail(error);
+    }
+    request.fd = fd;
+    return 0;
+  }
+
+  int lines_ioctl(open_file& p_file, unsigned long p_request, void* p_argument)
+  {
+    auto& request = *p_file.request;
+    const auto lines = request.offsets.size();
+    const auto all = lines == 64 ? ~std::uint64_t{ 0 }
+                                 : (std::uint64_t{ 1 } << lines) - 1;
+    switch (p_request) {
+      case GPIO_V2_LINE_SET_VALUES_IOCTL: {
+        const auto& values = *static_cast<gpio_v2_line_values*>(p_argument);
+        if (values.mask == 0 || (values.mask & ~all)) {
+          return fail(EINVAL);
+        }
+        for (std::size_t i = 0; i < lines; i++) {
+          const auto& line = request.chip->lines[request.offsets[i]];
+          if ((values.mask >> i & 1) &&
+              !(line.flags & GPIO_V2_LINE_FLAG_OUTPUT)) {
+            return fail(EPERM);
+          }
+        }
+        for (std::size_t i = 0; i < lines; i++) {
+          if (values.mask >> i & 1) {
+            auto& line = request.chip->lines[request.offsets[i]];
+            const bool inverted = line.flags & GPIO_V2_LINE_FLAG_ACTIVE_LOW;
+            line.output = (values.bits >> i & 1) != inverted;
+          }
+        }
+        return 0;
+      }
+      case GPIO_V2_LINE_GET_VALUES_IOCTL: {
+        auto& values = *static_cast<gpio_v2_line_values*>(p_argument);
+        if (values.mask == 0 || (values.mask & ~all)) {
+          return fail(EINVAL);
+        }
+        std::uint64_t bits = 0;
+        for (std::size_t i = 0; i < lines; i++) {
+          const auto& line = request.chip->lines[request.offsets[i]];
+          if ((values.mask >> i & 1) && logical_level(line)) {
+            bits |= std::uint64_t{ 1 } << i;
+          }
+        }
+        values.bits = bits;
+        return 0;
+      }
+      case GPIO_V2_LINE_SET_CONFIG_IOCTL: {
+        const auto& config = *static_cast<gpio_v2_line_config*>(p_argument);
+        return configure(request, config);
+      }
+      default:
+        return fail(ENOTTY);
+    }
+  }
+
+  ssize_t read_events(open_file& p_file,
+                      std::uint8_t* p_buffer,
+                      std::size_t p_size)
+  {
+    auto& events = p_file.request->events;
+    if (p_size < sizeof(gpio_v2_line_event)) {
+      return fail(EINVAL);
+    }
+    if (events.empty()) {
+      return fail(EAGAIN);
+    }
+    const auto count =
+      std::min(p_size / sizeof(gpio_v2_line_event), events.size());
+    for (std::size_t i = 0; i < count; i++) {
+      std::memcpy(p_buffer + i * sizeof(gpio_v2_line_event),
+                  &events.front(),
+                  sizeof(gpio_v2_line_event));
+      events.pop_front();
+    }
+    signal(p_file.request->fd, !events.empty());
+    return static_cast<ssize_t>(count * sizeof(gpio_v2_line_event));
+  }
+
+  i2c_device_model* device_at(open_file& p_file, std::uint16_t p_address)
+  {
+    auto device = p_file.bus->devices.find(p_address);
+    return device == p_file.bus->devices.end() ? nullptr : &device->second;
+  }
+
+  int i2c_ioctl(open_file& p_file, unsigned long p_request, void* p_argument)
+  {
+    switch (p_request) {
+      case I2C_FUNCS:
+        *static_cast<unsigned long*>(p_argument) =
+          I2C_FUNC_I2C | I2C_FUNC_10BIT_ADDR | I2C_FUNC_SMBUS_EMUL;
+        return 0;
+      case I2C_RDWR:
+        return i2c_transfer(p_file,
+                            *static_cast<i2c_rdwr_ioctl_data*>(p_argument));
+      case I2C_SMBUS:
+        return smbus_transfer(
+          p_file, *static_cast<i2c_smbus_ioctl_data*>(p_argument));
+      default:
+        return fail(ENOTTY);
+    }
+  }
+
+  int i2c_transfer(open_file& p_file, const i2c_rdwr_ioctl_data& p_transfer)
+  {
+    if (p_transfer.nmsgs == 0 || p_transfer.nmsgs > I2C_RDWR_IOCTL_MAX_MSGS) {
+      return fail(EINVAL);
+    }
+    for (std::uint32_t i = 0; i < p_transfer.nmsgs; i++) {
+      const auto& message = p_transfer.msgs[i];
+      auto* target = device_at(p_file, message.addr);
+      if (!target) {
+        return fail(ENXIO);
+      }
+      if (message.flags & I2C_M_RD) {
+        target->read({ message.buf, message.len });
+      } else {
+        target->write({ message.buf, message.len });
+      }
+    }
+    return static_cast<int>(p_transfer.nmsgs);
+  }
+
+  int smbus_transfer(open_file& p_file, const i2c_smbus_ioctl_data& p_args)
+  {
+    auto* target = device_at(p_file, p_file.address);
+    if (!target) {
+      return fail(ENXIO);
+    }
+    if (p_args.size == I2C_SMBUS_QUICK) {
+      return 0;
+    }
+    auto* data = p_args.data;
+    if (!data) {
+      return fail(EINVAL);
+    }
+    const bool reading = p_args.read_write == I2C_SMBUS_READ;
+    std::size_t length = 0;
+    std::uint8_t* payload = data->block;
+    switch (p_args.size) {
+      case I2C_SMBUS_BYTE:
+        // The command byte is the register pointer itself
+        if (reading) {
+          target->read({ &data->byte, 1 });
+        } else {
+          target->pointer = p_args.command;
+        }
+        return 0;
+      case I2C_SMBUS_BYTE_DATA:
+        length = 1;
+        break;
+      case I2C_SMBUS_WORD_DATA:
+        length = 2;
+        break;
+      case I2C_SMBUS_I2C_BLOCK_DATA:
+        length = data->block[0];
+        payload = data->block + 1;
+        if (length == 0 || length > I2C_SMBUS_BLOCK_MAX) {
+          return fail(EINVAL);
+        }
+        break;
+      default:
+        return fail(EOPNOTSUPP);
+    }
+
+    target->pointer = p_args.command;
+    if (reading) {
+      target->read({ payload, length });
+    } else {
+      for (std::size_t i = 0; i < length; i++) {
+        target->registers[target->pointer++] = payload[i];
+      }
+    }
+    return 0;
+  }
+
+  int tty_ioctl(tty_model& p_tty, unsigned long p_request, void* p_argument)
+  {
+    if (p_request == linux_tcsets2) {
+      p_tty.settings = *static_cast<const linux_termios2*>(p_argument);
+      return 0;
+    }
+    // Everything else, including TIOCGSERIAL, fails like on a pseudo
+    // terminal
+    return fail(ENOTTY);
+  }
+
+  std::mutex m_lock;
+  registry<gpio_chip_model> m_chips;
+  registry<i2c_bus_model> m_buses;
+  registry<tty_model> m_ttys;
+  std::unordered_map<int, open_file> m_files;
+};
+
+/**
+ * @brief Syscall policy that runs every driver against
+ * hal::linux::simulated_kernel instead of the real devices.
+ */
+struct simulated_syscalls
+{
+  static int open(const char* p_path, int p_flags)
+  {
+    return simulated_kernel::instance().open(p_path, p_flags);
+  }
+
+  static int close(int p_fd)
+  {
+    return simulated_kernel::instance().close(p_fd);
+  }
+
+  static int ioctl(int p_fd, unsigned long p_request, void* p_argument)
+  {
+    return simulated_kernel::instance().ioctl(p_fd, p_request, p_argument);
+  }
+
+  static int ioctl(int p_fd, unsigned long p_request, unsigned long p_value)
+  {
+    return simulated_kernel::instance().ioctl(p_fd, p_request, p_value);
+  }
+
+  static ssize_t read(int p_fd, void* p_buffer, std::size_t p_size)
+  {
+    return simulated_kernel::instance().read(p_fd, p_buffer, p_size);
+  }
+
+  static ssize_t write(int p_fd, const void* p_buffer, std::size_t p_size)
+  {
+    return simulated_kernel::instance().write(p_fd, p_buffer, p_size);
+  }
+
+  static ssize_t writev(int p_fd, const iovec* p_vectors, int p_count)
+  {
+    return simulated_kernel::instance().writev(p_fd, p_vectors, p_count);
+  }
+};
+}  // namespace hal::linux
@@ -0,0 +1,391 @@
+#pragma once
+#include "errors.hpp"
+#include "output_port.hpp"
+#include "realtime_context.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <libhal/error.hpp>
+#include <libhal/output_pin.hpp>
+#include <libhal/pwm.hpp>
+#include <libhal/units.hpp>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace hal::linux {
+
+class software_pwm;
+
+/**
+ * @brief Timing engine shared by any number of software_pwm channels.
+ *
+ * A single dedicated thread sleeps on an absolute CLOCK_MONOTONIC timerfd
+ * until the earliest pending edge of all attached channels, drives every edge
+ * that is due and goes back to sleep. Channels on the same output_port that
+ * switch at the same instant are written with one ioctl.
+ *
+ * The engine must outlive every channel attached to it.
+ */
+class pwm_engine
+{
+public:
+  /// How late the engine thread woke up compared to the edge it slept for
+  struct jitter_stats
+  {
+    std::uint64_t samples = 0;
+    std::int64_t min_ns = 0;
+    std::int64_t max_ns = 0;
+    double mean_ns = 0.0;
+  };
+
+  /**
+   * @brief Create the engine and start its timer thread.
+   *
+   * @throws hal::linux::errno_exception if the timerfd or wake up eventfd
+   * could not be created.
+   */
+  pwm_engine()
+    : pwm_engine(std::nullopt)
+  {
+  }
+
+  /**
+   * @brief Create the engine and run its timer thread under a
+   * hal::linux::realtime_context, for edges that land on time under load.
+   * Settings the process lacks privileges for are skipped with a warning.
+   * @param p_realtime Applied by the timer thread to itself.
+   *
+   * @throws hal::linux::errno_exception if the timerfd or wake up eventfd
+   * could not be created.
+   */
+  explicit pwm_engine(std::optional<realtime_context::settings> p_realtime)
+    : m_realtime(std::move(p_realtime))
+  {
+    m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (m_timer_fd < 0) {
+      throw errno_exception(errno, std::errc::too_many_files_open, this);
+    }
+    m_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_wake_fd < 0) {
+      close(m_timer_fd);
+      throw errno_exception(errno, std::errc::too_many_files_open, this);
+    }
+    m_thread = std::thread([this] { run(); });
+  }
+
+  pwm_engine(const pwm_engine&) = delete;
+  pwm_engine& operator=(const pwm_engine&) = delete;
+
+  ~pwm_engine()
+  {
+    m_running = false;
+    wake();
+    m_thread.join();
+    close(m_wake_fd);
+    close(m_timer_fd);
+  }
+
+  /// Wake up lateness measured since construction or the last reset
+  jitter_stats jitter() const
+  {
+    std::lock_guard lock(m_lock);
+    return m_jitter;
+  }
+
+  void reset_jitter()
+  {
+    std::lock_guard lock(m_lock);
+    m_jitter = {};
+  }
+
+private:
+  friend class software_pwm;
+
+  static std::int64_t now_ns()
+  {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1'000'000'000LL + now.tv_nsec;
+  }
+
+  void attach(software_pwm* p_channel)
+  {
+    std::lock_guard lock(m_lock);
+    m_channels.push_back(p_channel);
+  }
+
+  void detach(software_pwm* p_channel)
+  {
+    std::lock_guard lock(m_lock);
+    std::erase(m_channels, p_channel);
+  }
+
+  /// Make the thread pick up a changed schedule
+  void wake()
+  {
+    std::uint64_t one = 1;
+    [[maybe_unused]] auto res = write(m_wake_fd, &one, sizeof(one));
+  }
+
+  void record_lateness(std::int64_t p_late_ns)
+  {
+    const auto samples = m_jitter.samples + 1;
+    if (m_jitter.samples == 0 || p_late_ns < m_jitter.min_ns) {
+      m_jitter.min_ns = p_late_ns;
+    }
+    if (m_jitter.samples == 0 || p_late_ns > m_jitter.max_ns) {
+      m_jitter.max_ns = p_late_ns;
+    }
+    m_jitter.mean_ns += (p_late_ns - m_jitter.mean_ns) / samples;
+    m_jitter.samples = samples;
+  }
+
+  struct port_write
+  {
+    output_port* port;
+    std::uint64_t bits;
+    std::uint64_t mask;
+  };
+
+  inline void run();
+  inline std::int64_t service(std::int64_t p_now);
+
+  int m_timer_fd = -1;
+  int m_wake_fd = -1;
+  std::atomic<bool> m_running = true;
+  mutable std::mutex m_lock;
+  std::vector<software_pwm*> m_channels;
+  // Reused between wake ups so servicing edges never allocates
+  std::vector<port_write> m_port_writes;
+  jitter_stats m_jitter;
+  std::optional<realtime_context::settings> m_realtime;
+  std::thread m_thread;
+};
+
+/**
+ * @brief hal::pwm implemented by toggling a GPIO line from a pwm_engine.
+ *
+ * Intended for boards that only expose GPIO lines through the character
+ * device. Resolution and jitter are bound by the scheduler, so this suits
+ * LEDs, buzzers and hobby servos rather than motor commutation. Duty cycles
+ * of exactly 0 and 1 hold the line steady and cost nothing after the first
+ * write.
+ */
+class software_pwm : public hal::pwm
+{
+public:
+  /**
+   * @brief Drive a single output pin from the engine.
+   * @param p_engine Engine whose thread will service this channel.
+   * @param p_pin Pin to toggle, must outlive the channel.
+   */
+  software_pwm(pwm_engine& p_engine, hal::output_pin& p_pin)
+    : m_engine(&p_engine)
+    , m_pin(&p_pin)
+  {
+    m_engine->attach(this);
+  }
+
+  /**
+   * @brief Drive one line of an output_port from the engine. Channels that
+   * share a port and switch together are written with a single ioctl.
+   * @param p_engine Engine whose thread will service this channel.
+   * @param p_port Port holding the line, must outlive the channel.
+   * @param p_index Bit position of the line within the port.
+   *
+   * @throws hal::argument_out_of_domain if p_index is outside the port.
+   */
+  software_pwm(pwm_engine& p_engine, output_port& p_port, std::size_t p_index)
+    : m_engine(&p_engine)
+    , m_port(&p_port)
+  {
+    if (p_index >= p_port.size()) {
+      throw hal::argument_out_of_domain(this);
+    }
+    m_port_mask = std::uint64_t{ 1 } << p_index;
+    m_engine->attach(this);
+  }
+
+  software_pwm(const software_pwm&) = delete;
+  software_pwm& operator=(const software_pwm&) = delete;
+
+  virtual ~software_pwm()
+  {
+    m_engine->detach(this);
+  }
+
+private:
+  friend class pwm_engine;
+
+  /// Above this the engine spends its whole time waking up
+  static constexpr hertz max_frequency = 20'000.0f;
+
+  void driver_frequency(hertz p_frequency) override
+  {
+    if (p_frequency <= 0.0f || p_frequency > max_frequency) {
+      throw hal::argument_out_of_domain(this);
+    }
+    std::lock_guard lock(m_engine->m_lock);
+    m_period_ns = static_cast<std::int64_t>(1e9 / p_frequency);
+    reschedule();
+  }
+
+  void driver_duty_cycle(float p_duty_cycle) override
+  {
+    if (p_duty_cycle < 0.0f || p_duty_cycle > 1.0f) {
+      throw hal::argument_out_of_domain(this);
+    }
+    std::lock_guard lock(m_engine->m_lock);
+    m_duty_cycle = p_duty_cycle;
+    reschedule();
+  }
+
+  /// Called with the engine lock held
+  void reschedule()
+  {
+    m_high_ns = static_cast<std::int64_t>(m_period_ns * m_duty_cycle);
+    m_toggling = m_high_ns > 0 && m_high_ns < m_period_ns;
+    if (!m_toggling) {
+      drive(m_high_ns > 0);
+      return;
+    }
+    // Restart the period on the rising edge, right away
+    m_next_edge_ns = pwm_engine::now_ns();
+    m_high = false;
+    m_engine->wake();
+  }
+
+  void drive(bool p_high)
+  {
+    m_high = p_high;
+    if (m_pin) {
+      m_pin->level(p_high);
+    } else {
+      m_port->level(p_high ? m_port_mask : 0, m_port_mask);
+    }
+  }
+
+  pwm_engine* m_engine;
+  hal::output_pin* m_pin = nullptr;
+  output_port* m_port = nullptr;
+  std::uint64_t m_port_mask = 0;
+  std::int64_t m_period_ns = 1'000'000;
+  std::int64_t m_high_ns = 0;
+  std::int64_t m_next_edge_ns = 0;
+  float m_duty_cycle = 0.0f;
+  bool m_toggling = false;
+  bool m_high = false;
+};
+
+// Drives every edge that is due and returns the time of the next one
+inline std::int64_t pwm_engine::service(std::int64_t p_now)
+{
+  auto& port_writes = m_port_writes;
+  port_writes.clear();
+  auto next = std::numeric_limits<std::int64_t>::max();
+
+  for (auto* channel : m_channels) {
+    if (!channel->m_toggling) {
+      continue;
+    }
+    if (channel->m_next_edge_ns <= p_now) {
+      const bool high = !channel->m_high;
+      channel->m_high = high;
+      channel->m_next_edge_ns +=
+        high ? channel->m_high_ns : channel->m_period_ns - channel->m_high_ns;
+      // Fell more than a phase behind, drop the missed edges
+      if (channel->m_next_edge_ns <= p_now) {
+        channel->m_next_edge_ns = p_now + (high ? channel->m_high_ns
+                                                : channel->m_period_ns -
+                                                    channel->m_high_ns);
+      }
+
+      if (channel->m_pin) {
+        try {
+          channel->m_pin->level(high);
+        } catch (...) {
+          // Keep the other channels running if one line fails, the edge
+          // is retried on the next phase
+        }
+      } else {
+        auto found = std::find_if(
+          port_writes.begin(), port_writes.end(), [channel](auto& p_write) {
+            return p_write.port == channel->m_port;
+          });
+        if (found == port_writes.end()) {
+          port_writes.push_back({ channel->m_port, 0, 0 });
+          found = port_writes.end() - 1;
+        }
+        found->mask |= channel->m_port_mask;
+        found->bits |= high ? channel->m_port_mask : 0;
+      }
+    }
+    next = std::min(next, channel->m_next_edge_ns);
+  }
+
+  for (auto& port_write : port_writes) {
+    try {
+      port_write.port->level(port_write.bits, port_write.mask);
+    } catch (...) {
+      // Same as for pins, one failing port must not stall the others
+    }
+  }
+  return next;
+}
+
+inline void pwm_engine::run()
+{
+  std::optional<realtime_context> context;
+  if (m_realtime) {
+    context.emplace(*m_realtime);
+  }
+  std::array<pollfd, 2> fds = {
+    pollfd{ .fd = m_timer_fd, .events = POLLIN, .revents = 0 },
+    pollfd{ .fd = m_wake_fd, .events = POLLIN, .revents = 0 },
+  };
+  std::int64_t deadline = 0;
+
+  while (m_running) {
+    {
+      std::lock_guard lock(m_lock);
+      const auto now = now_ns();
+      if (deadline != 0 && now >= deadline) {
+        record_lateness(now - deadline);
+      }
+      deadline = service(now);
+    }
+
+    itimerspec when{};
+    if (deadline != std::numeric_limits<std::int64_t>::max()) {
+      when.it_value.tv_sec = deadline / 1'000'000'000;
+      when.it_value.tv_nsec = deadline % 1'000'000'000;
+    } else {
+      deadline = 0;
+    }
+    timerfd_settime(m_timer_fd, TFD_TIMER_ABSTIME, &when, nullptr);
+
+    if (poll(fds.data(), fds.size(), -1) <= 0) {
+      continue;
+    }
+    std::uint64_t discard;
+    if (fds[0].revents & POLLIN) {
+      [[maybe_unused]] auto res = read(m_timer_fd, &discard, sizeof(discard));
+    }
+    if (fds[1].revents & POLLIN) {
+      [[maybe_unused]] auto res = read(m_wake_fd, &discard, sizeof(discard));
+      // Woken for a schedule change, not a timer edge
+      deadline = 0;
+    }
+  }
+}
+}  // namespace hal::linux
@@ -0,0 +1,302 @@
+#pragma once
+#include "errors.hpp"
+#include "instrumentation.hpp"
+#include "syscalls.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <libhal/error.hpp>
+#include <libhal/spi.hpp>
+#include <libhal/units.hpp>
+#include <linux/spi/spidev.h>
+#include <span>
+#include <string>
+#include <sys/ioctl.h>
+#include <vector>
+
+namespace hal::linux {
+
+/// Per segment controls of an spi_batch
+struct spi_segment_options
+{
+  /// Deassert chip select after this segment, or keep it asserted after the
+  /// last one
+  bool cs_change = false;
+  /// Delay after the segment, before chip select changes
+  std::uint16_t delay_us = 0;
+  /// Clock rate for this segment only, zero keeps the configured rate
+  std::uint32_t speed_hz = 0;
+};
+
+/**
+ * @brief Segments of one SPI message, sent with a single SPI_IOC_MESSAGE
+ * ioctl.
+ *
+ * Chip select stays asserted from the first segment to the last unless a
+ * segment asks for it to be toggled after it. Buffers are referenced, not
+ * copied, and must stay valid until the batch is transferred. A batch can be
+ * cleared and refilled every frame without allocating once it has grown to
+ * its working size.
+ */
+class spi_batch
+{
+public:
+  /// Most segments the kernel accepts in one message
+  static constexpr std::size_t max_segments =
+    (1 << _IOC_SIZEBITS) / sizeof(spi_ioc_transfer) - 1;
+
+  /**
+   * @brief Append a segment that clocks out p_data and ignores what comes
+   * back.
+   *
+   * @throws hal::argument_out_of_domain if the batch is full.
+   */
+  void write(std::span<const hal::byte> p_data,
+             spi_segment_options p_options = {})
+  {
+    add(p_data.data(), nullptr, p_data.size(), p_options);
+  }
+
+  /**
+   * @brief Append a segment that receives into p_data while the controller
+   * clocks out zeros.
+   *
+   * @throws hal::argument_out_of_domain if the batch is full.
+   */
+  void read(std::span<hal::byte> p_data, spi_segment_options p_options = {})
+  {
+    add(nullptr, p_data.data(), p_data.size(), p_options);
+  }
+
+  /**
+   * @brief Append a full duplex segment.
+   *
+   * @throws hal::argument_out_of_domain if the spans differ in size or the
+   * batch is full.
+   */
+  void exchange(std::span<const hal::byte> p_out,
+                std::span<hal::byte> p_in,
+                spi_segment_options p_options = {})
+  {
+    if (p_out.size() != p_in.size()) {
+      throw hal::argument_out_of_domain(this);
+    }
+    add(p_out.data(), p_in.data(), p_out.size(), p_options);
+  }
+
+  std::size_t size() const
+  {
+    return m_segments.size();
+  }
+
+  void clear()
+  {
+    m_segments.clear();
+  }
+
+private:
+  template<class syscalls>
+  friend class basic_spi;
+
+  void add(const hal::byte* p_out,
+           hal::byte* p_in,
+           std::size_t p_length,
+           spi_segment_options p_options)
+  {
+    if (m_segments.size() == max_segments || p_length > UINT32_MAX) {
+      throw hal::argument_out_of_domain(this);
+    }
+    // Fields are assigned one by one, the struct grew over kernel versions
+    spi_ioc_transfer segment{};
+    segment.tx_buf = reinterpret_cast<std::uintptr_t>(p_out);
+    segment.rx_buf = reinterpret_cast<std::uintptr_t>(p_in);
+    segment.len = static_cast<std::uint32_t>(p_length);
+    segment.speed_hz = p_options.speed_hz;
+    segment.delay_usecs = p_options.delay_us;
+    segment.cs_change = p_options.cs_change;
+    m_segments.push_back(segment);
+  }
+
+  std::vector<spi_ioc_transfer> m_segments;
+};
+
+/**
+ * @brief hal::spi over a spidev character device, /dev/spidevX.Y.
+ *
+ * Mode, clock rate and word size are cached, so configure() only issues the
+ * ioctls for what changed and transfers never reconfigure the device. Every
+ * transfer is a single SPI_IOC_MESSAGE ioctl.
+ *
+ * All kernel calls go through the syscalls policy, see
+ * hal::linux::posix_syscalls. Use the hal::linux::spi alias for real
+ * hardware.
+ */
+template<class syscalls>
+class basic_spi : public hal::spi
+{
+public:
+  /**
+   * @brief Open a spidev device and apply the initial settings.
+   * @param p_file_path Full path to the spidev character device.
+   * @param p_settings Initial bus settings.
+   *
+   * @throws hal::linux::invalid_character_device if the device could not be
+   * opened.
+   * @throws hal::linux::errno_exception if the device rejected the settings.
+   */
+  basic_spi(const std::string& p_file_path, const settings& p_settings = {})
+    : m_stats(p_file_path)
+  {
+    m_fd = syscalls::open(p_file_path.c_str(), O_RDWR | O_CLOEXEC);
+    if (m_fd < 0) {
+      throw hal::linux::invalid_character_device(p_file_path, errno, this);
+    }
+    try {
+      std::uint8_t bits_per_word = 8;
+      set(SPI_IOC_WR_BITS_PER_WORD, &bits_per_word);
+      driver_configure(p_settings);
+    } catch (...) {
+      syscalls::close(m_fd);
+      throw;
+    }
+  }
+
+  basic_spi(const basic_spi&) = delete;
+  basic_spi& operator=(const basic_spi&) = delete;
+
+  virtual ~basic_spi()
+  {
+    syscalls::close(m_fd);
+  }
+
+  /// File descriptor of the spidev device
+  int native_handle() const
+  {
+    return m_fd;
+  }
+
+  /// Counters of this device, empty unless built with
+  /// HAL_LINUX_INSTRUMENTATION
+  const driver_stats& stats() const
+  {
+    return m_stats;
+  }
+
+  using hal::spi::transfer;
+
+  /**
+   * @brief Send every segment of a batch as one SPI message.
+   *
+   * @throws hal::io_error if the controller rejected the message.
+   */
+  void transfer(spi_batch& p_batch)
+  {
+    if (p_batch.m_segments.empty()) {
+      return;
+    }
+    message(p_batch.m_segments);
+  }
+
+private:
+  void driver_configure(const settings& p_settings) override
+  {
+    std::uint32_t mode = 0;
+    if (p_settings.clock_idles_high) {
+      mode |= SPI_CPOL;
+    }
+    if (p_settings.data_valid_on_trailing_edge) {
+      mode |= SPI_CPHA;
+    }
+    auto speed = static_cast<std::uint32_t>(p_settings.clock_rate);
+    if (speed == 0) {
+      throw hal::argument_out_of_domain(this);
+    }
+
+    if (!m_configured || mode != m_mode) {
+      set(SPI_IOC_WR_MODE32, &mode);
+      m_mode = mode;
+    }
+    if (!m_configured || speed != m_speed) {
+      set(SPI_IOC_WR_MAX_SPEED_HZ, &speed);
+      m_speed = speed;
+    }
+    m_configured = true;
+  }
+
+  void driver_transfer(std::span<const hal::byte> p_data_out,
+                       std::span<hal::byte> p_data_in,
+                       hal::byte p_filler) override
+  {
+    const auto common = std::min(p_data_out.size(), p_data_in.size());
+    const auto length = std::max(p_data_out.size(), p_data_in.size());
+    if (length == 0) {
+      return;
+    }
+
+    // At most two segments under one chip select: the full duplex part,
+    // then the longer side on its own.
+    spi_ioc_transfer segments[2]{};
+    std::size_t count = 0;
+    if (common > 0) {
+      segments[count++] = segment(p_data_out.data(), p_data_in.data(), common);
+    }
+    if (p_data_out.size() > common) {
+      segments[count++] =
+        segment(p_data_out.data() + common, nullptr, length - common);
+    } else if (p_data_in.size() > common) {
+      // The read tail still has to clock out the filler byte
+      if (m_filler.size() < length - common || m_filler_value != p_filler) {
+        m_filler.assign(std::max(m_filler.size(), length - common), p_filler);
+        m_filler_value = p_filler;
+      }
+      segments[count++] =
+        segment(m_filler.data(), p_data_in.data() + common, length - common);
+    }
+    message({ segments, count });
+  }
+
+  static spi_ioc_transfer segment(const hal::byte* p_out,
+                                  hal::byte* p_in,
+                                  std::size_t p_length)
+  {
+    spi_ioc_transfer transfer{};
+    transfer.tx_buf = reinterpret_cast<std::uintptr_t>(p_out);
+    transfer.rx_buf = reinterpret_cast<std::uintptr_t>(p_in);
+    transfer.len = static_cast<std::uint32_t>(p_length);
+    return transfer;
+  }
+
+  // SPI_IOC_MESSAGE(N) only takes a constant N, build the request by hand
+  void message(std::span<spi_ioc_transfer> p_segments)
+  {
+    const unsigned long request =
+      _IOC(_IOC_WRITE, SPI_IOC_MAGIC, 0, SPI_MSGSIZE(p_segments.size()));
+    std::size_t bytes = 0;
+    for (const auto& segment : p_segments) {
+      bytes += segment.len;
+    }
+    auto operation = m_stats.measure(bytes);
+    if (syscalls::ioctl(m_fd, request, p_segments.data()) < 0) {
+      throw hal::io_error(this);
+    }
+  }
+
+  void set(unsigned long p_request, void* p_value)
+  {
+    if (syscalls::ioctl(m_fd, p_request, p_value) < 0) {
+      throw errno_exception(errno, std::errc::invalid_argument, this);
+    }
+  }
+
+  int m_fd = -1;
+  bool m_configured = false;
+  std::uint32_t m_mode = 0;
+  std::uint32_t m_speed = 0;
+  hal::byte m_filler_value = 0;
+  std::vector<hal::byte> m_filler;
+  [[no_unique_address]] driver_stats m_stats;
+};
+
+using spi = basic_spi<posix_syscalls>;
+}  // namespace hal::linux
@@ -2,12 +2,17 @@
 #include <chrono>
 #include <concepts>
 #include <cstdint>
-#include <cstdio>
+#include <ctime>
 #include <libhal/steady_clock.hpp>
 #include <libhal/units.hpp>
 #include <ratio>
 #include <type_traits>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
 namespace {
 template<typename T>
 concept Clock = requires
@@ -36,15 +41,11 @@ template<Clock C>
 class steady_clock : public hal::steady_clock
 {
 public:
-  steady_clock()
-  {
-    printf("Constructed\n");
-    std::chrono::time_point<C> res = C::now();
-  }
   constexpr hertz driver_frequency() override
   {
     using period = C::period;
-    double freq = period::den / period::num;
+    // Ticks per second, a period of 1/3 s ticks at 3 Hz, not 0 Hz
+    double freq = static_cast<double>(period::den) / period::num;
     return static_cast<hertz>(freq);
   }
 
@@ -54,4 +55,116 @@ public:
   }
 };
 
-}  // namespace hal::linux
\ No newline at end of file
+/**
+ * @brief Steady clock for hot paths that timestamp often.
+ *
+ * Reads CLOCK_MONOTONIC_RAW, which the vDSO serves without entering the
+ * kernel and which NTP never slews, at an exact 1 GHz tick rate.
+ *
+ * Optionally reads the architecture counter directly instead, skipping the
+ * vDSO bookkeeping: the TSC on x86, if the CPU reports it as invariant, and
+ * CNTVCT_EL0 on arm64. The arm64 counter frequency is exact, the TSC rate is
+ * calibrated against CLOCK_MONOTONIC_RAW on construction, which takes about
+ * 10ms. Without a usable counter the clock falls back to
+ * CLOCK_MONOTONIC_RAW.
+ */
+class raw_steady_clock : public hal::steady_clock
+{
+public:
+  /**
+   * @param p_use_counter Read the architecture counter when it is usable.
+   */
+  raw_steady_clock(bool p_use_counter = false)
+  {
+    if (p_use_counter) {
+      m_counter_frequency = counter_frequency();
+    }
+  }
+
+  /// True if uptime is read from the architecture counter
+  bool uses_counter() const
+  {
+    return m_counter_frequency > 0.0;
+  }
+
+private:
+  hertz driver_frequency() override
+  {
+    if (uses_counter()) {
+      return static_cast<hertz>(m_counter_frequency);
+    }
+    return 1'000'000'000.0f;
+  }
+
+  std::uint64_t driver_uptime() override
+  {
+    if (uses_counter()) {
+      return read_counter();
+    }
+    return monotonic_raw_ns();
+  }
+
+  static std::uint64_t monotonic_raw_ns()
+  {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    return static_cast<std::uint64_t>(now.tv_sec) * 1'000'000'000 +
+           static_cast<std::uint64_t>(now.tv_nsec);
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  static std::uint64_t read_counter()
+  {
+    return __rdtsc();
+  }
+
+  // Zero if the TSC may change rate or stop in deep sleep states
+  static double counter_frequency()
+  {
+    unsigned int eax = 0;
+    unsigned int ebx = 0;
+    unsigned int ecx = 0;
+    unsigned int edx = 0;
+    constexpr unsigned int invariant_tsc = 1 << 8;
+    if (!__get_cpuid(0x8000'0007, &eax, &ebx, &ecx, &edx) ||
+        !(edx & invariant_tsc)) {
+      return 0.0;
+    }
+    const auto start_ns = monotonic_raw_ns();
+    const auto start_ticks = read_counter();
+    timespec pause{ .tv_sec = 0, .tv_nsec = 10'000'000 };
+    nanosleep(&pause, nullptr);
+    const auto ticks = read_counter() - start_ticks;
+    const auto ns = monotonic_raw_ns() - start_ns;
+    return static_cast<double>(ticks) * 1e9 / static_cast<double>(ns);
+  }
+#elif defined(__aarch64__)
+  static std::uint64_t read_counter()
+  {
+    std::uint64_t ticks;
+    // Keep the read from being hoisted above earlier instructions
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(ticks)::"memory");
+    return ticks;
+  }
+
+  static double counter_frequency()
+  {
+    std::uint64_t frequency;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+    return static_cast<double>(frequency);
+  }
+#else
+  static std::uint64_t read_counter()
+  {
+    return monotonic_raw_ns();
+  }
+
+  static double counter_frequency()
+  {
+    return 0.0;
+  }
+#endif
+
+  double m_counter_frequency = 0.0;
+};
+}  // namespace hal::linux
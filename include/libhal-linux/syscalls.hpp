@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace hal::linux {
+/**
+ * @brief Syscall policy that goes straight to the kernel.
+ *
+ * Every driver is a basic_ template over a syscall policy and makes all of its
+ * device calls through it, resolved at compile time, so the usual aliases
+ * such as hal::linux::i2c cost exactly the direct call. Tests swap in
+ * hal::linux::simulated_syscalls or a policy of their own that records calls
+ * and fakes replies without any hardware. A policy provides these static
+ * functions with the same signatures and errno conventions.
+ *
+ * Descriptors handed out by a policy must be real file descriptors, as
+ * drivers still wait on them with poll and epoll.
+ */
+struct posix_syscalls
+{
+  static int open(const char* p_path, int p_flags)
+  {
+    return ::open(p_path, p_flags);
+  }
+
+  static int close(int p_fd)
+  {
+    return ::close(p_fd);
+  }
+
+  static int ioctl(int p_fd, unsigned long p_request, void* p_argument)
+  {
+    return ::ioctl(p_fd, p_request, p_argument);
+  }
+
+  /// For requests that take their argument by value, such as I2C_SLAVE
+  static int ioctl(int p_fd, unsigned long p_request, unsigned long p_value)
+  {
+    return ::ioctl(p_fd, p_request, p_value);
+  }
+
+  static ssize_t read(int p_fd, void* p_buffer, std::size_t p_size)
+  {
+    return ::read(p_fd, p_buffer, p_size);
+  }
+
+  static ssize_t write(int p_fd, const void* p_buffer, std::size_t p_size)
+  {
+    return ::write(p_fd, p_buffer, p_size);
+  }
+
+  static ssize_t writev(int p_fd, const iovec* p_vectors, int p_count)
+  {
+    return ::writev(p_fd, p_vectors, p_count);
+  }
+};
+}  // namespace hal::linux
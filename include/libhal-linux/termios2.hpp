@@ -0,0 +1,24 @@
+#pragma once
+#include <sys/ioctl.h>
+#include <termios.h>
+
+namespace hal::linux {
+/// Mirrors the kernel's struct termios2 from <asm/termbits.h>, which cannot be
+/// included next to glibc's <termios.h>. Matches the generic layout used by
+/// x86 and arm, where the kernel has 19 control characters.
+struct linux_termios2
+{
+  tcflag_t c_iflag;
+  tcflag_t c_oflag;
+  tcflag_t c_cflag;
+  tcflag_t c_lflag;
+  cc_t c_line;
+  cc_t c_cc[19];
+  speed_t c_ispeed;
+  speed_t c_ospeed;
+};
+
+constexpr unsigned long linux_tcsets2 = _IOW('T', 0x2B, linux_termios2);
+/// Baud rate is taken from c_ispeed/c_ospeed instead of the Bxxx constants
+constexpr tcflag_t linux_bother = 0010000;
+}  // namespace hal::linux
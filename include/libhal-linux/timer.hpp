@@ -0,0 +1,375 @@
+#pragma once
+#include "errors.hpp"
+#include "event_thread.hpp"
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <libhal/error.hpp>
+#include <libhal/timer.hpp>
+#include <libhal/units.hpp>
+#include <mutex>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace hal::linux {
+
+class timer;
+
+/**
+ * @brief Hierarchical timing wheel that drives any number of software timers
+ * from a single timerfd, serviced by the shared hal::linux::event_thread.
+ *
+ * Time is counted in ticks of a fixed resolution. The wheel has four levels
+ * of 64 slots, each level covering 64 times the span of the one below, so
+ * timers up to 2^24 ticks out are placed directly and longer ones ride the
+ * top level until they come in range. Scheduling and cancelling are O(1):
+ * a timer is linked into or unlinked from its slot. Occupancy bitmaps let the
+ * wheel arm the timerfd for the next slot that holds anything instead of
+ * waking up every tick.
+ *
+ * Callbacks run on the event thread with the wheel locked, so they must be
+ * short. They may schedule or cancel timers, including their own. Once
+ * cancel() returns on any other thread, the callback is not running.
+ */
+class timer_wheel
+{
+public:
+  /**
+   * @brief Wheel used by hal::linux::timer unless told otherwise, with a
+   * resolution of one millisecond.
+   */
+  static timer_wheel& shared()
+  {
+    static timer_wheel instance(std::chrono::milliseconds(1));
+    return instance;
+  }
+
+  /**
+   * @param p_resolution Length of a tick, delays are rounded up to it.
+   *
+   * @throws hal::argument_out_of_domain if p_resolution is not positive.
+   * @throws hal::linux::errno_exception if the timerfd could not be created
+   * or watched.
+   */
+  explicit timer_wheel(std::chrono::nanoseconds p_resolution)
+    : m_resolution_ns(p_resolution.count())
+  {
+    if (m_resolution_ns <= 0) {
+      throw hal::argument_out_of_domain(this);
+    }
+    m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (m_timer_fd < 0) {
+      throw errno_exception(errno, std::errc::too_many_files_open, this);
+    }
+    m_start_ns = now_ns();
+    try {
+      event_thread::shared().watch(
+        m_timer_fd, EPOLLIN, [this](std::uint32_t) { expire(); });
+    } catch (...) {
+      close(m_timer_fd);
+      throw;
+    }
+  }
+
+  timer_wheel(const timer_wheel&) = delete;
+  timer_wheel& operator=(const timer_wheel&) = delete;
+
+  /// Every timer using the wheel must be destroyed first
+  ~timer_wheel()
+  {
+    event_thread::shared().unwatch(m_timer_fd);
+    close(m_timer_fd);
+  }
+
+  /// Length of a tick
+  std::chrono::nanoseconds resolution() const
+  {
+    return std::chrono::nanoseconds(m_resolution_ns);
+  }
+
+  /// Timers currently scheduled
+  std::size_t size() const
+  {
+    std::lock_guard lock(m_lock);
+    return m_count;
+  }
+
+private:
+  friend class timer;
+
+  static constexpr int levels = 4;
+  static constexpr int slot_bits = 6;
+  static constexpr std::uint64_t slots = 1 << slot_bits;
+  static constexpr std::uint64_t slot_mask = slots - 1;
+  static constexpr std::uint64_t never = UINT64_MAX;
+  /// Level of timers that are due and about to run
+  static constexpr std::uint8_t firing_level = levels;
+
+  struct node
+  {
+    node* prev = nullptr;
+    node* next = nullptr;
+    std::uint64_t expiry = 0;
+    hal::callback<void(void)> callback;
+    bool linked = false;
+    std::uint8_t level = 0;
+    std::uint8_t slot = 0;
+  };
+
+  static std::int64_t now_ns()
+  {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1'000'000'000LL + now.tv_nsec;
+  }
+
+  std::uint64_t now_tick() const
+  {
+    return static_cast<std::uint64_t>((now_ns() - m_start_ns) /
+                                      m_resolution_ns);
+  }
+
+  void schedule(node& p_node,
+                hal::callback<void(void)> p_callback,
+                hal::time_duration p_delay)
+  {
+    std::lock_guard lock(m_lock);
+    if (p_node.linked) {
+      unlink(p_node);
+    }
+    const auto now = now_tick();
+    // Nothing can be due on an empty wheel, skip the idle stretch
+    if (m_count == 0) {
+      m_current = std::max(m_current, now);
+    }
+    const auto delay = std::max<std::int64_t>(p_delay.count(), 0);
+    const auto ticks = (delay + m_resolution_ns - 1) / m_resolution_ns;
+    // The current tick is already partly over, one more keeps timers from
+    // firing early
+    p_node.expiry = std::max(now, m_current) + ticks + 1;
+    p_node.callback = std::move(p_callback);
+    link(p_node);
+    arm();
+  }
+
+  void cancel(node& p_node)
+  {
+    std::lock_guard lock(m_lock);
+    if (p_node.linked) {
+      unlink(p_node);
+    }
+  }
+
+  bool is_linked(const node& p_node) const
+  {
+    std::lock_guard lock(m_lock);
+    return p_node.linked;
+  }
+
+  // Place a node by how far away it expires
+  void link(node& p_node)
+  {
+    const auto delta = p_node.expiry - m_current;
+    int level = 0;
+    while (level < levels - 1 && (delta >> (slot_bits * (level + 1))) != 0) {
+      level++;
+    }
+    const auto slot = (p_node.expiry >> (slot_bits * level)) & slot_mask;
+    auto& head = m_slots[level][slot];
+    p_node.prev = nullptr;
+    p_node.next = head;
+    if (head) {
+      head->prev = &p_node;
+    }
+    head = &p_node;
+    p_node.level = static_cast<std::uint8_t>(level);
+    p_node.slot = static_cast<std::uint8_t>(slot);
+    p_node.linked = true;
+    m_occupied[level] |= std::uint64_t{ 1 } << slot;
+    m_count++;
+  }
+
+  void unlink(node& p_node)
+  {
+    const bool firing = p_node.level == firing_level;
+    auto& head = firing ? m_firing : m_slots[p_node.level][p_node.slot];
+    if (p_node.prev) {
+      p_node.prev->next = p_node.next;
+    } else {
+      head = p_node.next;
+    }
+    if (p_node.next) {
+      p_node.next->prev = p_node.prev;
+    }
+    if (!head && !firing) {
+      m_occupied[p_node.level] &= ~(std::uint64_t{ 1 } << p_node.slot);
+    }
+    p_node.linked = false;
+    m_count--;
+  }
+
+  // First tick after m_current at which an occupied slot comes due. A slot
+  // above level 0 comes due when the block of ticks it covers begins.
+  std::uint64_t next_event() const
+  {
+    auto next = never;
+    for (int level = 0; level < levels; level++) {
+      if (!m_occupied[level]) {
+        continue;
+      }
+      const auto shift = slot_bits * level;
+      const auto block = m_current >> shift;
+      const auto rotation = static_cast<int>((block + 1) & slot_mask);
+      const auto ahead = std::rotr(m_occupied[level], rotation);
+      const auto offset = static_cast<std::uint64_t>(std::countr_zero(ahead));
+      next = std::min(next, (block + 1 + offset) << shift);
+    }
+    return next;
+  }
+
+  // Fire and cascade everything due up to p_now, jumping over empty ticks
+  void advance(std::uint64_t p_now)
+  {
+    while (m_current < p_now) {
+      const auto next = next_event();
+      if (next > p_now) {
+        m_current = p_now;
+        return;
+      }
+      m_current = next;
+      for (int level = levels - 1; level > 0; level--) {
+        const auto shift = slot_bits * level;
+        if ((m_current & ((std::uint64_t{ 1 } << shift) - 1)) == 0) {
+          cascade(level, (m_current >> shift) & slot_mask);
+        }
+      }
+      fire(m_current & slot_mask);
+    }
+  }
+
+  // Move every timer of a higher level slot down to where it now belongs
+  void cascade(int p_level, std::uint64_t p_slot)
+  {
+    auto* entry = m_slots[p_level][p_slot];
+    m_slots[p_level][p_slot] = nullptr;
+    m_occupied[p_level] &= ~(std::uint64_t{ 1 } << p_slot);
+    while (entry) {
+      auto* next = entry->next;
+      m_count--;
+      link(*entry);
+      entry = next;
+    }
+  }
+
+  void fire(std::uint64_t p_slot)
+  {
+    // Callbacks may link timers back into this very slot for a later lap, so
+    // the due timers move to a list of their own first. They stay linked
+    // there, so cancelling one that has not run yet still works.
+    m_firing = m_slots[0][p_slot];
+    m_slots[0][p_slot] = nullptr;
+    m_occupied[0] &= ~(std::uint64_t{ 1 } << p_slot);
+    for (auto* entry = m_firing; entry; entry = entry->next) {
+      entry->level = firing_level;
+    }
+    while (m_firing) {
+      auto* entry = m_firing;
+      unlink(*entry);
+      try {
+        entry->callback();
+      } catch (...) {
+        // A failing callback must not stop the other timers
+      }
+    }
+  }
+
+  // Program the timerfd for the next event if that moved earlier
+  void arm()
+  {
+    const auto next = next_event();
+    if (next >= m_armed) {
+      return;
+    }
+    m_armed = next;
+    const auto at_ns = m_start_ns + static_cast<std::int64_t>(next) *
+                                      m_resolution_ns;
+    itimerspec when{};
+    when.it_value.tv_sec = at_ns / 1'000'000'000;
+    when.it_value.tv_nsec = at_ns % 1'000'000'000;
+    timerfd_settime(m_timer_fd, TFD_TIMER_ABSTIME, &when, nullptr);
+  }
+
+  // Runs on the event thread
+  void expire()
+  {
+    std::uint64_t discard;
+    [[maybe_unused]] auto res = read(m_timer_fd, &discard, sizeof(discard));
+    std::lock_guard lock(m_lock);
+    m_armed = never;
+    advance(now_tick());
+    arm();
+  }
+
+  std::int64_t m_resolution_ns;
+  std::int64_t m_start_ns = 0;
+  int m_timer_fd = -1;
+  // Recursive so callbacks can schedule and cancel timers
+  mutable std::recursive_mutex m_lock;
+  std::uint64_t m_current = 0;
+  std::uint64_t m_armed = never;
+  std::size_t m_count = 0;
+  node* m_firing = nullptr;
+  std::array<std::uint64_t, levels> m_occupied{};
+  std::array<std::array<node*, slots>, levels> m_slots{};
+};
+
+/**
+ * @brief hal::timer backed by a hal::linux::timer_wheel. Costs no thread and
+ * no file descriptor of its own, so thousands of them are cheap.
+ *
+ * Callbacks run on the shared event thread.
+ */
+class timer : public hal::timer
+{
+public:
+  /**
+   * @param p_wheel Wheel to schedule on, must outlive the timer.
+   */
+  timer(timer_wheel& p_wheel = timer_wheel::shared())
+    : m_wheel(&p_wheel)
+  {
+  }
+
+  timer(const timer&) = delete;
+  timer& operator=(const timer&) = delete;
+
+  virtual ~timer()
+  {
+    driver_cancel();
+  }
+
+private:
+  bool driver_is_running() override
+  {
+    return m_wheel->is_linked(m_node);
+  }
+
+  void driver_cancel() override
+  {
+    m_wheel->cancel(m_node);
+  }
+
+  void driver_schedule(hal::callback<void(void)> p_callback,
+                       hal::time_duration p_delay) override
+  {
+    m_wheel->schedule(m_node, std::move(p_callback), p_delay);
+  }
+
+  timer_wheel* m_wheel;
+  timer_wheel::node m_node;
+};
+}  // namespace hal::linux
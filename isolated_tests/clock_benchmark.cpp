@@ -0,0 +1,46 @@
+#include "../include/libhal-linux/steady_clock.hpp"
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+using namespace std;
+
+// Average cost of one call to p_read over many calls, in nanoseconds
+template<typename F>
+double ns_per_call(F&& p_read)
+{
+  constexpr int calls = 10'000'000;
+  std::uint64_t sink = 0;
+  const auto start = chrono::steady_clock::now();
+  for (int i = 0; i < calls; i++) {
+    sink += p_read();
+  }
+  const auto end = chrono::steady_clock::now();
+  // Keep the reads from being optimized away
+  if (sink == 42) {
+    cout << "";
+  }
+  return chrono::duration<double, nano>(end - start).count() / calls;
+}
+
+int main()
+{
+  auto chrono_clock = hal::linux::steady_clock<chrono::steady_clock>();
+  auto raw_clock = hal::linux::raw_steady_clock();
+  auto counter_clock = hal::linux::raw_steady_clock(true);
+
+  cout << "std::chrono::steady_clock::now: " << ns_per_call([] {
+    return chrono::steady_clock::now().time_since_epoch().count();
+  }) << " ns\n";
+  cout << "steady_clock<chrono::steady_clock>: "
+       << ns_per_call([&] { return chrono_clock.uptime(); }) << " ns @ "
+       << chrono_clock.frequency() << " Hz\n";
+  cout << "raw_steady_clock: "
+       << ns_per_call([&] { return raw_clock.uptime(); }) << " ns @ "
+       << raw_clock.frequency() << " Hz\n";
+  cout << "raw_steady_clock(counter"
+       << (counter_clock.uses_counter() ? "" : ", unavailable") << "): "
+       << ns_per_call([&] { return counter_clock.uptime(); }) << " ns @ "
+       << counter_clock.frequency() << " Hz\n";
+  return 0;
+}
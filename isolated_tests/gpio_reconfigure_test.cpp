@@ -0,0 +1,61 @@
+// Reconfiguring one line of a shared line request must leave the levels of
+// the other output lines alone. Runs on the simulated kernel, no hardware.
+
+#include "../include/libhal-linux/gpio_chip.hpp"
+#include "../include/libhal-linux/output_pin.hpp"
+#include "../include/libhal-linux/output_port.hpp"
+#include "../include/libhal-linux/simulated_kernel.hpp"
+#include <cstdint>
+#include <cstdio>
+
+using namespace hal::linux;
+using sim = simulated_syscalls;
+
+namespace {
+int failures = 0;
+
+void check(bool p_condition, const char* p_what)
+{
+  if (!p_condition) {
+    std::printf("FAIL: %s\n", p_what);
+    failures++;
+  }
+}
+}  // namespace
+
+int main()
+{
+  auto& kernel = simulated_kernel::instance();
+  kernel.add_gpio_chip("/sim/gpiochip0", 32);
+
+  {
+    const std::uint16_t pins[] = { 4, 5, 6, 7 };
+    auto port = basic_output_port<sim>("/sim/gpiochip0", pins);
+    port.level(0b1011);
+    port.configure(2, { .resistor = hal::pin_resistor::pull_up });
+    check(kernel.line_level("/sim/gpiochip0", 4), "port bit 0 stays high");
+    check(kernel.line_level("/sim/gpiochip0", 5), "port bit 1 stays high");
+    check(!kernel.line_level("/sim/gpiochip0", 6), "port bit 2 stays low");
+    check(kernel.line_level("/sim/gpiochip0", 7), "port bit 3 stays high");
+    check(port.level() == 0b1011, "port reads back its levels");
+  }
+
+  {
+    auto batch = basic_line_batch<sim>("/sim/gpiochip0");
+    auto first = basic_output_pin<sim>(batch, 10);
+    auto second = basic_output_pin<sim>(batch, 11);
+    batch.commit();
+    first.level(true);
+    second.level(true);
+    second.configure({ .open_drain = true });
+    check(kernel.line_level("/sim/gpiochip0", 10),
+          "batch neighbour stays high");
+    check(kernel.line_level("/sim/gpiochip0", 11),
+          "reconfigured pin stays high");
+  }
+
+  if (failures == 0) {
+    std::printf("gpio reconfigure: all checks passed\n");
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,265 @@
+// Checks what hal::linux::spi asks of spidev, through the recording syscall
+// policy. Runs without any SPI hardware.
+
+#include "../include/libhal-linux/recording_syscalls.hpp"
+#include "../include/libhal-linux/spi.hpp"
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+using namespace hal::linux;
+using test_spi = basic_spi<recording_syscalls>;
+
+namespace {
+int failures = 0;
+
+void check(bool p_condition, const char* p_what)
+{
+  if (!p_condition) {
+    std::printf("FAIL: %s\n", p_what);
+    failures++;
+  }
+}
+
+syscall_recorder& recorder()
+{
+  return syscall_recorder::instance();
+}
+
+std::size_t count(unsigned long p_request)
+{
+  return recorder().ioctls(p_request).size();
+}
+
+std::uint32_t u32(const syscall_recorder::call& p_call)
+{
+  std::uint32_t value = 0;
+  std::memcpy(&value, p_call.data.data(), sizeof(value));
+  return value;
+}
+
+// Segments of the only SPI message recorded since the last clear()
+std::vector<spi_ioc_transfer> message(std::size_t p_segments)
+{
+  const auto messages = recorder().ioctls(SPI_IOC_MESSAGE(p_segments));
+  std::vector<spi_ioc_transfer> segments;
+  if (messages.size() != 1) {
+    return segments;
+  }
+  segments.resize(p_segments);
+  std::memcpy(
+    segments.data(), messages[0].data.data(), messages[0].data.size());
+  return segments;
+}
+
+void settings_are_cached()
+{
+  recorder().reset();
+  auto spi = test_spi("/dev/spidev0.0", { .clock_rate = 1'000'000.0f });
+  check(count(SPI_IOC_WR_BITS_PER_WORD) == 1, "word size set on open");
+  check(count(SPI_IOC_WR_MODE32) == 1, "mode set on open");
+  check(count(SPI_IOC_WR_MAX_SPEED_HZ) == 1, "speed set on open");
+  const auto speed = recorder().ioctls(SPI_IOC_WR_MAX_SPEED_HZ);
+  check(!speed.empty() && u32(speed[0]) == 1'000'000, "speed value");
+
+  recorder().clear();
+  spi.configure({ .clock_rate = 1'000'000.0f });
+  check(recorder().calls().empty(), "same settings issue no ioctl");
+
+  spi.configure({ .clock_rate = 2'000'000.0f });
+  check(count(SPI_IOC_WR_MAX_SPEED_HZ) == 1, "new speed is set");
+  check(count(SPI_IOC_WR_MODE32) == 0, "mode untouched by speed change");
+
+  recorder().clear();
+  spi.configure({ .clock_rate = 2'000'000.0f,
+                  .clock_idles_high = true,
+                  .data_valid_on_trailing_edge = true });
+  const auto mode = recorder().ioctls(SPI_IOC_WR_MODE32);
+  check(mode.size() == 1 && u32(mode[0]) == (SPI_CPOL | SPI_CPHA),
+        "new mode is set");
+  check(count(SPI_IOC_WR_MAX_SPEED_HZ) == 0, "speed untouched by mode");
+
+  recorder().clear();
+  const std::array<hal::byte, 4> out = { 1, 2, 3, 4 };
+  std::array<hal::byte, 4> in{};
+  spi.transfer(out, in);
+  check(count(SPI_IOC_WR_BITS_PER_WORD) == 0, "word size never set again");
+  check(recorder().calls().size() == 1, "one ioctl per transfer");
+}
+
+void transfers_are_packed()
+{
+  recorder().reset();
+  auto spi = test_spi("/dev/spidev0.0");
+
+  recorder().clear();
+  const std::array<hal::byte, 4> out = { 1, 2, 3, 4 };
+  std::array<hal::byte, 4> in{};
+  spi.transfer(out, in);
+  auto segments = message(1);
+  check(segments.size() == 1 && segments[0].len == 4 &&
+          segments[0].tx_buf == reinterpret_cast<std::uintptr_t>(out.data()) &&
+          segments[0].rx_buf == reinterpret_cast<std::uintptr_t>(in.data()),
+        "full duplex is one segment");
+  check(segments.size() == 1 && segments[0].cs_change == 0,
+        "chip select released after a transfer");
+
+  recorder().clear();
+  std::array<hal::byte, 5> longer{};
+  spi.transfer(std::span(out).first(2), longer, 0xA5);
+  segments = message(2);
+  check(segments.size() == 2, "short write, long read is two segments");
+  if (segments.size() == 2) {
+    check(segments[0].len == 2 && segments[1].len == 3, "segment lengths");
+    check(segments[1].rx_buf ==
+            reinterpret_cast<std::uintptr_t>(longer.data() + 2),
+          "read tail lands after the duplex part");
+    const auto* filler =
+      reinterpret_cast<const hal::byte*>(segments[1].tx_buf);
+    check(filler && filler[0] == 0xA5 && filler[1] == 0xA5 &&
+            filler[2] == 0xA5,
+          "read tail clocks out the filler");
+    check(segments[0].cs_change == 0 && segments[1].cs_change == 0,
+          "chip select held across the segments");
+  }
+
+  recorder().clear();
+  spi.transfer({}, longer, 0x00);
+  segments = message(1);
+  if (segments.size() == 1) {
+    const auto* filler = reinterpret_cast<const hal::byte*>(segments[0].tx_buf);
+    check(filler && filler[0] == 0x00 && filler[4] == 0x00,
+          "filler follows the requested value");
+  } else {
+    check(false, "read only is one segment");
+  }
+
+  recorder().clear();
+  spi.transfer(out, {});
+  segments = message(1);
+  check(segments.size() == 1 && segments[0].rx_buf == 0 &&
+          segments[0].len == 4,
+        "write only ignores the input");
+
+  recorder().clear();
+  spi.transfer({}, {});
+  check(recorder().calls().empty(), "empty transfer issues no ioctl");
+}
+
+void batches_are_one_message()
+{
+  recorder().reset();
+  auto spi = test_spi("/dev/spidev0.0");
+  recorder().clear();
+
+  const std::array<hal::byte, 3> command = { 0x2A, 0x00, 0x7F };
+  std::array<hal::byte, 8> pixels{};
+  std::array<hal::byte, 2> status{};
+  spi_batch batch;
+  batch.write(command);
+  batch.write(pixels, { .delay_us = 5, .speed_hz = 4'000'000 });
+  batch.read(status, { .cs_change = true });
+  spi.transfer(batch);
+
+  const auto segments = message(3);
+  check(segments.size() == 3, "three segments in one SPI_IOC_MESSAGE(3)");
+  check(recorder().calls().size() == 1, "one ioctl per batch");
+  if (segments.size() == 3) {
+    check(segments[0].len == 3 && segments[0].rx_buf == 0, "write segment");
+    check(segments[1].delay_usecs == 5 && segments[1].speed_hz == 4'000'000,
+          "per segment delay and speed");
+    check(segments[2].tx_buf == 0 &&
+            segments[2].rx_buf ==
+              reinterpret_cast<std::uintptr_t>(status.data()),
+          "read segment");
+    check(segments[0].cs_change == 0 && segments[1].cs_change == 0 &&
+            segments[2].cs_change == 1,
+          "cs_change only where asked, here on the last segment");
+  }
+
+  recorder().clear();
+  batch.clear();
+  for (int i = 0; i < 20; i++) {
+    batch.write(command);
+  }
+  spi.transfer(batch);
+  const auto request =
+    _IOC(_IOC_WRITE, SPI_IOC_MAGIC, 0, SPI_MSGSIZE(20));
+  check(count(request) == 1 && request == SPI_IOC_MESSAGE(20),
+        "request matches SPI_IOC_MESSAGE(20)");
+
+  recorder().clear();
+  batch.clear();
+  spi.transfer(batch);
+  check(recorder().calls().empty(), "empty batch issues no ioctl");
+}
+
+void errors_are_mapped()
+{
+  recorder().reset();
+  recorder().fail_open(ENOENT);
+  try {
+    auto spi = test_spi("/dev/spidev9.9");
+    check(false, "open failure throws");
+  } catch (const invalid_character_device& p_error) {
+    check(p_error.m_saved_errno == ENOENT, "open failure keeps errno");
+  }
+
+  recorder().reset();
+  auto spi = test_spi("/dev/spidev0.0", { .clock_rate = 1'000'000.0f });
+  recorder().on_ioctl([](int, unsigned long p_request, void*) {
+    if (p_request == SPI_IOC_WR_MAX_SPEED_HZ) {
+      errno = EINVAL;
+      return -1;
+    }
+    if (_IOC_TYPE(p_request) == SPI_IOC_MAGIC && _IOC_NR(p_request) == 0) {
+      errno = EIO;
+      return -1;
+    }
+    return 0;
+  });
+
+  try {
+    spi.configure({ .clock_rate = 50'000'000.0f });
+    check(false, "rejected speed throws");
+  } catch (const errno_exception& p_error) {
+    check(p_error.m_saved_errno == EINVAL, "rejected speed keeps errno");
+  }
+  recorder().clear();
+  try {
+    spi.configure({ .clock_rate = 50'000'000.0f });
+  } catch (const errno_exception&) {
+  }
+  check(count(SPI_IOC_WR_MAX_SPEED_HZ) == 1,
+        "rejected speed is not cached, configure retries it");
+
+  try {
+    spi.configure({ .clock_rate = 0.0f });
+    check(false, "zero clock rate throws");
+  } catch (const hal::argument_out_of_domain&) {
+  }
+
+  const std::array<hal::byte, 2> out = { 1, 2 };
+  try {
+    spi.transfer(out, {});
+    check(false, "failed message throws");
+  } catch (const hal::io_error&) {
+  }
+  recorder().reset();
+}
+}  // namespace
+
+int main()
+{
+  settings_are_cached();
+  transfers_are_packed();
+  batches_are_one_message();
+  errors_are_mapped();
+  if (failures == 0) {
+    std::printf("spi: all checks passed\n");
+  }
+  return failures == 0 ? 0 : 1;
+}